@@ -0,0 +1,208 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <string.h>
+#include <algorithm>
+#include "aggregate.h"
+
+namespace zdb {
+
+/* the vector kernels are written once with gcc vector extensions and compiled
+   for each instruction set by instantiating them with the vector width inside
+   a function that has the matching target attribute */
+template <typename T, size_t kBytes>
+static inline __attribute__((always_inline))
+typename sum_type<T>::type sum_vector(const T* values, size_t count) {
+  using S = typename sum_type<T>::type;
+  static const size_t kLanes = kBytes / sizeof(S);
+  typedef S svec __attribute__((vector_size(kBytes)));
+  typedef T tvec __attribute__((vector_size(kLanes * sizeof(T))));
+
+  /* values are widened to the sum type before they are added */
+  svec acc = {};
+  size_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    tvec v;
+    memcpy(&v, values + i, sizeof(v));
+    acc += __builtin_convertvector(v, svec);
+  }
+
+  S sum = 0;
+  for (size_t j = 0; j < kLanes; ++j) {
+    sum += acc[j];
+  }
+
+  for (; i < count; ++i) {
+    sum += values[i];
+  }
+
+  return sum;
+}
+
+template <typename T, size_t kBytes, bool kMax>
+static inline __attribute__((always_inline))
+T minmax_vector(const T* values, size_t count, T m) {
+  static const size_t kLanes = kBytes / sizeof(T);
+  typedef T tvec __attribute__((vector_size(kBytes)));
+
+  /* every lane starts from m rather than from the first values so that a NaN
+     never becomes a lane's accumulator: comparisons with NaN are false, so
+     NaN values are skipped as long as the accumulators aren't NaN */
+  size_t i = 0;
+  if (count >= kLanes) {
+    tvec acc;
+    for (size_t j = 0; j < kLanes; ++j) {
+      acc[j] = m;
+    }
+
+    for (; i + kLanes <= count; i += kLanes) {
+      tvec v;
+      memcpy(&v, values + i, sizeof(v));
+      acc = kMax ? (acc < v ? v : acc) : (v < acc ? v : acc);
+    }
+
+    for (size_t j = 0; j < kLanes; ++j) {
+      m = kMax ? (m < acc[j] ? acc[j] : m) : (acc[j] < m ? acc[j] : m);
+    }
+  }
+
+  for (; i < count; ++i) {
+    if (kMax ? m < values[i] : values[i] < m) {
+      m = values[i];
+    }
+  }
+
+  return m;
+}
+
+template <typename T>
+static void sum_scalar(
+    const T* values,
+    size_t count,
+    typename sum_type<T>::type* sum) {
+  typename sum_type<T>::type s = 0;
+  for (size_t i = 0; i < count; ++i) {
+    s += values[i];
+  }
+
+  *sum += s;
+}
+
+template <typename T>
+static void min_scalar(const T* values, size_t count, T* min) {
+  auto m = *min;
+  for (size_t i = 0; i < count; ++i) {
+    m = values[i] < m ? values[i] : m;
+  }
+
+  *min = m;
+}
+
+template <typename T>
+static void max_scalar(const T* values, size_t count, T* max) {
+  auto m = *max;
+  for (size_t i = 0; i < count; ++i) {
+    m = m < values[i] ? values[i] : m;
+  }
+
+  *max = m;
+}
+
+#if defined(__x86_64__)
+
+template <typename T>
+static void sum_sse2(
+    const T* values,
+    size_t count,
+    typename sum_type<T>::type* sum) {
+  *sum += sum_vector<T, 16>(values, count);
+}
+
+template <typename T>
+static void min_sse2(const T* values, size_t count, T* min) {
+  *min = minmax_vector<T, 16, false>(values, count, *min);
+}
+
+template <typename T>
+static void max_sse2(const T* values, size_t count, T* max) {
+  *max = minmax_vector<T, 16, true>(values, count, *max);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void sum_avx2(
+    const T* values,
+    size_t count,
+    typename sum_type<T>::type* sum) {
+  *sum += sum_vector<T, 32>(values, count);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void min_avx2(const T* values, size_t count, T* min) {
+  *min = minmax_vector<T, 32, false>(values, count, *min);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+static void max_avx2(const T* values, size_t count, T* max) {
+  *max = minmax_vector<T, 32, true>(values, count, *max);
+}
+
+#endif
+
+template <typename T>
+const aggregate_kernels<T>& get_aggregate_kernels(simd_level level) {
+  static const aggregate_kernels<T> scalar = {
+    &sum_scalar<T>,
+    &min_scalar<T>,
+    &max_scalar<T>
+  };
+
+#if defined(__x86_64__)
+  static const aggregate_kernels<T> sse2 = {
+    &sum_sse2<T>,
+    &min_sse2<T>,
+    &max_sse2<T>
+  };
+
+  static const aggregate_kernels<T> avx2 = {
+    &sum_avx2<T>,
+    &min_avx2<T>,
+    &max_avx2<T>
+  };
+#endif
+
+  switch (std::min(level, simd_detect())) {
+#if defined(__x86_64__)
+    case SIMD_AVX2: return avx2;
+    case SIMD_SSE2: return sse2;
+#endif
+    default: return scalar;
+  }
+}
+
+template <typename T>
+const aggregate_kernels<T>& get_aggregate_kernels() {
+  return get_aggregate_kernels<T>(simd_detect());
+}
+
+#define ZDB_AGGREGATE_KERNELS(T) \
+    template const aggregate_kernels<T>& get_aggregate_kernels<T>( \
+        simd_level level); \
+    template const aggregate_kernels<T>& get_aggregate_kernels<T>();
+
+ZDB_AGGREGATE_KERNELS(uint8_t)
+ZDB_AGGREGATE_KERNELS(uint32_t)
+ZDB_AGGREGATE_KERNELS(uint64_t)
+ZDB_AGGREGATE_KERNELS(int32_t)
+ZDB_AGGREGATE_KERNELS(int64_t)
+ZDB_AGGREGATE_KERNELS(float)
+ZDB_AGGREGATE_KERNELS(double)
+
+} // namespace zdb
+
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include "zdb.h"
+#include "simd.h"
+
+namespace zdb {
+
+/* sums are accumulated as int64 for signed columns, as uint64 for unsigned
+   and bool columns and as double for float columns */
+template <typename T>
+struct sum_type {
+  using type = int64_t;
+};
+
+template <> struct sum_type<uint8_t> { using type = uint64_t; };
+template <> struct sum_type<uint32_t> { using type = uint64_t; };
+template <> struct sum_type<uint64_t> { using type = uint64_t; };
+template <> struct sum_type<float> { using type = double; };
+template <> struct sum_type<double> { using type = double; };
+
+/**
+ * Kernels that aggregate a contiguous array of column values. sum adds the
+ * values to *sum. min and max fold the values into *min or *max, which must
+ * be initialized by the caller to a value that is not NaN. NaN values are
+ * skipped.
+ */
+template <typename T>
+struct aggregate_kernels {
+  using sum_type = typename zdb::sum_type<T>::type;
+  void (*sum)(const T* values, size_t count, sum_type* sum);
+  void (*min)(const T* values, size_t count, T* min);
+  void (*max)(const T* values, size_t count, T* max);
+};
+
+/* returns the kernels for the given instruction set or, if the cpu doesn't
+   support it, for the best one it does support */
+template <typename T>
+const aggregate_kernels<T>& get_aggregate_kernels(simd_level level);
+
+template <typename T>
+const aggregate_kernels<T>& get_aggregate_kernels();
+
+} // namespace zdb
+
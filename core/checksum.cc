@@ -0,0 +1,44 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include "checksum.h"
+
+namespace tsdb {
+
+namespace {
+
+struct CRC32Table {
+  CRC32Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (0xedb88320U ^ (c >> 1)) : (c >> 1);
+      }
+
+      table[i] = c;
+    }
+  }
+
+  uint32_t table[256];
+};
+
+} // namespace
+
+uint32_t computeCRC32(const void* data, size_t len) {
+  static const CRC32Table crc_table;
+
+  auto cur = (const unsigned char*) data;
+  uint32_t crc = 0xffffffffU;
+  for (size_t i = 0; i < len; ++i) {
+    crc = crc_table.table[(crc ^ cur[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc ^ 0xffffffffU;
+}
+
+} // namespace tsdb
+
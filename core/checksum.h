@@ -0,0 +1,20 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+
+namespace tsdb {
+
+/**
+ * Compute the CRC-32 (IEEE 802.3 polynomial) of a buffer
+ */
+uint32_t computeCRC32(const void* data, size_t len);
+
+} // namespace tsdb
+
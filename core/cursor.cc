@@ -5,39 +5,81 @@
  * This file is part of the "libzdb" project. libzdb is free software licensed
  * under the 3-Clause BSD License (BSD-3-Clause).
  */
-#include "cursor.h"
+#include "tsdb_cursor.h"
 #include "page_index.h"
 #include "assert.h"
+#include <algorithm>
 
 namespace tsdb {
 
+/* pages are merged with a neighbour once their encoded size drops below
+   1/kPageMergeFactor of the split size */
+static const size_t kPageMergeFactor = 4;
+
+/* returns the position of the first value in the page with a timestamp that
+   is greater or equal (or strictly greater if upper is true) */
+static size_t findValue(
+    const PageBuffer& page,
+    uint64_t timestamp,
+    bool upper) {
+  size_t low = 0;
+  size_t high = page.getSize();
+  while (low < high) {
+    auto mid = (low + high) / 2;
+    uint64_t mid_timestamp;
+    page.getTimestamp(mid, &mid_timestamp);
+    if (mid_timestamp < timestamp || (upper && mid_timestamp == timestamp)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
 Cursor::Cursor() :
     page_pos_(0),
     page_id_(-1),
     page_map_(nullptr),
     page_buf_(),
     page_buf_valid_(false),
-    page_buf_pos_(0) {}
+    page_buf_pos_(0),
+    page_split_size_(0),
+    caching_(true),
+    readahead_(0),
+    readahead_end_(0) {}
 
 Cursor::Cursor(
     PageMap* page_map,
-    Transaction&& txn) :
+    Transaction&& txn,
+    size_t page_split_size) :
     txn_(std::move(txn)),
+    index_(txn_.getPageIndex()->getVersion()),
     page_pos_(0),
     page_id_(-1),
     page_map_(page_map),
     page_buf_(),
     page_buf_valid_(false),
-    page_buf_pos_(0) {}
+    page_buf_pos_(0),
+    page_split_size_(page_split_size),
+    caching_(true),
+    readahead_(0),
+    readahead_end_(0) {}
 
 Cursor::Cursor(Cursor&& o) :
     txn_(std::move(o.txn_)),
+    index_(std::move(o.index_)),
     page_pos_(o.page_pos_),
     page_id_(o.page_id_),
     page_map_(o.page_map_),
     page_buf_(std::move(o.page_buf_)),
     page_buf_valid_(o.page_buf_valid_),
-    page_buf_pos_(o.page_buf_pos_) {
+    page_buf_pos_(o.page_buf_pos_),
+    page_split_size_(o.page_split_size_),
+    caching_(o.caching_),
+    readahead_(o.readahead_),
+    readahead_end_(o.readahead_end_) {
   o.page_pos_ = 0;
   o.page_id_ = -1;
   o.page_map_ = nullptr;
@@ -47,12 +89,17 @@ Cursor::Cursor(Cursor&& o) :
 
 Cursor& Cursor::operator=(Cursor&& o) {
   txn_ = std::move(o.txn_);
+  index_ = std::move(o.index_);
   page_pos_ = o.page_pos_;
   page_id_ = o.page_id_;
   page_map_ = o.page_map_;
   page_buf_ = std::move(o.page_buf_);
   page_buf_valid_ = o.page_buf_valid_;
   page_buf_pos_ = o.page_buf_pos_;
+  page_split_size_ = o.page_split_size_;
+  caching_ = o.caching_;
+  readahead_ = o.readahead_;
+  readahead_end_ = o.readahead_end_;
 
   o.page_pos_ = 0;
   o.page_id_ = -1;
@@ -63,22 +110,22 @@ Cursor& Cursor::operator=(Cursor&& o) {
 }
 
 bool Cursor::valid() {
-  return page_map_ && page_buf_valid_ && page_buf_pos_ < page_buf_.getSize();
+  return page_map_ && page_buf_valid_ && page_buf_pos_ < page_buf_->getSize();
 }
 
 void Cursor::get(uint64_t* timestamp, void* value, size_t value_len) {
-  page_buf_.getTimestamp(page_buf_pos_, timestamp);
-  page_buf_.getValue(page_buf_pos_, value, value_len);
+  page_buf_->getTimestamp(page_buf_pos_, timestamp);
+  page_buf_->getValue(page_buf_pos_, value, value_len);
 }
 
 uint64_t Cursor::getTime() {
   uint64_t timestamp;
-  page_buf_.getTimestamp(page_buf_pos_, &timestamp);
+  page_buf_->getTimestamp(page_buf_pos_, &timestamp);
   return timestamp;
 }
 
 void Cursor::getValue(void* value, size_t value_len) {
-  page_buf_.getValue(page_buf_pos_, value, value_len);
+  page_buf_->getValue(page_buf_pos_, value, value_len);
 }
 
 bool Cursor::next(uint64_t* timestamp, void* value, size_t value_len) {
@@ -96,63 +143,31 @@ bool Cursor::seekTo(uint64_t timestamp) {
     return false;
   }
 
-  /* search for the correct page */
-  auto page_idx = txn_.getPageIndex();
-  page_pos_ = 0; // FIXME: binary search for the correct page
-  page_id_ = page_idx->getEntries()[page_pos_].page_id;
-
-  /* load the page */
-  if (page_map_->getPage(page_id_, &page_buf_)) {
-    page_buf_valid_ = true;
-  } else {
-    page_buf_valid_ = false;
+  /* search for the correct page in the current version of the index */
+  index_ = txn_.getPageIndex()->getVersion();
+  if (!openPage(index_->findPage(timestamp))) {
     return false;
   }
 
-  /* search for the correct slot in the page */
-  if (timestamp == 0) {
-    page_buf_pos_ = 0;
+  /* search for the correct slot in the page. if all values in the page are
+     smaller, the first value of the next page is the one we're looking for */
+  page_buf_pos_ = findValue(*page_buf_, timestamp, false);
+  if (page_buf_pos_ < page_buf_->getSize()) {
     return true;
   }
 
-  {
-    uint64_t high = page_buf_.getSize();
-    uint64_t low = 0;
-
-    uint64_t actual_timestamp;
-    while (high != low) {
-      page_buf_pos_ = (high + low) / 2 ;
-      page_buf_.getTimestamp(page_buf_pos_, &actual_timestamp);
-      if (actual_timestamp > timestamp) {
-        high = page_buf_pos_;
-      } else if (actual_timestamp < timestamp) {
-        low = page_buf_pos_ + 1;
-      } else {
-        return true;
-      }
-    }
-
-    if (actual_timestamp < timestamp) {
-      page_buf_pos_++;
-    }
-  }
-
-  return page_buf_pos_ < page_buf_.getSize();
+  return nextPage();
 }
 
 bool Cursor::seekToFirst() {
-  /* open the first page */
-  auto page_idx = txn_.getPageIndex();
-  if (!page_buf_valid_ || page_pos_ != 0) {
-    page_pos_ = 0;
-    page_id_ = page_idx->getEntries()[page_pos_].page_id;
+  if (!page_map_) {
+    return false;
+  }
 
-    if (page_map_->getPage(page_id_, &page_buf_)) {
-      page_buf_valid_ = true;
-    } else {
-      page_buf_valid_ = false;
-      return false;
-    }
+  /* open the first page */
+  index_ = txn_.getPageIndex()->getVersion();
+  if (!openPage(0)) {
+    return false;
   }
 
   /* seek to the first value in the page */
@@ -161,52 +176,74 @@ bool Cursor::seekToFirst() {
 }
 
 bool Cursor::seekToLast() {
-  /* open the last page */
-  auto page_idx = txn_.getPageIndex();
-  auto page_pos = page_idx->getSize() - 1;
-
-  if (!page_buf_valid_ || page_pos_ != page_pos) {
-    page_pos_ = page_pos;
-    page_id_ = page_idx->getEntries()[page_pos_].page_id;
+  if (!page_map_) {
+    return false;
+  }
 
-    if (page_map_->getPage(page_id_, &page_buf_)) {
-      page_buf_valid_ = true;
-    } else {
-      page_buf_valid_ = false;
-      return false;
-    }
+  /* open the last page */
+  index_ = txn_.getPageIndex()->getVersion();
+  if (!openPage(index_->entries.size() - 1)) {
+    return false;
   }
 
   /* seek to the last value in the page */
-  page_buf_pos_ = page_buf_.getSize() - 1;
+  page_buf_pos_ = page_buf_->getSize() - 1;
   return true;
 }
 
 bool Cursor::next() {
-  if (!page_map_) {
+  if (!page_map_ || !page_buf_valid_) {
     return false;
   }
 
-  if (page_buf_valid_ && page_buf_pos_ < page_buf_.getSize()) {
+  if (page_buf_pos_ + 1 < page_buf_->getSize()) {
     ++page_buf_pos_;
     return true;
-  } else {
-    /* load next page */
-    auto page_idx = txn_.getPageIndex();
-    if (page_pos_ + 1 >= page_idx->getSize()) {
+  }
+
+  return nextPage();
+}
+
+bool Cursor::nextPage() {
+  /* move to the first value of the next non-empty page. if there is none,
+     leave the cursor past the end of the current page */
+  while (page_pos_ + 1 < index_->entries.size()) {
+    if (!openPage(page_pos_ + 1)) {
       return false;
     }
 
-    page_id_ = page_idx->getEntries()[++page_pos_].page_id;
-    if (!page_map_->getPage(page_id_, &page_buf_)) {
-      page_buf_valid_ = false;
-      return false;
+    if (page_buf_->getSize() > 0) {
+      page_buf_pos_ = 0;
+      return true;
     }
+  }
 
-    page_buf_valid_ = true;
-    page_buf_pos_ = 0;
-    return true;
+  page_buf_pos_ = page_buf_->getSize();
+  return false;
+}
+
+bool Cursor::openPage(size_t page_pos) {
+  page_pos_ = page_pos;
+  page_id_ = index_->entries[page_pos_].page_id;
+
+  /* request the next pages before blocking on this one. pages that were
+     requested when a previous page was opened are not requested again.
+     prefetched pages are read into the page cache, so cursors that don't
+     cache pages don't read ahead */
+  if (readahead_ > 0 && caching_) {
+    if (readahead_end_ <= page_pos_ ||
+        readahead_end_ > page_pos_ + readahead_ + 1) {
+      readahead_end_ = page_pos_ + 1;
+    }
+
+    auto end = std::min(page_pos_ + readahead_ + 1, index_->entries.size());
+    for (; readahead_end_ < end; ++readahead_end_) {
+      page_map_->prefetchPage(index_->entries[readahead_end_].page_id);
+    }
   }
+
+  page_buf_valid_ = page_map_->getPage(page_id_, &page_buf_, nullptr, caching_);
+  return page_buf_valid_;
 }
 
 void Cursor::update(const void* value, size_t value_len) {
@@ -218,50 +255,41 @@ void Cursor::update(const void* value, size_t value_len) {
     return true;
   };
 
+  /* drop our pin on the page so that the modification can be applied in
+     place, then pin the new version */
+  page_buf_.reset();
   txn_.getPageMap()->modifyPage(page_id_, modify_fn);
-  modify_fn(&page_buf_);
+  page_buf_valid_ = page_map_->getPage(page_id_, &page_buf_, nullptr, caching_);
 }
 
 void Cursor::insert(uint64_t timestamp, const void* value, size_t value_len) {
   assert(!txn_.isReadonly());
-  assert(valid());
 
-  /* append the value */
+  /* insert the value into the page that covers the timestamp. late values
+     go to the pages out-of-order buffer */
   auto modify_fn = [
-      this,
       timestamp,
       value,
       value_len] (PageBuffer* page) -> bool {
-    page->insert(page_buf_pos_, timestamp, value, value_len);
+    page->insert(timestamp, value, value_len);
     return true;
   };
 
-  txn_.getPageMap()->modifyPage(page_id_, modify_fn);
-  modify_fn(&page_buf_);
+  if (!modifyPageAt(timestamp, modify_fn)) {
+    return;
+  }
+
+  /* seek to the inserted value */
+  page_buf_pos_ = findValue(*page_buf_, timestamp, false);
+  rebalancePage();
 }
 
 void Cursor::append(uint64_t timestamp, const void* value, size_t value_len) {
   assert(!txn_.isReadonly());
 
-  /* open the last page */
-  auto page_idx = txn_.getPageIndex();
-  auto last_page_pos = page_idx->getSize() - 1;
-
-  if (!page_buf_valid_ || page_pos_ != last_page_pos) {
-    page_pos_ = last_page_pos;
-    page_id_ = page_idx->getEntries()[page_pos_].page_id;
-
-    if (page_map_->getPage(page_id_, &page_buf_)) {
-      page_buf_valid_ = true;
-    } else {
-      page_buf_valid_ = false;
-      return;
-    }
-  }
-
-  /* append the value */
+  /* append the value to the page that covers the timestamp, which is the
+     last page unless the value is late */
   auto modify_fn = [
-      this,
       timestamp,
       value,
       value_len] (PageBuffer* page) -> bool {
@@ -269,11 +297,182 @@ void Cursor::append(uint64_t timestamp, const void* value, size_t value_len) {
     return true;
   };
 
-  txn_.getPageMap()->modifyPage(page_id_, modify_fn);
-  modify_fn(&page_buf_);
+  if (!modifyPageAt(timestamp, modify_fn)) {
+    return;
+  }
 
   /* seek to the inserted value */
-  page_buf_pos_ = page_buf_.getSize() - 1;
+  page_buf_pos_ = findValue(*page_buf_, timestamp, true) - 1;
+  rebalancePage();
+}
+
+bool Cursor::modifyPageAt(
+    uint64_t timestamp,
+    std::function<bool (PageBuffer* buf)> fn) {
+  /* writes always go to the current version of the index */
+  index_ = txn_.getPageIndex()->getVersion();
+  page_pos_ = index_->findPage(timestamp);
+  page_id_ = index_->entries[page_pos_].page_id;
+
+  /* drop our pin on the page so that the modification can be applied in
+     place, then pin the new version */
+  page_buf_.reset();
+  page_map_->modifyPage(page_id_, fn);
+  page_buf_valid_ = page_map_->getPage(page_id_, &page_buf_, nullptr, caching_);
+  return page_buf_valid_;
+}
+
+void Cursor::rebalancePage() {
+  if (page_split_size_ == 0) {
+    return;
+  }
+
+  auto encoded_size = page_buf_->getEncodedSize();
+  if (encoded_size > page_split_size_) {
+    splitPage();
+  } else if (encoded_size < page_split_size_ / kPageMergeFactor) {
+    mergePage();
+  }
+}
+
+bool Cursor::splitPage() {
+  auto page_buf = page_buf_;
+  auto page_size = page_buf->getSize();
+
+  /* split the page at the median timestamp. all values with the same
+     timestamp have to end up in the same page */
+  uint64_t split_time;
+  page_buf->getTimestamp(page_size / 2, &split_time);
+  auto split_pos = findValue(*page_buf, split_time, false);
+  if (split_pos == 0) {
+    split_pos = findValue(*page_buf, split_time, true);
+    if (split_pos == page_size) {
+      return false;
+    }
+
+    page_buf->getTimestamp(split_pos, &split_time);
+  }
+
+  /* copy both halves into new pages. the old page stays untouched so that
+     readers that hold the current version of the index still see it */
+  auto page_index = txn_.getPageIndex();
+  auto lower_page_id = page_map_->allocPage(page_index->getValueSize());
+  page_map_->modifyPage(lower_page_id, [&page_buf, split_pos] (
+      PageBuffer* page) -> bool {
+    page->appendRange(*page_buf, 0, split_pos);
+    return true;
+  });
+
+  auto upper_page_id = page_map_->allocPage(page_index->getValueSize());
+  page_map_->modifyPage(upper_page_id, [&page_buf, split_pos, page_size] (
+      PageBuffer* page) -> bool {
+    page->appendRange(*page_buf, split_pos, page_size);
+    return true;
+  });
+
+  /* publish a new version of the index */
+  std::shared_ptr<PageIndexVersion> version(new PageIndexVersion(*index_));
+  PageIndexEntry upper_entry;
+  upper_entry.page_id = upper_page_id;
+  PageIndexSplitpoint splitpoint;
+  splitpoint.point = split_time;
+  version->entries[page_pos_].page_id = lower_page_id;
+  version->entries.insert(
+      version->entries.begin() + page_pos_ + 1,
+      upper_entry);
+  version->splitpoints.insert(
+      version->splitpoints.begin() + page_pos_,
+      splitpoint);
+
+  index_ = version;
+  page_index->setVersion(std::move(version), page_map_);
+
+  /* move the cursor to the half that holds the current value */
+  if (page_buf_pos_ >= split_pos) {
+    page_buf_pos_ -= split_pos;
+    return openPage(page_pos_ + 1);
+  } else {
+    return openPage(page_pos_);
+  }
+}
+
+bool Cursor::mergePage() {
+  auto page_count = index_->entries.size();
+  if (page_count < 2 || index_->isUnmergeable(page_id_)) {
+    return false;
+  }
+
+  /* try to merge with the next page first, then with the previous one */
+  size_t neighbours[2] = { page_pos_ + 1, page_pos_ - 1 };
+  bool unmergeable = true;
+  for (auto neighbour_pos : neighbours) {
+    if (neighbour_pos >= page_count) {
+      continue;
+    }
+
+    PageBufferRef neighbour_buf;
+    if (!page_map_->getPage(
+          index_->entries[neighbour_pos].page_id,
+          &neighbour_buf,
+          nullptr,
+          caching_)) {
+      unmergeable = false;
+      continue;
+    }
+
+    auto merged_size =
+        page_buf_->getEncodedSize() + neighbour_buf->getEncodedSize();
+    if (merged_size > page_split_size_ / 2) {
+      continue;
+    }
+
+    /* copy both pages into a new one and publish a new version of the
+       index */
+    auto first_pos = std::min(page_pos_, neighbour_pos);
+    auto first_buf = first_pos == page_pos_ ? page_buf_ : neighbour_buf;
+    auto second_buf = first_pos == page_pos_ ? neighbour_buf : page_buf_;
+
+    auto page_index = txn_.getPageIndex();
+    auto merged_page_id = page_map_->allocPage(page_index->getValueSize());
+    page_map_->modifyPage(merged_page_id, [&first_buf, &second_buf] (
+        PageBuffer* page) -> bool {
+      page->appendRange(*first_buf, 0, first_buf->getSize());
+      page->appendRange(*second_buf, 0, second_buf->getSize());
+      return true;
+    });
+
+    std::shared_ptr<PageIndexVersion> version(new PageIndexVersion(*index_));
+    version->entries[first_pos].page_id = merged_page_id;
+    version->entries.erase(version->entries.begin() + first_pos + 1);
+    version->splitpoints.erase(version->splitpoints.begin() + first_pos);
+
+    index_ = version;
+    page_index->setVersion(std::move(version), page_map_);
+
+    /* move the cursor to the merged page */
+    if (page_pos_ != first_pos) {
+      page_buf_pos_ += first_buf->getSize();
+    }
+
+    return openPage(first_pos);
+  }
+
+  /* the neighbours are too big, don't read them again until the page index
+     changes */
+  if (unmergeable) {
+    index_->setUnmergeable(page_id_);
+  }
+
+  return false;
+}
+
+void Cursor::setCaching(bool enable) {
+  caching_ = enable;
+}
+
+void Cursor::setReadahead(size_t pages) {
+  readahead_ = pages;
+  readahead_end_ = 0;
 }
 
 } // namespace tsdb
@@ -8,15 +8,35 @@
 #pragma once
 #include <stdlib.h>
 #include "zdb.h"
+#include "metadata.h"
 
 namespace zdb {
 
+/**
+ * A cursor iterates over the rows of a table. A new cursor is positioned
+ * before the first row. The cursor holds a read lock on the database until it
+ * is destroyed, so the table can't be modified while a cursor on it is open.
+ */
 class cursor {
 public:
 
+  cursor(database_ref db, const std::string& table_name);
+  cursor(const cursor& o) = delete;
+  cursor& operator=(const cursor& o) = delete;
+  ~cursor();
+
   void advise(zdb_cursor_advise_t);
+
+  /* restrict the cursor to a subset of the columns. once a column has been
+     used, only used columns can be read and ZDB_FETCH_AHEAD only prefetches
+     the pages of used columns */
   int use(const std::string& column);
 
+  /* skip rows that don't match the predicate. the filters are evaluated for
+     a chunk of rows at a time and the other columns are only read for the
+     rows that match. next_batch_borrow can't be used with filters */
+  int filter(const predicate& pred);
+
   bool get_bool(int column);
   uint32_t get_uint32(int column);
   uint64_t get_uint64(int column);
@@ -29,7 +49,45 @@ public:
   int next();
   uint32_t tell() const;
 
+  /* read the values of the next (up to) max_rows rows and advance the cursor
+     to the last row read. the values of columns[i] are copied to buffers[i],
+     which must have room for max_rows values of the columns type. rows is set
+     to the number of rows read, which is zero at the end of the table. with
+     filters, only matching rows are returned */
+  int next_batch(
+      const int* columns,
+      void** buffers,
+      size_t columns_count,
+      size_t max_rows,
+      size_t* rows);
+
+  /* like next_batch, but points buffers[i] at the cursors column storage
+     instead of copying the values, or sets it to nullptr if the column has no
+     values for these rows. a batch never spans more than one row block. the
+     pointers are valid until the cursor is destroyed */
+  int next_batch_borrow(
+      const int* columns,
+      const void** buffers,
+      size_t columns_count,
+      size_t max_rows,
+      size_t* rows);
+
+  /* copy the values of the given rows (for example the result of a scan) to
+     the caller provided arrays, without moving the cursor. buffers[i] must
+     have room for rows_count values of the type of columns[i] */
+  int read_rows(
+      const uint64_t* rows,
+      size_t rows_count,
+      const int* columns,
+      void** buffers,
+      size_t columns_count);
+
   int seek_position(uint32_t index);
+
+  /* move the cursor to the first row with the given primary key (the first
+     column, which must have the type of the key). this is a hash lookup if
+     the table has a primary key index and a search of the key column
+     otherwise */
   int seek_primary_key_uint32(uint32_t key);
   int seek_primary_key_uint64(uint64_t key);
   int seek_primary_key_int32(int32_t key);
@@ -38,49 +96,70 @@ public:
   int seek_primary_key_float64(double key);
   int seek_primary_key_string(const char* key, size_t keylen);
 
-};
+protected:
+
+  /* rows that are prefetched ahead of the cursor with ZDB_FETCH_AHEAD */
+  static const size_t kPrefetchRows = 16;
 
-//class Cursor {
-//public:
-//
-//  Cursor();
-//  Cursor(PageMap* page_map, Transaction&& txn);
-//  Cursor(Cursor&& o);
-//  Cursor(const Cursor& o) = delete;
-//  Cursor& operator=(const Cursor& o) = delete;
-//  Cursor& operator=(Cursor&& o);
-//
-//  bool valid();
-//
-//  void get(uint64_t* timestamp, void* value, size_t value_len);
-//  uint64_t getTime();
-//  void getValue(void* value, size_t value_len);
-//
-//  /* seek to the first entry that is greater or equal */
-//  bool seekTo(uint64_t timestamp);
-//  bool seekToFirst();
-//  bool seekToLast();
-//
-//  bool next();
-//  bool next(uint64_t* timestamp, void* value, size_t value_len);
-//
-//  /* insert at the current position (new value will appear before current
-//     value at this position after insert) */
-//  void insert(uint64_t timestamp, const void* value, size_t value_len);
-//
-//  void append(uint64_t timestamp, const void* value, size_t value_len);
-//
-//  void update(const void* value, size_t value_len);
-//
-//protected:
-//  Transaction txn_;
-//  size_t page_pos_;
-//  size_t page_id_;
-//  PageMap* page_map_;
-//  PageBuffer page_buf_;
-//  bool page_buf_valid_;
-//  size_t page_buf_pos_;
-//};
+  /* rows for which the filters are evaluated at once. chunks are aligned to
+     the chunks of the zone maps so that each one can be skipped on its own */
+  static const size_t kFilterRows = kZoneRows;
+
+  friend zdb_err_t cursor_init(
+      database_ref db,
+      const std::string& table_name,
+      cursor_ref* cursor);
+
+  template <typename T>
+  T get_value(int column, zdb_type_t type);
+
+  bool is_used(int column) const;
+  bool check_columns(const int* columns, size_t columns_count) const;
+
+  /* evaluate the filters for the chunk of rows that contains offset, unless
+     it is the current chunk, and return the number of rows from offset to the
+     end of the chunk */
+  size_t filter_chunk(size_t row_block, uint64_t offset);
+
+  /* copy the values of the rows in a run that match the filters to the
+     buffers, starting at index first, and return the number of rows copied */
+  size_t gather_filtered(
+      size_t run_block,
+      uint64_t run_offset,
+      size_t run_length,
+      const int* columns,
+      void** buffers,
+      size_t columns_count,
+      size_t first);
+
+  /* find the row block that contains a row */
+  bool find_row(uint64_t row, size_t* row_block, uint64_t* offset) const;
+  int seek_row(uint64_t row);
+
+  template <typename T>
+  int seek_primary_key(T key, zdb_type_t type);
+
+  /* advance the cursor over the next run of up to max_rows rows in one row
+     block and return the length of the run. the cursor is left on the last
+     row of the run */
+  size_t next_run(size_t max_rows, size_t* run_block, uint64_t* run_offset);
+
+  database_ref db;
+  const table* tbl;
+  std::vector<uint64_t> block_first_row;
+  bool started;
+  size_t block;
+  uint64_t block_offset;
+  uint64_t position;
+  zdb_cursor_advise_t advice;
+  std::vector<bool> used;
+  std::vector<predicate> filters;
+  std::vector<uint8_t> filter_mask;
+  std::vector<uint8_t> filter_scratch;
+  size_t filter_block;
+  uint64_t filter_begin;
+  uint64_t filter_end;
+};
 
 } // namespace zdb
 
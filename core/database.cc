@@ -6,6 +6,7 @@
  * under the 3-Clause BSD License (BSD-3-Clause).
  */
 #include "database.h"
+#include "lock.h"
 #include <assert.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -18,7 +19,8 @@ database::database(
     metadata&& meta_,
     bool readonly_) :
     meta(std::move(meta_)),
-    readonly(readonly_) {
+    readonly(readonly_),
+    sched(get_default_scheduler()) {
   if (pthread_rwlock_init(&lock, nullptr)) {
     throw new std::runtime_error("pthread_rwlock_init failed");
   }
@@ -34,5 +36,18 @@ zdb_err_t open(const std::string& filename, int oflags, database_ref* db_ref) {
   return ZDB_SUCCESS;
 }
 
+zdb_err_t set_scheduler(database_ref db, scheduler_ref sched) {
+  assert(!!db);
+
+  if (!sched) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  lock_guard lk(&db->lock);
+  lk.lock_write();
+  db->sched = std::move(sched);
+  return ZDB_SUCCESS;
+}
+
 } // namespace zdb
 
@@ -8,6 +8,7 @@
 #pragma once
 #include "tuple.h"
 #include "metadata.h"
+#include "scheduler.h"
 
 namespace zdb {
 
@@ -20,15 +21,14 @@ struct database {
 
   void close();
 
-  int cursor_init(
-      const std::string& table_name,
-      cursor_ref* cursor);
-
   int commit();
 
   metadata meta;
   const bool readonly;
   pthread_rwlock_t lock;
+
+  /* runs the parallel parts of operations on this database */
+  scheduler_ref sched;
 };
 
 } // namespace zdb
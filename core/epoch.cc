@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <thread>
+#include "epoch.h"
+
+namespace tsdb {
+
+static size_t getStripeIndex() {
+  static thread_local size_t stripe_idx =
+      std::hash<std::thread::id>()(std::this_thread::get_id());
+
+  return stripe_idx;
+}
+
+EpochManager::EpochManager() : epoch_(1) {
+  for (auto& stripe : stripes_) {
+    stripe.readers[0] = 0;
+    stripe.readers[1] = 0;
+  }
+}
+
+EpochManager::~EpochManager() {
+  for (auto& retired : retired_) {
+    for (auto& fn : retired) {
+      fn();
+    }
+  }
+}
+
+std::atomic<uint64_t>* EpochManager::enter() {
+  auto& stripe = stripes_[getStripeIndex() % kNumStripes];
+
+  /* register as a reader of the current epoch. if the epoch was advanced
+     concurrently, the reclaimer might not have seen us, so retry */
+  for (;;) {
+    auto epoch = epoch_.load();
+    auto readers = &stripe.readers[epoch % 2];
+    readers->fetch_add(1);
+
+    if (epoch_.load() == epoch) {
+      return readers;
+    }
+
+    readers->fetch_sub(1);
+  }
+}
+
+void EpochManager::retire(std::function<void ()> fn) {
+  {
+    std::unique_lock<std::mutex> lk(retired_mutex_);
+    retired_[epoch_.load() % 2].emplace_back(std::move(fn));
+  }
+
+  tryAdvance();
+}
+
+/**
+ * The epoch can be advanced from E to E + 1 once all readers of epoch E - 1
+ * have left. At that point no reader can reference anything that was retired
+ * in epoch E - 1 (which shares its slot with E + 1), so those objects are
+ * destroyed
+ */
+void EpochManager::tryAdvance() {
+  std::vector<std::function<void ()>> reclaim;
+
+  {
+    std::unique_lock<std::mutex> lk(retired_mutex_);
+    auto epoch = epoch_.load();
+    auto prev_slot = (epoch + 1) % 2;
+
+    for (auto& stripe : stripes_) {
+      if (stripe.readers[prev_slot].load() > 0) {
+        return;
+      }
+    }
+
+    reclaim.swap(retired_[prev_slot]);
+    epoch_.store(epoch + 1);
+  }
+
+  for (auto& fn : reclaim) {
+    fn();
+  }
+}
+
+EpochGuard::EpochGuard(EpochManager* manager) : readers_(manager->enter()) {}
+
+EpochGuard::~EpochGuard() {
+  readers_->fetch_sub(1);
+}
+
+} // namespace tsdb
+
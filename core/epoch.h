@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace tsdb {
+
+/**
+ * Epoch-based reclamation for lock-free readers. Readers enter a critical
+ * section with an EpochGuard; objects that were unlinked from a shared
+ * structure are passed to retire() and destroyed once every reader that
+ * could still hold a reference to them has left its critical section.
+ *
+ * Readers register in one of a fixed number of cache-line sized stripes, so
+ * entering and leaving a critical section only touches a counter that is
+ * shared with few other threads
+ */
+class EpochManager {
+public:
+
+  EpochManager();
+  EpochManager(const EpochManager& o) = delete;
+  EpochManager& operator=(const EpochManager& o) = delete;
+  ~EpochManager();
+
+  /* call fn once no reader can reference the retired object anymore */
+  void retire(std::function<void ()> fn);
+
+protected:
+  friend class EpochGuard;
+
+  static const size_t kNumStripes = 64;
+  static const size_t kCacheLineSize = 64;
+
+  struct Stripe {
+    std::atomic<uint64_t> readers[2];
+    char padding[kCacheLineSize - 2 * sizeof(std::atomic<uint64_t>)];
+  };
+
+  std::atomic<uint64_t>* enter();
+  void tryAdvance();
+
+  std::atomic<uint64_t> epoch_;
+  Stripe stripes_[kNumStripes];
+  std::mutex retired_mutex_;
+  std::vector<std::function<void ()>> retired_[2];
+};
+
+class EpochGuard {
+public:
+  EpochGuard(EpochManager* manager);
+  EpochGuard(const EpochGuard& o) = delete;
+  EpochGuard& operator=(const EpochGuard& o) = delete;
+  ~EpochGuard();
+
+protected:
+  std::atomic<uint64_t>* readers_;
+};
+
+} // namespace tsdb
+
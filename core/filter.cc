@@ -0,0 +1,270 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include "filter.h"
+#include "predicate.h"
+
+namespace zdb {
+
+/* how the values in a range of a page can match a predicate according to the
+   zone map of the range */
+enum zone_match {
+  ZONE_NONE,
+  ZONE_SOME,
+  ZONE_ALL
+};
+
+template <typename T>
+static T get_operand(const predicate& pred, size_t i) {
+  T v;
+  memcpy(&v, pred.operands.data() + i * sizeof(T), sizeof(T));
+  return v;
+}
+
+template <typename T>
+static zone_match check_zone(
+    const page_buf* page,
+    uint64_t begin,
+    uint64_t end,
+    const predicate& pred) {
+  T min;
+  T max;
+  if (!page->get_minmax(begin, end, &min, &max)) {
+    return ZONE_SOME;
+  }
+
+  /* the zone map ignores NaNs, which never match, so a float page can't be
+     known to match entirely */
+  auto all = std::is_floating_point<T>::value ? ZONE_SOME : ZONE_ALL;
+
+  auto v = get_operand<T>(pred, 0);
+  switch (pred.op) {
+    case ZDB_PREDICATE_EQ:
+      if (v < min || max < v) return ZONE_NONE;
+      if (!(min < v) && !(v < max)) return all;
+      return ZONE_SOME;
+    case ZDB_PREDICATE_LT:
+      if (!(min < v)) return ZONE_NONE;
+      if (max < v) return all;
+      return ZONE_SOME;
+    case ZDB_PREDICATE_LE:
+      if (v < min) return ZONE_NONE;
+      if (!(v < max)) return all;
+      return ZONE_SOME;
+    case ZDB_PREDICATE_GT:
+      if (!(v < max)) return ZONE_NONE;
+      if (v < min) return all;
+      return ZONE_SOME;
+    case ZDB_PREDICATE_GE:
+      if (max < v) return ZONE_NONE;
+      if (!(min < v)) return all;
+      return ZONE_SOME;
+    case ZDB_PREDICATE_BETWEEN: {
+      auto hi = get_operand<T>(pred, 1);
+      if (hi < min || max < v) return ZONE_NONE;
+      if (!(min < v) && !(hi < max)) return all;
+      return ZONE_SOME;
+    }
+    case ZDB_PREDICATE_IN: {
+      auto n = pred.operands.size() / sizeof(T);
+      for (size_t i = 0; i < n; ++i) {
+        auto o = get_operand<T>(pred, i);
+        if (!(o < min) && !(max < o)) {
+          return ZONE_SOME;
+        }
+      }
+
+      return ZONE_NONE;
+    }
+    default:
+      return ZONE_SOME;
+  }
+}
+
+template <typename T>
+static void evaluate_predicate(
+    const T* values,
+    size_t count,
+    const predicate& pred,
+    uint8_t* mask,
+    std::vector<uint8_t>* scratch) {
+  const auto& kernels = get_compare_kernels<T>();
+  auto v = get_operand<T>(pred, 0);
+  switch (pred.op) {
+    case ZDB_PREDICATE_EQ:
+      kernels.eq(values, count, v, mask);
+      break;
+    case ZDB_PREDICATE_LT:
+      kernels.lt(values, count, v, mask);
+      break;
+    case ZDB_PREDICATE_LE:
+      kernels.le(values, count, v, mask);
+      break;
+    case ZDB_PREDICATE_GT:
+      kernels.gt(values, count, v, mask);
+      break;
+    case ZDB_PREDICATE_GE:
+      kernels.ge(values, count, v, mask);
+      break;
+    case ZDB_PREDICATE_BETWEEN:
+      kernels.ge(values, count, v, mask);
+      kernels.le(values, count, get_operand<T>(pred, 1), mask);
+      break;
+    case ZDB_PREDICATE_IN: {
+      scratch->assign(count, 0);
+      auto n = pred.operands.size() / sizeof(T);
+      for (size_t i = 0; i < n; ++i) {
+        kernels.eq_or(values, count, get_operand<T>(pred, i), scratch->data());
+      }
+
+      for (size_t i = 0; i < count; ++i) {
+        mask[i] &= (*scratch)[i];
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/* narrows the mask for rows [begin, end) of a row block to the rows that
+   match the predicate. returns ZONE_NONE if no row can match, in which case
+   the mask is left as is */
+template <typename T>
+static zone_match apply_predicate(
+    const row_block& rblock,
+    uint64_t begin,
+    uint64_t end,
+    const predicate& pred,
+    uint8_t* mask,
+    std::vector<uint8_t>* scratch) {
+  auto page = rblock.columns[pred.column].page;
+  if (!page || page->size() <= begin) {
+    return ZONE_NONE;
+  }
+
+  auto zone = check_zone<T>(page, begin, end, pred);
+  if (zone == ZONE_NONE) {
+    return ZONE_NONE;
+  }
+
+  auto avail = std::min(end, uint64_t(page->size())) - begin;
+  if (zone == ZONE_ALL && avail == end - begin) {
+    return ZONE_ALL;
+  }
+
+  evaluate_predicate<T>(
+      static_cast<const T*>(page->data()) + begin,
+      avail,
+      pred,
+      mask,
+      scratch);
+
+  /* rows without a value never match */
+  memset(mask + avail, 0, (end - begin) - avail);
+  return ZONE_SOME;
+}
+
+static zone_match apply_predicate(
+    const table& tbl,
+    const row_block& rblock,
+    uint64_t begin,
+    uint64_t end,
+    const predicate& pred,
+    uint8_t* mask,
+    std::vector<uint8_t>* scratch) {
+  switch (tbl.columns[pred.column].type) {
+    case ZDB_BOOL:
+      return apply_predicate<uint8_t>(
+          rblock, begin, end, pred, mask, scratch);
+    case ZDB_UINT32:
+      return apply_predicate<uint32_t>(
+          rblock, begin, end, pred, mask, scratch);
+    case ZDB_UINT64:
+      return apply_predicate<uint64_t>(
+          rblock, begin, end, pred, mask, scratch);
+    case ZDB_INT32:
+      return apply_predicate<int32_t>(
+          rblock, begin, end, pred, mask, scratch);
+    case ZDB_INT64:
+      return apply_predicate<int64_t>(
+          rblock, begin, end, pred, mask, scratch);
+    case ZDB_FLOAT32:
+      return apply_predicate<float>(
+          rblock, begin, end, pred, mask, scratch);
+    case ZDB_FLOAT64:
+      return apply_predicate<double>(
+          rblock, begin, end, pred, mask, scratch);
+    default:
+      return ZONE_NONE;
+  }
+}
+
+bool check_predicate(const table& tbl, const predicate& pred) {
+  if (pred.column < 0 || size_t(pred.column) >= tbl.columns.size()) {
+    return false;
+  }
+
+  auto type = tbl.columns[pred.column].type;
+  if (type == ZDB_STRING) {
+    return false;
+  }
+
+  auto vsize = type_size(type);
+  if (pred.operands.size() % vsize != 0) {
+    return false;
+  }
+
+  auto n = pred.operands.size() / vsize;
+  switch (pred.op) {
+    case ZDB_PREDICATE_EQ:
+    case ZDB_PREDICATE_LT:
+    case ZDB_PREDICATE_LE:
+    case ZDB_PREDICATE_GT:
+    case ZDB_PREDICATE_GE:
+      return n == 1;
+    case ZDB_PREDICATE_BETWEEN:
+      return n == 2;
+    case ZDB_PREDICATE_IN:
+      return n >= 1;
+    default:
+      return false;
+  }
+}
+
+bool evaluate_predicates(
+    const table& tbl,
+    const row_block& rblock,
+    uint64_t begin,
+    uint64_t end,
+    const std::vector<predicate>& predicates,
+    std::vector<uint8_t>* mask,
+    std::vector<uint8_t>* scratch) {
+  mask->assign(end - begin, 1);
+  for (const auto& pred : predicates) {
+    auto zone = apply_predicate(
+        tbl,
+        rblock,
+        begin,
+        end,
+        pred,
+        mask->data(),
+        scratch);
+
+    if (zone == ZONE_NONE) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+} // namespace zdb
+
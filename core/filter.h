@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "zdb.h"
+#include "metadata.h"
+
+namespace zdb {
+
+/* check that a predicate refers to a non-string column of the table and has
+   the number of operands that its op requires */
+bool check_predicate(const table& tbl, const predicate& pred);
+
+/**
+ * Evaluate the predicates over rows [begin, end) of a row block. mask is set
+ * to one byte per row that is 1 if the row matches all predicates. Returns
+ * false without filling in the mask if the zone maps of the pages show that
+ * no row in the range can match. The zone maps have one entry per kZoneRows
+ * rows, so ranges that are aligned to kZoneRows are pruned most precisely.
+ * scratch is working space for IN predicates that can be reused between
+ * calls.
+ */
+bool evaluate_predicates(
+    const table& tbl,
+    const row_block& rblock,
+    uint64_t begin,
+    uint64_t end,
+    const std::vector<predicate>& predicates,
+    std::vector<uint8_t>* mask,
+    std::vector<uint8_t>* scratch);
+
+} // namespace zdb
+
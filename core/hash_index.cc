@@ -0,0 +1,174 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <string.h>
+#include <stdexcept>
+#include "hash_index.h"
+#include "metadata.h"
+
+namespace zdb {
+
+hash_index::hash_index() :
+    cur(alloc_table(kInitialBuckets)),
+    old{nullptr, 0},
+    migrate_pos(0),
+    entries(0) {}
+
+hash_index::~hash_index() {
+  free(cur.buckets);
+  free(old.buckets);
+}
+
+uint64_t hash_index::hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+hash_index::bucket_table hash_index::alloc_table(size_t nbuckets) {
+  void* buckets;
+  if (posix_memalign(&buckets, alignof(bucket), nbuckets * sizeof(bucket))) {
+    throw std::runtime_error("posix_memalign failed");
+  }
+
+  memset(buckets, 0, nbuckets * sizeof(bucket));
+  return bucket_table{static_cast<bucket*>(buckets), nbuckets - 1};
+}
+
+bool hash_index::find_in(
+    const bucket_table& t,
+    uint64_t key,
+    uint64_t* row) {
+  /* there are no deletes, so the probe can stop at the first bucket that
+     isn't full */
+  for (auto b = hash(key) & t.mask; ; b = (b + 1) & t.mask) {
+    const auto& bkt = t.buckets[b];
+    for (size_t i = 0; i < bkt.count; ++i) {
+      if (bkt.keys[i] == key) {
+        *row = bkt.rows[i];
+        return true;
+      }
+    }
+
+    if (bkt.count < kBucketSlots) {
+      return false;
+    }
+  }
+}
+
+void hash_index::insert_into(bucket_table* t, uint64_t key, uint64_t row) {
+  for (auto b = hash(key) & t->mask; ; b = (b + 1) & t->mask) {
+    auto& bkt = t->buckets[b];
+    if (bkt.count < kBucketSlots) {
+      bkt.keys[bkt.count] = key;
+      bkt.rows[bkt.count] = row;
+      ++bkt.count;
+      return;
+    }
+  }
+}
+
+bool hash_index::insert(uint64_t key, uint64_t row) {
+  uint64_t existing;
+  if (find(key, &existing)) {
+    return false;
+  }
+
+  /* keep the load factor below 3/4 */
+  if ((entries + 1) * 4 > (cur.mask + 1) * kBucketSlots * 3) {
+    grow();
+  }
+
+  insert_into(&cur, key, row);
+  ++entries;
+
+  if (old.buckets) {
+    migrate(kMigrateBuckets);
+  }
+
+  return true;
+}
+
+void hash_index::grow() {
+  /* the previous move is normally done long before the new table fills up,
+     but finish it if it isn't */
+  if (old.buckets) {
+    migrate(old.mask + 1);
+  }
+
+  old = cur;
+  cur = alloc_table((old.mask + 1) * 2);
+  migrate_pos = 0;
+}
+
+void hash_index::migrate(size_t nbuckets) {
+  for (size_t i = 0; i < nbuckets && migrate_pos <= old.mask; ++i) {
+    const auto& bkt = old.buckets[migrate_pos++];
+    for (size_t j = 0; j < bkt.count; ++j) {
+      insert_into(&cur, bkt.keys[j], bkt.rows[j]);
+    }
+  }
+
+  if (migrate_pos > old.mask) {
+    free(old.buckets);
+    old = bucket_table{nullptr, 0};
+  }
+}
+
+bool hash_index::find(uint64_t key, uint64_t* row) const {
+  /* the moved buckets are left in the old table, so a key is always found in
+     one of the tables */
+  if (find_in(cur, key, row)) {
+    return true;
+  }
+
+  return old.buckets && find_in(old, key, row);
+}
+
+void hash_index::prefetch(uint64_t key) const {
+  __builtin_prefetch(&cur.buckets[hash(key) & cur.mask]);
+}
+
+size_t hash_index::size() const {
+  return entries;
+}
+
+bool get_index_key(zdb_type_t type, const void* value, uint64_t* key) {
+  if (type == ZDB_STRING) {
+    return false;
+  }
+
+  *key = 0;
+  memcpy(key, value, type_size(type));
+
+  switch (type) {
+    case ZDB_FLOAT32: {
+      auto f = *static_cast<const float*>(value);
+      if (f == 0) {
+        *key = 0;
+      }
+
+      return f == f;
+    }
+    case ZDB_FLOAT64: {
+      auto f = *static_cast<const double*>(value);
+      if (f == 0) {
+        *key = 0;
+      }
+
+      return f == f;
+    }
+    default:
+      return true;
+  }
+}
+
+} // namespace zdb
+
@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include "zdb.h"
+
+namespace zdb {
+
+/**
+ * An in-memory hash index from fixed size keys (up to 8 bytes) to row
+ * positions. The index uses open addressing with linear probing over
+ * cache-line sized buckets of three entries, so a probe usually costs a
+ * single cache miss.
+ *
+ * The index grows incrementally: when it gets too full, a table of twice
+ * the size is allocated and every insert moves a few buckets of the old
+ * table over, so no single insert pays for rehashing the whole index.
+ * Lookups check both tables until the move is done.
+ */
+class hash_index {
+public:
+
+  hash_index();
+  hash_index(const hash_index& o) = delete;
+  hash_index& operator=(const hash_index& o) = delete;
+  ~hash_index();
+
+  /* add a key unless it is already in the index. returns false if it was */
+  bool insert(uint64_t key, uint64_t row);
+
+  bool find(uint64_t key, uint64_t* row) const;
+
+  /* prefetch the bucket that a following find of the key reads first */
+  void prefetch(uint64_t key) const;
+
+  /* the number of keys in the index */
+  size_t size() const;
+
+protected:
+
+  static const size_t kBucketSlots = 3;
+  static const size_t kInitialBuckets = 16;
+
+  /* old buckets that are moved to the new table on every insert */
+  static const size_t kMigrateBuckets = 8;
+
+  struct alignas(64) bucket {
+    uint64_t keys[kBucketSlots];
+    uint64_t rows[kBucketSlots];
+    uint64_t count;
+  };
+
+  struct bucket_table {
+    bucket* buckets;
+    size_t mask;
+  };
+
+  static uint64_t hash(uint64_t key);
+  static bucket_table alloc_table(size_t nbuckets);
+  static bool find_in(const bucket_table& t, uint64_t key, uint64_t* row);
+  static void insert_into(bucket_table* t, uint64_t key, uint64_t row);
+
+  void grow();
+  void migrate(size_t nbuckets);
+
+  bucket_table cur;
+  bucket_table old;
+  size_t migrate_pos;
+  size_t entries;
+};
+
+/* the index key of a column value. float zeros are normalized so that 0.0
+   and -0.0 have the same key. returns false for types that can't be keys and
+   for NaN, which is never equal to a key and so is never indexed or found */
+bool get_index_key(zdb_type_t type, const void* value, uint64_t* key);
+
+} // namespace zdb
+
@@ -8,9 +8,12 @@
 #pragma once
 #include <mutex>
 #include <map>
+#include <memory>
 #include <vector>
 #include "zdb.h"
 #include "page.h"
+#include "hash_index.h"
+#include "secondary_index.h"
 
 namespace zdb {
 
@@ -38,6 +41,13 @@ struct table {
   column_list columns;
   std::vector<row_block> row_map;
   uint64_t row_count;
+
+  /* maps the primary key (the first column) to the first row with that key,
+     if the table has a primary key index */
+  std::unique_ptr<hash_index> primary_index;
+
+  /* the secondary indexes by column */
+  std::map<int, std::unique_ptr<secondary_index>> secondary_indexes;
 };
 
 struct metadata {
@@ -0,0 +1,295 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include <algorithm>
+#include "zdb.h"
+#include "lock.h"
+#include "database.h"
+#include "aggregate.h"
+#include "parallel.h"
+
+namespace zdb {
+
+/* the partial result of an aggregation over some of the rows */
+template <typename T>
+struct aggregate_state {
+  uint64_t count = 0;
+  typename sum_type<T>::type sum = 0;
+  T min = T();
+  T max = T();
+
+  /* min and max hold a value that is not NaN. if all values so far were NaN
+     they hold NaN */
+  bool has_minmax = false;
+};
+
+/* returns the index of the first value that is not NaN or count if there is
+   none. values of integer types are never NaN */
+template <typename T>
+static size_t find_not_nan(const T* values, size_t count) {
+  size_t i = 0;
+  while (i < count && values[i] != values[i]) {
+    ++i;
+  }
+
+  return i;
+}
+
+template <typename T>
+static void aggregate_morsel(
+    const table& tbl,
+    const morsel& m,
+    int column,
+    zdb_aggregate_t fn,
+    aggregate_state<T>* state) {
+  const auto& kernels = get_aggregate_kernels<T>();
+
+  auto page = tbl.row_map[m.row_block].columns[column].page;
+  if (!page) {
+    return;
+  }
+
+  auto end = std::min(m.end, uint64_t(page->size()));
+  if (m.begin >= end) {
+    return;
+  }
+
+  auto values = static_cast<const T*>(page->data()) + m.begin;
+  auto n = end - m.begin;
+  switch (fn) {
+    case ZDB_AGGREGATE_SUM:
+    case ZDB_AGGREGATE_AVG:
+      kernels.sum(values, n, &state->sum);
+      break;
+    case ZDB_AGGREGATE_MIN:
+    case ZDB_AGGREGATE_MAX: {
+      /* the kernels skip NaN values but must be seeded with a value that is
+         not NaN */
+      size_t first = 0;
+      if (!state->has_minmax) {
+        first = find_not_nan(values, n);
+        if (first == n) {
+          state->min = values[0];
+          state->max = values[0];
+          break;
+        }
+
+        state->min = values[first];
+        state->max = values[first];
+        state->has_minmax = true;
+      }
+
+      if (fn == ZDB_AGGREGATE_MIN) {
+        kernels.min(values + first, n - first, &state->min);
+      } else {
+        kernels.max(values + first, n - first, &state->max);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  state->count += n;
+}
+
+template <typename T>
+static void aggregate_merge(
+    const aggregate_state<T>& partial,
+    aggregate_state<T>* state) {
+  if (partial.count == 0) {
+    return;
+  }
+
+  if (state->count == 0) {
+    *state = partial;
+    return;
+  }
+
+  state->count += partial.count;
+  state->sum += partial.sum;
+  if (!partial.has_minmax) {
+    return;
+  }
+
+  if (!state->has_minmax) {
+    state->min = partial.min;
+    state->max = partial.max;
+    state->has_minmax = true;
+    return;
+  }
+
+  state->min = partial.min < state->min ? partial.min : state->min;
+  state->max = state->max < partial.max ? partial.max : state->max;
+}
+
+template <typename T>
+static zdb_err_t aggregate_column(
+    scheduler* sched,
+    const table& tbl,
+    int column,
+    zdb_aggregate_t fn,
+    void* result,
+    size_t threads,
+    uint64_t row_begin,
+    uint64_t row_end) {
+  using S = typename sum_type<T>::type;
+
+  /* run the kernel over the part of each page that is in the row range */
+  std::vector<morsel> morsels;
+  split_morsels(
+      tbl,
+      row_begin,
+      row_end,
+      threads > 1 ? kMorselRows : uint64_t(-1),
+      &morsels);
+
+  std::vector<aggregate_state<T>> partial(threads);
+  run_morsels(sched, morsels.size(), threads, [&] (size_t worker, size_t i) {
+    aggregate_morsel<T>(tbl, morsels[i], column, fn, &partial[worker]);
+  });
+
+  aggregate_state<T> state;
+  for (const auto& p : partial) {
+    aggregate_merge(p, &state);
+  }
+
+  switch (fn) {
+    case ZDB_AGGREGATE_COUNT:
+      *static_cast<uint64_t*>(result) = state.count;
+      return ZDB_SUCCESS;
+    case ZDB_AGGREGATE_SUM:
+      *static_cast<S*>(result) = state.sum;
+      return ZDB_SUCCESS;
+    default:
+      break;
+  }
+
+  /* min, max and avg are undefined for an empty range */
+  if (state.count == 0) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  switch (fn) {
+    case ZDB_AGGREGATE_MIN:
+      *static_cast<T*>(result) = state.min;
+      return ZDB_SUCCESS;
+    case ZDB_AGGREGATE_MAX:
+      *static_cast<T*>(result) = state.max;
+      return ZDB_SUCCESS;
+    case ZDB_AGGREGATE_AVG:
+      *static_cast<double*>(result) = double(state.sum) / state.count;
+      return ZDB_SUCCESS;
+    default:
+      return ZDB_ERR_INVALID_ARGUMENT;
+  }
+}
+
+static zdb_err_t aggregate_table(
+    database_ref db,
+    const std::string& table_name,
+    int column,
+    zdb_aggregate_t fn,
+    void* result,
+    size_t threads,
+    uint64_t row_begin,
+    uint64_t row_end) {
+  assert(!!db);
+
+  /* acquire read lock */
+  lock_guard lk(&db->lock);
+  lk.lock_read();
+
+  /* find table */
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  const auto& table = table_iter->second;
+
+  /* check arguments */
+  if (column < 0 || size_t(column) >= table.columns.size()) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  if (fn < ZDB_AGGREGATE_COUNT || fn > ZDB_AGGREGATE_AVG) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  auto sched = db->sched.get();
+  threads = get_scan_threads(*sched, threads);
+
+  switch (table.columns[column].type) {
+    case ZDB_BOOL:
+      return aggregate_column<uint8_t>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    case ZDB_UINT32:
+      return aggregate_column<uint32_t>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    case ZDB_UINT64:
+      return aggregate_column<uint64_t>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    case ZDB_INT32:
+      return aggregate_column<int32_t>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    case ZDB_INT64:
+      return aggregate_column<int64_t>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    case ZDB_FLOAT32:
+      return aggregate_column<float>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    case ZDB_FLOAT64:
+      return aggregate_column<double>(
+          sched, table, column, fn, result, threads, row_begin, row_end);
+    default:
+      return ZDB_ERR_INVALID_ARGUMENT;
+  }
+}
+
+zdb_err_t aggregate(
+    database_ref db,
+    const std::string& table_name,
+    int column,
+    zdb_aggregate_t fn,
+    void* result,
+    uint64_t row_begin /* = 0 */,
+    uint64_t row_end /* = uint64_t(-1) */) {
+  return aggregate_table(
+      db,
+      table_name,
+      column,
+      fn,
+      result,
+      1,
+      row_begin,
+      row_end);
+}
+
+zdb_err_t aggregate_parallel(
+    database_ref db,
+    const std::string& table_name,
+    int column,
+    zdb_aggregate_t fn,
+    void* result,
+    size_t threads /* = 0 */,
+    uint64_t row_begin /* = 0 */,
+    uint64_t row_end /* = uint64_t(-1) */) {
+  return aggregate_table(
+      db,
+      table_name,
+      column,
+      fn,
+      result,
+      threads,
+      row_begin,
+      row_end);
+}
+
+} // namespace zdb
+
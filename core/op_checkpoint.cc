@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include "tsdb.h"
+
+namespace tsdb {
+
+/* how often the checkpointer checks the dirty bytes trigger */
+static const uint64_t kCheckpointPollIntervalMS = 100;
+
+/* after a failed checkpoint the checkpointer waits before it tries again.
+   the delay starts at the poll interval and doubles up to this limit */
+static const uint64_t kCheckpointMaxRetryDelayMS = 30000;
+
+void TSDB::startCheckpointer() {
+  if (checkpoint_interval_ms_ == 0 && checkpoint_dirty_bytes_ == 0) {
+    return;
+  }
+
+  assert(!checkpoint_thread_.joinable());
+  checkpoint_stop_ = false;
+  checkpoint_thread_ = std::thread(std::bind(&TSDB::runCheckpointer, this));
+}
+
+void TSDB::stopCheckpointer() {
+  if (!checkpoint_thread_.joinable()) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(checkpoint_mutex_);
+    checkpoint_stop_ = true;
+  }
+
+  checkpoint_cv_.notify_all();
+  checkpoint_thread_.join();
+}
+
+void TSDB::runCheckpointer() {
+  auto poll_interval = std::chrono::milliseconds(kCheckpointPollIntervalMS);
+  if (checkpoint_interval_ms_ > 0) {
+    poll_interval = std::min(
+        poll_interval,
+        std::chrono::milliseconds(checkpoint_interval_ms_));
+  }
+
+  auto last_checkpoint = std::chrono::steady_clock::now();
+  auto retry_delay = std::chrono::milliseconds(0);
+  auto retry_at = last_checkpoint;
+
+  std::unique_lock<std::mutex> lk(checkpoint_mutex_);
+  while (!checkpoint_stop_) {
+    checkpoint_cv_.wait_for(lk, poll_interval);
+    if (checkpoint_stop_) {
+      break;
+    }
+
+    auto dirty_bytes = page_map_.getDirtyBytes();
+    if (dirty_bytes == 0) {
+      continue;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool checkpoint = false;
+
+    if (checkpoint_dirty_bytes_ > 0 && dirty_bytes >= checkpoint_dirty_bytes_) {
+      checkpoint = true;
+    }
+
+    if (checkpoint_interval_ms_ > 0 &&
+        now - last_checkpoint >=
+            std::chrono::milliseconds(checkpoint_interval_ms_)) {
+      checkpoint = true;
+    }
+
+    if (!checkpoint || now < retry_at) {
+      continue;
+    }
+
+    /* the commit only snapshots the pages it writes; writers keep appending
+       to the live pages while it runs */
+    lk.unlock();
+    auto rc = commit();
+    lk.lock();
+
+    last_checkpoint = std::chrono::steady_clock::now();
+
+    /* a failed checkpoint is retried on a later trigger, backing off while
+       the failures persist (e.g. while the disk is full) */
+    if (rc) {
+      retry_delay = std::chrono::milliseconds(0);
+    } else {
+      retry_delay = std::min(
+          std::max(retry_delay * 2, poll_interval),
+          std::chrono::milliseconds(kCheckpointMaxRetryDelayMS));
+    }
+
+    retry_at = last_checkpoint + retry_delay;
+  }
+}
+
+} // namespace tsdb
+
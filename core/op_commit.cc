@@ -8,6 +8,12 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <set>
 #include <vector>
 #include "tsdb.h"
@@ -35,151 +41,426 @@ struct IndexPage {
   uint64_t size;
 };
 
-bool TSDB::commit() {
-  std::unique_lock<std::mutex> lk(commit_mutex_);
-  std::vector<FlushedPage> flushed_pages;
-  std::vector<IndexPage> index_pages;
+struct PendingWrite {
+  uint64_t disk_addr;
+  std::string data;
+};
 
-  /* get a snapshot of all series */
-  bool all_series_clean = true;
-  std::set<uint64_t> series_ids;
-  txn_map_.listSlots(&series_ids);
+struct CommitPage {
+  PageMap::PageIDType page_id;
+  PageInfo info;
+  std::string data;
+  bool encoded;
+};
 
-  /* write the transaction header */
-  std::string txn_data;
-  writeVarUInt(&txn_data, 0); // flags
-  writeVarUInt(&txn_data, bsize_);
+struct CommitSeries {
+  uint64_t series_id;
+  Transaction txn;
+  /* the page layout that is committed. pinning it keeps its pages alive
+     even if the series is split or merged while the commit runs */
+  PageIndexVersionRef index_version;
+  std::vector<CommitPage> pages;
+};
 
-  /* write the pages and partition indexes for each series */
-  for (auto siter = series_ids.begin(); siter != series_ids.end(); ) {
-    auto series_id = *siter;
+/* encode at most roughly this many dirty pages before assigning disk space */
+static const size_t kCommitChunkPages = 4096;
 
-    /* get a snapshot of the series */
-    Transaction txn;
-    if (!txn_map_.startTransaction(series_id, true, &txn)) {
-      /* if we can't start the transaction, the series was deleted while
-         our commit is running, so we ignore it */
-      siter = series_ids.erase(siter);
+/* flush the pending writes once they exceed this many bytes */
+static const size_t kMaxPendingWriteBytes = 32 * 1024 * 1024;
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static bool writeFully(int fd, struct iovec* iov, int iovcnt, uint64_t offset) {
+  while (iovcnt > 0) {
+#ifdef HAVE_PWRITEV
+    auto rc = pwritev(fd, iov, iovcnt, offset);
+#else
+    auto rc = pwrite(fd, iov->iov_base, iov->iov_len, offset);
+#endif
+
+    if (rc < 0 && errno == EINTR) {
       continue;
-    } else {
-      ++siter;
     }
 
-    /* write the series index data header */
-    std::string index_data;
-    auto page_idx = txn.getPageIndex();
-    writeVarUInt(&index_data, page_idx->getValueSize());
-    writeVarUInt(&index_data, page_idx->getMetadata().size());
-    index_data.append(
-        page_idx->getMetadata().data(),
-        page_idx->getMetadata().size());
+    if (rc <= 0) {
+      return false;
+    }
 
-    writeVarUInt(&index_data, page_idx->getSize());
+    /* skip over everything that was written, handling short writes */
+    offset += rc;
+    size_t written = rc;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
 
-    for (size_t i = 1; i < page_idx->getSize(); ++i) {
-      auto point = page_idx->getSplitpoints()[i - 1].point;
-      writeVarUInt(&index_data, point); // FIXME use delta encoding
+    if (iovcnt > 0) {
+      iov->iov_base = (char*) iov->iov_base + written;
+      iov->iov_len -= written;
     }
+  }
+
+  return true;
+}
+
+/**
+ * Write the data and make it durable. Where the kernel supports RWF_DSYNC
+ * this is a single call instead of a write followed by a separate flush
+ */
+static bool writeSync(int fd, const std::string& data, uint64_t offset) {
+#if defined(HAVE_PWRITEV2) && defined(RWF_DSYNC)
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(data.data());
+  iov.iov_len = data.size();
+
+  auto rc = pwritev2(fd, &iov, 1, offset, RWF_DSYNC);
+  if (rc >= 0) {
+    return size_t(rc) == data.size();
+  }
 
-    /* write each page to disk */
-    bool all_pages_clean = true;
-    for (size_t i = 0; i < page_idx->getSize(); ++i) {
-      auto page_id = page_idx->getEntries()[i].page_id;
-      PageInfo page_info;
+  /* older kernels reject pwritev2 or the flag, fall back to an explicit
+     flush */
+  if (errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) {
+    return false;
+  }
+#endif
 
-      if (!page_map_.getPageInfo(page_id, &page_info)) {
+  auto rc_fallback = pwrite(fd, data.data(), data.size(), offset);
+  if (rc_fallback < 0 || size_t(rc_fallback) != data.size()) {
+    return false;
+  }
+
+#ifdef HAVE_FDATASYNC
+  return fdatasync(fd) == 0;
+#else
+  return fsync(fd) == 0;
+#endif
+}
+
+/**
+ * Write out a batch of pages. Pages are allocated sequentially, so most of
+ * the batch is contiguous on disk; each contiguous run is submitted with a
+ * single vectored write instead of one write per page
+ */
+static bool writeBatch(int fd, std::vector<PendingWrite>* batch) {
+  std::sort(
+      batch->begin(),
+      batch->end(),
+      [] (const PendingWrite& a, const PendingWrite& b) {
+        return a.disk_addr < b.disk_addr;
+      });
+
+  std::vector<struct iovec> iov;
+  uint64_t run_addr = 0;
+  uint64_t run_end = 0;
+  for (auto& w : *batch) {
+    if (iov.size() > 0 && (w.disk_addr != run_end || iov.size() >= IOV_MAX)) {
+      if (!writeFully(fd, iov.data(), iov.size(), run_addr)) {
         return false;
       }
 
-      if (page_info.is_dirty) {
-        all_pages_clean = false;
+      iov.clear();
+    }
+
+    if (iov.empty()) {
+      run_addr = w.disk_addr;
+      run_end = w.disk_addr;
+    }
+
+    struct iovec v;
+    v.iov_base = &w.data[0];
+    v.iov_len = w.data.size();
+    iov.emplace_back(v);
+    run_end += w.data.size();
+  }
 
-        PageBuffer page_buf;
-        page_map_.getPage(page_id, &page_buf);
+  if (iov.size() > 0) {
+    if (!writeFully(fd, iov.data(), iov.size(), run_addr)) {
+      return false;
+    }
+  }
 
-        std::string page_data;
-        page_buf.encode(&page_data);
-        assert(!page_data.empty());
+  batch->clear();
+  return true;
+}
+
+bool TSDB::commit() {
+  std::unique_lock<std::mutex> lk(commit_mutex_);
+  std::vector<FlushedPage> flushed_pages;
+  std::vector<IndexPage> index_pages;
+  std::vector<PendingWrite> pending_writes;
+  size_t pending_bytes = 0;
 
+  /* get a snapshot of all series */
+  bool all_series_clean = true;
+  std::set<uint64_t> series_ids;
+  txn_map_.listSlots(&series_ids);
+
+  /* the location of each series index in the new transaction */
+  std::vector<SeriesIndexRef> txn_series;
+
+  /* series are committed in chunks: the dirty pages of a chunk are encoded in
+     parallel, then disk space is assigned and the indexes are written
+     sequentially */
+  std::vector<CommitSeries> chunk;
+  size_t chunk_dirty_pages = 0;
+
+  auto commit_chunk = [&] () -> bool {
+    /* encode all dirty pages in the chunk */
+    std::vector<CommitPage*> dirty_pages;
+    for (auto& series : chunk) {
+      for (auto& page : series.pages) {
+        if (page.info.is_dirty) {
+          dirty_pages.emplace_back(&page);
+        }
+      }
+    }
+
+    runParallel(dirty_pages.size(), commit_threads_, [this, &dirty_pages] (
+        size_t i) {
+      auto page = dirty_pages[i];
+      /* the encoded snapshot is tagged with the version it was copied at;
+         if the page is modified while we commit it stays dirty */
+      PageBufferRef page_buf;
+      if (page_map_.getPage(page->page_id, &page_buf, &page->info.version)) {
+        page_buf->encode(&page->data);
+        page->encoded = true;
+      }
+    });
+
+    /* assign disk space and write the partition index for each series */
+    for (auto& series : chunk) {
+      /* write the series index data header */
+      std::string index_data;
+      auto page_idx = series.txn.getPageIndex();
+      const auto& metadata = page_idx->getMetadata();
+      auto& index_version = series.index_version;
+      if (fixed_layout_) {
+        writeUInt64LE(&index_data, 0);
+        writeUInt64LE(&index_data, page_idx->getValueSize());
+        writeUInt64LE(&index_data, metadata.size());
+        writeUInt64LE(&index_data, index_version->entries.size());
+        index_data.append(metadata);
+        index_data.resize(
+            (index_data.size() + sizeof(uint64_t) - 1) /
+            sizeof(uint64_t) * sizeof(uint64_t));
+
+        for (const auto& splitpoint : index_version->splitpoints) {
+          writeUInt64LE(&index_data, splitpoint.point);
+        }
+      } else {
+        writeVarUInt(&index_data, page_idx->getValueSize());
+        writeVarUInt(&index_data, metadata.size());
+        index_data.append(metadata);
+        writeVarUInt(&index_data, index_version->entries.size());
+
+        // FIXME use delta encoding
+        for (const auto& splitpoint : index_version->splitpoints) {
+          writeVarUInt(&index_data, splitpoint.point);
+        }
+      }
+
+      /* write each page to disk */
+      bool all_pages_clean = true;
+      for (auto& page : series.pages) {
+        auto& page_info = page.info;
+
+        if (page_info.is_dirty) {
+          all_pages_clean = false;
+
+          if (!page.encoded) {
+            return false;
+          }
+
+          auto& page_data = page.data;
+          assert(!page_data.empty());
+
+          if (!allocPage(
+                page_data.size(),
+                &page_info.disk_addr,
+                &page_info.disk_size)) {
+            return false;
+          }
+
+          /* pad the page to its full size so that adjacent pages form one
+             contiguous run */
+          page_data.resize(page_info.disk_size);
+          pending_bytes += page_data.size();
+
+          PendingWrite pending_write;
+          pending_write.disk_addr = page_info.disk_addr;
+          pending_write.data = std::move(page_data);
+          pending_writes.emplace_back(std::move(pending_write));
+
+          FlushedPage flushed_page;
+          flushed_page.page_id = page.page_id;
+          flushed_page.version = page_info.version;
+          flushed_page.disk_addr = page_info.disk_addr;
+          flushed_page.disk_size = page_info.disk_size;
+          flushed_pages.emplace_back(flushed_page);
+        }
+
+        /* append the pages position to the series index */
+        assert(page_info.disk_addr % bsize_ == 0);
+        assert(page_info.disk_size % bsize_ == 0);
+        if (fixed_layout_) {
+          writeUInt64LE(&index_data, page_info.disk_addr / bsize_);
+          writeUInt64LE(&index_data, page_info.disk_size / bsize_);
+        } else {
+          writeVarUInt(&index_data, page_info.disk_addr / bsize_);
+          writeVarUInt(&index_data, page_info.disk_size / bsize_);
+        }
+      }
+
+      uint64_t index_disk_addr;
+      uint64_t index_disk_size;
+      if (page_idx->hasDiskSnapshot() && all_pages_clean) {
+        /* reuse the previous series index */
+        page_idx->getDiskSnapshot(&index_disk_addr, &index_disk_size);
+      } else {
+        all_series_clean = false;
+
+        /* write the series index to disk*/
         if (!allocPage(
-              page_data.size(),
-              &page_info.disk_addr,
-              &page_info.disk_size)) {
+              index_data.size(),
+              &index_disk_addr,
+              &index_disk_size)) {
           return false;
         }
 
-        auto rc = pwrite(
-            fd_,
-            page_data.data(),
-            page_data.size(),
-            page_info.disk_addr);
+        index_data.resize(index_disk_size);
+        pending_bytes += index_data.size();
+
+        PendingWrite pending_write;
+        pending_write.disk_addr = index_disk_addr;
+        pending_write.data = std::move(index_data);
+        pending_writes.emplace_back(std::move(pending_write));
 
-        if (rc <= 0) {
+        IndexPage index_page;
+        index_page.addr = index_disk_addr;
+        index_page.size = index_disk_size;
+        index_pages.emplace_back(index_page);
+
+        page_idx->setDiskSnapshot(index_disk_addr, index_disk_size);
+      }
+
+      /* add the series index position to the transaction */
+      assert(index_disk_addr % bsize_ == 0);
+      assert(index_disk_size % bsize_ == 0);
+      SeriesIndexRef series_index;
+      series_index.series_id = series.series_id;
+      series_index.disk_addr = index_disk_addr / bsize_;
+      series_index.disk_size = index_disk_size / bsize_;
+      txn_series.emplace_back(series_index);
+
+      /* don't buffer an unbounded amount of page data in memory */
+      if (pending_bytes > kMaxPendingWriteBytes) {
+        if (!writeBatch(fd_, &pending_writes)) {
           return false;
         }
 
-        FlushedPage flushed_page;
-        flushed_page.page_id = page_id;
-        flushed_page.version = page_info.version;
-        flushed_page.disk_addr = page_info.disk_addr;
-        flushed_page.disk_size = page_info.disk_size;
-        flushed_pages.emplace_back(flushed_page);
+        pending_bytes = 0;
       }
+    }
+
+    chunk.clear();
+    chunk_dirty_pages = 0;
+    return true;
+  };
 
-      /* append the pages position to the series index */
-      assert(page_info.disk_addr % bsize_ == 0);
-      assert(page_info.disk_size % bsize_ == 0);
-      writeVarUInt(&index_data, page_info.disk_addr / bsize_);
-      writeVarUInt(&index_data, page_info.disk_size / bsize_);
+  for (auto series_id : series_ids) {
+    /* get a snapshot of the series. if we can't start the transaction, the
+       series was deleted while our commit is running, so we ignore it. it
+       stays in series_ids so that its index isn't re-added below */
+    Transaction txn;
+    if (!txn_map_.startTransaction(series_id, true, &txn)) {
+      continue;
     }
 
-    uint64_t index_disk_addr;
-    uint64_t index_disk_size;
-    if (page_idx->hasDiskSnapshot() && all_pages_clean) {
-      /* reuse the previous series index */
-      page_idx->getDiskSnapshot(&index_disk_addr, &index_disk_size);
-    } else {
-      all_series_clean = false;
+    CommitSeries series;
+    series.series_id = series_id;
 
-      /* write the series index to disk*/
-      if (!allocPage(index_data.size(), &index_disk_addr, &index_disk_size)) {
+    series.index_version = txn.getPageIndex()->getVersion();
+    for (const auto& entry : series.index_version->entries) {
+      CommitPage page;
+      page.page_id = entry.page_id;
+      page.encoded = false;
+
+      if (!page_map_.getPageInfo(page.page_id, &page.info)) {
         return false;
       }
 
-      auto rc = pwrite(
-          fd_,
-          index_data.data(),
-          index_data.size(),
-          index_disk_addr);
-
-      if (rc <= 0) {
-        return false;
+      if (page.info.is_dirty) {
+        ++chunk_dirty_pages;
       }
 
-      IndexPage index_page;
-      index_page.addr = index_disk_addr;
-      index_page.size = index_disk_size;
-      index_pages.emplace_back(index_page);
+      series.pages.emplace_back(std::move(page));
+    }
+
+    series.txn = std::move(txn);
+    chunk.emplace_back(std::move(series));
 
-      page_idx->setDiskSnapshot(index_disk_addr, index_disk_size);
+    if (chunk_dirty_pages >= kCommitChunkPages) {
+      if (!commit_chunk()) {
+        return false;
+      }
     }
+  }
 
-    /* append the series index position to the transaction */
-    writeVarUInt(&txn_data, series_id);
-    assert(index_disk_addr % bsize_ == 0);
-    assert(index_disk_size % bsize_ == 0);
-    writeVarUInt(&txn_data, index_disk_addr / bsize_);
-    writeVarUInt(&txn_data, index_disk_size / bsize_);
+  if (!commit_chunk()) {
+    return false;
   }
 
-  /* append the eof marker to the transaction */
-  writeVarUInt(&txn_data, 0);
+  /* series that were never loaded can't have changed, so their index from
+     the previous transaction is reused without loading it. series that were
+     loaded when the commit started are skipped even if they have been
+     deleted since */
+  for (size_t i = 0; i < lazy_series_count_; ++i) {
+    if (series_ids.count(lazy_series_[i].series_id) == 0) {
+      txn_series.emplace_back(lazy_series_[i]);
+    }
+  }
 
   /* if nothing has changed, bail out */
   if (all_series_clean) {
     return true;
   }
 
+  /* encode the transaction */
+  std::string txn_data;
+  if (fixed_layout_) {
+    std::sort(
+        txn_series.begin(),
+        txn_series.end(),
+        [] (const SeriesIndexRef& a, const SeriesIndexRef& b) {
+          return a.series_id < b.series_id;
+        });
+
+    writeVarUInt(&txn_data, kTxnFlagFixedLayout);
+    writeVarUInt(&txn_data, bsize_);
+    txn_data.resize(kTxnHeaderSize);
+    writeUInt64LE(&txn_data, txn_series.size());
+    for (const auto& series_index : txn_series) {
+      writeUInt64LE(&txn_data, series_index.series_id);
+      writeUInt64LE(&txn_data, series_index.disk_addr);
+      writeUInt64LE(&txn_data, series_index.disk_size);
+    }
+  } else {
+    writeVarUInt(&txn_data, 0); // flags
+    writeVarUInt(&txn_data, bsize_);
+    for (const auto& series_index : txn_series) {
+      writeVarUInt(&txn_data, series_index.series_id);
+      writeVarUInt(&txn_data, series_index.disk_addr);
+      writeVarUInt(&txn_data, series_index.disk_size);
+    }
+
+    /* append the eof marker to the transaction */
+    writeVarUInt(&txn_data, 0);
+  }
+
   /* write the new transaction to disk */
   uint64_t txn_disk_addr;
   uint64_t txn_disk_size;
@@ -187,8 +468,15 @@ bool TSDB::commit() {
     return false;
   }
 
-  auto rc = pwrite(fd_, txn_data.data(), txn_data.size(), txn_disk_addr);
-  if (rc <= 0) {
+  {
+    PendingWrite pending_write;
+    pending_write.disk_addr = txn_disk_addr;
+    pending_write.data = std::move(txn_data);
+    pending_write.data.resize(txn_disk_size);
+    pending_writes.emplace_back(std::move(pending_write));
+  }
+
+  if (!writeBatch(fd_, &pending_writes)) {
     return false;
   }
 
@@ -203,26 +491,25 @@ bool TSDB::commit() {
   }
 #endif
 
-  /* commit the new transaction */
-  std::string commit_data(kMagicBytes, sizeof(kMagicBytes));
-  writeVarUInt(&commit_data, txn_disk_addr);
-  writeVarUInt(&commit_data, txn_disk_size);
-  writeVarUInt(&commit_data, fpos_);
-
-  rc = pwrite(fd_, commit_data.data(), commit_data.size(), 0);
-  if (rc <= 0) {
+  /* commit the new transaction by writing it to the older of the metablock
+     slots. a torn write leaves the other slot intact, so the write doesn't
+     need to be ordered against anything but the fsync above */
+  MetaBlock metablock;
+  metablock.version = kMetaBlockVersion;
+  metablock.sequence = meta_sequence_ + 1;
+  metablock.slots = meta_slots_;
+  metablock.txn_addr = txn_disk_addr;
+  metablock.txn_size = txn_disk_size;
+  metablock.fpos = fpos_;
+
+  std::string commit_data;
+  encodeMetaBlock(metablock, &commit_data);
+  auto commit_addr = (metablock.sequence % meta_slots_) * kMetaBlockSize;
+  if (!writeSync(fd_, commit_data, commit_addr)) {
     return false;
   }
 
-#ifdef HAVE_FDATASYNC
-  if (fdatasync(fd_) != 0) {
-    return false;
-  }
-#else
-  if (fsync(fd_) != 0) {
-    return false;
-  }
-#endif
+  meta_sequence_ = metablock.sequence;
 
   /* advise the kernel that we are not going to read back the index */
 #ifdef HAVE_POSIX_FADVISE
@@ -0,0 +1,544 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+#include "zdb.h"
+#include "cursor.h"
+#include "database.h"
+#include "filter.h"
+
+namespace zdb {
+
+zdb_err_t cursor_init(
+    database_ref db,
+    const std::string& table_name,
+    cursor_ref* cursor_ref) {
+  assert(!!db);
+
+  /* the cursor acquires the read lock and keeps it until it is destroyed */
+  std::shared_ptr<cursor> c(new cursor(db, table_name));
+  if (!c->tbl) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  *cursor_ref = std::move(c);
+  return ZDB_SUCCESS;
+}
+
+cursor::cursor(
+    database_ref db_,
+    const std::string& table_name) :
+    db(std::move(db_)),
+    tbl(nullptr),
+    started(false),
+    block(0),
+    block_offset(0),
+    position(0),
+    advice(ZDB_FETCH_SINGLE),
+    filter_block(size_t(-1)),
+    filter_begin(0),
+    filter_end(0) {
+  if (pthread_rwlock_rdlock(&db->lock)) {
+    throw std::runtime_error("pthread_rwlock_rdlock failed");
+  }
+
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return;
+  }
+
+  tbl = &table_iter->second;
+
+  /* the table can't change while we hold the lock, so the position of each
+     row block is computed once */
+  uint64_t first_row = 0;
+  for (const auto& rblock : tbl->row_map) {
+    block_first_row.emplace_back(first_row);
+    first_row += rblock.row_count;
+  }
+}
+
+cursor::~cursor() {
+  pthread_rwlock_unlock(&db->lock);
+}
+
+void cursor::advise(zdb_cursor_advise_t a) {
+  advice = a;
+}
+
+int cursor::use(const std::string& column) {
+  for (const auto& c : tbl->columns) {
+    if (c.name != column) {
+      continue;
+    }
+
+    /* until the first call every column is used */
+    if (used.empty()) {
+      used.assign(tbl->columns.size(), false);
+    }
+
+    used[c.id] = true;
+    return ZDB_SUCCESS;
+  }
+
+  return ZDB_ERR_NOTFOUND;
+}
+
+int cursor::filter(const predicate& pred) {
+  if (!check_predicate(*tbl, pred)) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  filters.emplace_back(pred);
+  filter_block = size_t(-1);
+  return ZDB_SUCCESS;
+}
+
+size_t cursor::filter_chunk(size_t row_block, uint64_t offset) {
+  if (row_block != filter_block ||
+      offset < filter_begin ||
+      offset >= filter_end) {
+    const auto& rblock = tbl->row_map[row_block];
+    filter_block = row_block;
+    filter_begin = offset - offset % kFilterRows;
+    filter_end = std::min(filter_begin + kFilterRows, rblock.row_count);
+
+    if (!evaluate_predicates(
+            *tbl,
+            rblock,
+            filter_begin,
+            filter_end,
+            filters,
+            &filter_mask,
+            &filter_scratch)) {
+      filter_mask.assign(filter_end - filter_begin, 0);
+    }
+  }
+
+  return filter_end - offset;
+}
+
+int cursor::next() {
+  for (;;) {
+    size_t run_block;
+    uint64_t run_offset;
+    if (next_run(1, &run_block, &run_offset) == 0) {
+      return ZDB_ERR_NOTFOUND;
+    }
+
+    if (filters.empty()) {
+      return ZDB_SUCCESS;
+    }
+
+    filter_chunk(run_block, run_offset);
+    if (filter_mask[run_offset - filter_begin]) {
+      return ZDB_SUCCESS;
+    }
+  }
+}
+
+uint32_t cursor::tell() const {
+  return position;
+}
+
+size_t cursor::next_run(
+    size_t max_rows,
+    size_t* run_block,
+    uint64_t* run_offset) {
+  const auto& row_map = tbl->row_map;
+  if (max_rows == 0) {
+    return 0;
+  }
+
+  /* find the first row after the cursor */
+  auto b = started ? block : 0;
+  auto offset = started ? block_offset + 1 : 0;
+  while (b < row_map.size() && offset >= row_map[b].row_count) {
+    ++b;
+    offset = 0;
+  }
+
+  /* leave the cursor past the last row */
+  if (b >= row_map.size()) {
+    started = true;
+    block = row_map.size();
+    block_offset = 0;
+    return 0;
+  }
+
+  /* the pages of the next row block are separate allocations that the
+     hardware prefetcher can't predict, so touch them when entering a block */
+  if (advice == ZDB_FETCH_AHEAD &&
+      offset == 0 &&
+      b + 1 < row_map.size()) {
+    const auto& next_columns = row_map[b + 1].columns;
+    for (size_t i = 0; i < next_columns.size(); ++i) {
+      auto page = next_columns[i].page;
+      if (is_used(i) && page && page->size() > 0) {
+        __builtin_prefetch(page->data());
+      }
+    }
+  }
+
+  auto n = std::min(uint64_t(max_rows), row_map[b].row_count - offset);
+  *run_block = b;
+  *run_offset = offset;
+
+  position = started ? position + n : n - 1;
+  started = true;
+  block = b;
+  block_offset = offset + n - 1;
+  return n;
+}
+
+bool cursor::is_used(int column) const {
+  return used.empty() || used[column];
+}
+
+bool cursor::check_columns(const int* columns, size_t columns_count) const {
+  for (size_t i = 0; i < columns_count; ++i) {
+    if (columns[i] < 0 || size_t(columns[i]) >= tbl->columns.size()) {
+      return false;
+    }
+
+    if (!is_used(columns[i])) {
+      return false;
+    }
+
+    if (tbl->columns[columns[i]].type == ZDB_STRING) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+size_t cursor::gather_filtered(
+    size_t run_block,
+    uint64_t run_offset,
+    size_t run_length,
+    const int* columns,
+    void** buffers,
+    size_t columns_count,
+    size_t first) {
+  const auto& rblock = tbl->row_map[run_block];
+
+  size_t copied = 0;
+  for (size_t i = 0; i < run_length; ) {
+    auto offset = run_offset + i;
+    auto n = std::min(run_length - i, filter_chunk(run_block, offset));
+    auto mask = filter_mask.data() + (offset - filter_begin);
+
+    size_t matched = 0;
+    for (size_t j = 0; j < n; ++j) {
+      matched += mask[j];
+    }
+
+    /* only the values of the matching rows are read. values that are missing
+       from the page are returned as zero */
+    for (size_t c = 0; matched > 0 && c < columns_count; ++c) {
+      auto vsize = type_size(tbl->columns[columns[c]].type);
+      auto dst = static_cast<char*>(buffers[c]) + (first + copied) * vsize;
+      auto page = rblock.columns[columns[c]].page;
+      auto avail = page ? page->size() : 0;
+      auto src = page ? static_cast<const char*>(page->data()) : nullptr;
+      for (size_t j = 0; j < n; ++j) {
+        if (!mask[j]) {
+          continue;
+        }
+
+        if (offset + j < avail) {
+          memcpy(dst, src + (offset + j) * vsize, vsize);
+        } else {
+          memset(dst, 0, vsize);
+        }
+
+        dst += vsize;
+      }
+    }
+
+    copied += matched;
+    i += n;
+  }
+
+  return copied;
+}
+
+int cursor::next_batch(
+    const int* columns,
+    void** buffers,
+    size_t columns_count,
+    size_t max_rows,
+    size_t* rows) {
+  if (!check_columns(columns, columns_count)) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  *rows = 0;
+  while (*rows < max_rows) {
+    size_t run_block;
+    uint64_t run_offset;
+    auto n = next_run(max_rows - *rows, &run_block, &run_offset);
+    if (n == 0) {
+      break;
+    }
+
+    const auto& rblock = tbl->row_map[run_block];
+    if (!filters.empty()) {
+      *rows += gather_filtered(
+          run_block,
+          run_offset,
+          n,
+          columns,
+          buffers,
+          columns_count,
+          *rows);
+      continue;
+    }
+
+    /* copy the run from each column page. values that are missing from the
+       page are returned as zero */
+    for (size_t i = 0; i < columns_count; ++i) {
+      auto vsize = type_size(tbl->columns[columns[i]].type);
+      auto dst = static_cast<char*>(buffers[i]) + *rows * vsize;
+      auto page = rblock.columns[columns[i]].page;
+
+      uint64_t avail = 0;
+      if (page && page->size() > run_offset) {
+        avail = std::min(uint64_t(n), page->size() - run_offset);
+        memcpy(
+            dst,
+            static_cast<const char*>(page->data()) + run_offset * vsize,
+            avail * vsize);
+      }
+
+      memset(dst + avail * vsize, 0, (n - avail) * vsize);
+    }
+
+    *rows += n;
+  }
+
+  return ZDB_SUCCESS;
+}
+
+int cursor::next_batch_borrow(
+    const int* columns,
+    const void** buffers,
+    size_t columns_count,
+    size_t max_rows,
+    size_t* rows) {
+  if (!check_columns(columns, columns_count) || !filters.empty()) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  size_t run_block;
+  uint64_t run_offset;
+  *rows = next_run(max_rows, &run_block, &run_offset);
+  if (*rows == 0) {
+    return ZDB_SUCCESS;
+  }
+
+  const auto& rblock = tbl->row_map[run_block];
+  for (size_t i = 0; i < columns_count; ++i) {
+    auto vsize = type_size(tbl->columns[columns[i]].type);
+    auto page = rblock.columns[columns[i]].page;
+    if (page && page->size() >= run_offset + *rows) {
+      buffers[i] = static_cast<const char*>(page->data()) + run_offset * vsize;
+    } else {
+      buffers[i] = nullptr;
+    }
+  }
+
+  return ZDB_SUCCESS;
+}
+
+bool cursor::find_row(
+    uint64_t row,
+    size_t* row_block,
+    uint64_t* offset) const {
+  auto iter = std::upper_bound(
+      block_first_row.begin(),
+      block_first_row.end(),
+      row);
+
+  if (iter == block_first_row.begin()) {
+    return false;
+  }
+
+  /* skip back over empty blocks */
+  auto b = size_t(iter - block_first_row.begin()) - 1;
+  if (row - block_first_row[b] >= tbl->row_map[b].row_count) {
+    return false;
+  }
+
+  *row_block = b;
+  *offset = row - block_first_row[b];
+  return true;
+}
+
+int cursor::read_rows(
+    const uint64_t* rows,
+    size_t rows_count,
+    const int* columns,
+    void** buffers,
+    size_t columns_count) {
+  if (!check_columns(columns, columns_count)) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  for (size_t r = 0; r < rows_count; ++r) {
+    size_t row_block;
+    uint64_t offset;
+    if (!find_row(rows[r], &row_block, &offset)) {
+      return ZDB_ERR_NOTFOUND;
+    }
+
+    const auto& rblock = tbl->row_map[row_block];
+    for (size_t i = 0; i < columns_count; ++i) {
+      auto vsize = type_size(tbl->columns[columns[i]].type);
+      auto dst = static_cast<char*>(buffers[i]) + r * vsize;
+      auto page = rblock.columns[columns[i]].page;
+      if (page && offset < page->size()) {
+        memcpy(
+            dst,
+            static_cast<const char*>(page->data()) + offset * vsize,
+            vsize);
+      } else {
+        memset(dst, 0, vsize);
+      }
+    }
+  }
+
+  return ZDB_SUCCESS;
+}
+
+int cursor::seek_row(uint64_t row) {
+  size_t row_block;
+  uint64_t offset;
+  if (!find_row(row, &row_block, &offset)) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  started = true;
+  block = row_block;
+  block_offset = offset;
+  position = row;
+  return ZDB_SUCCESS;
+}
+
+int cursor::seek_position(uint32_t index) {
+  return seek_row(index);
+}
+
+template <typename T>
+int cursor::seek_primary_key(T key, zdb_type_t type) {
+  if (tbl->columns.empty() || tbl->columns[0].type != type) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  if (tbl->primary_index) {
+    uint64_t index_key;
+    uint64_t row;
+    if (!get_index_key(type, &key, &index_key) ||
+        !tbl->primary_index->find(index_key, &row)) {
+      return ZDB_ERR_NOTFOUND;
+    }
+
+    return seek_row(row);
+  }
+
+  for (size_t b = 0; b < tbl->row_map.size(); ++b) {
+    const auto& rblock = tbl->row_map[b];
+    auto page = rblock.columns[0].page;
+    if (!page) {
+      continue;
+    }
+
+    auto values = static_cast<const T*>(page->data());
+    auto n = std::min(uint64_t(page->size()), rblock.row_count);
+    for (uint64_t i = 0; i < n; ++i) {
+      if (values[i] == key) {
+        return seek_row(block_first_row[b] + i);
+      }
+    }
+  }
+
+  return ZDB_ERR_NOTFOUND;
+}
+
+int cursor::seek_primary_key_uint32(uint32_t key) {
+  return seek_primary_key<uint32_t>(key, ZDB_UINT32);
+}
+
+int cursor::seek_primary_key_uint64(uint64_t key) {
+  return seek_primary_key<uint64_t>(key, ZDB_UINT64);
+}
+
+int cursor::seek_primary_key_int32(int32_t key) {
+  return seek_primary_key<int32_t>(key, ZDB_INT32);
+}
+
+int cursor::seek_primary_key_int64(int64_t key) {
+  return seek_primary_key<int64_t>(key, ZDB_INT64);
+}
+
+int cursor::seek_primary_key_float32(float key) {
+  return seek_primary_key<float>(key, ZDB_FLOAT32);
+}
+
+int cursor::seek_primary_key_float64(double key) {
+  return seek_primary_key<double>(key, ZDB_FLOAT64);
+}
+
+template <typename T>
+T cursor::get_value(int column, zdb_type_t type) {
+  assert(started && block < tbl->row_map.size());
+  assert(column >= 0 && size_t(column) < tbl->columns.size());
+  assert(tbl->columns[column].type == type);
+  assert(is_used(column));
+
+  auto page = tbl->row_map[block].columns[column].page;
+  if (!page || block_offset >= page->size()) {
+    return T();
+  }
+
+  return static_cast<const T*>(page->data())[block_offset];
+}
+
+bool cursor::get_bool(int column) {
+  return get_value<uint8_t>(column, ZDB_BOOL);
+}
+
+uint32_t cursor::get_uint32(int column) {
+  return get_value<uint32_t>(column, ZDB_UINT32);
+}
+
+uint64_t cursor::get_uint64(int column) {
+  return get_value<uint64_t>(column, ZDB_UINT64);
+}
+
+int32_t cursor::get_int32(int column) {
+  return get_value<int32_t>(column, ZDB_INT32);
+}
+
+int64_t cursor::get_int64(int column) {
+  return get_value<int64_t>(column, ZDB_INT64);
+}
+
+float cursor::get_float32(int column) {
+  return get_value<float>(column, ZDB_FLOAT32);
+}
+
+double cursor::get_float64(int column) {
+  return get_value<double>(column, ZDB_FLOAT64);
+}
+
+} // namespace zdb
+
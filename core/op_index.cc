@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include "zdb.h"
+#include "lock.h"
+#include "database.h"
+
+namespace zdb {
+
+zdb_err_t primary_index_add(database_ref db, const std::string& table_name) {
+  assert(!!db);
+
+  /* check that database is not readonly */
+  if (db->readonly) {
+    return ZDB_ERR_READONLY;
+  }
+
+  /* acquire write lock */
+  lock_guard lk(&db->lock);
+  lk.lock_write();
+
+  /* find table */
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  auto& table = table_iter->second;
+
+  /* check arguments */
+  if (table.columns.empty() || table.columns[0].type == ZDB_STRING) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  if (table.primary_index) {
+    return ZDB_ERR_EXISTS;
+  }
+
+  /* index the existing rows */
+  std::unique_ptr<hash_index> index(new hash_index());
+  auto type = table.columns[0].type;
+  auto vsize = type_size(type);
+  uint64_t first_row = 0;
+  for (const auto& rblock : table.row_map) {
+    auto page = rblock.columns[0].page;
+    auto n = page ? std::min(uint64_t(page->size()), rblock.row_count) : 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      uint64_t key;
+      if (get_index_key(
+              type,
+              static_cast<const char*>(page->data()) + i * vsize,
+              &key)) {
+        index->insert(key, first_row + i);
+      }
+    }
+
+    first_row += rblock.row_count;
+  }
+
+  table.primary_index = std::move(index);
+  return ZDB_SUCCESS;
+}
+
+zdb_err_t index_add(
+    database_ref db,
+    const std::string& table_name,
+    int column) {
+  assert(!!db);
+
+  /* check that database is not readonly */
+  if (db->readonly) {
+    return ZDB_ERR_READONLY;
+  }
+
+  /* acquire write lock */
+  lock_guard lk(&db->lock);
+  lk.lock_write();
+
+  /* find table */
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  auto& table = table_iter->second;
+
+  /* check arguments */
+  if (column < 0 || size_t(column) >= table.columns.size()) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  auto index = make_secondary_index(table.columns[column].type);
+  if (!index) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  if (table.secondary_indexes.count(column)) {
+    return ZDB_ERR_EXISTS;
+  }
+
+  /* index the existing rows */
+  auto vsize = type_size(table.columns[column].type);
+  uint64_t first_row = 0;
+  for (const auto& rblock : table.row_map) {
+    auto page = rblock.columns[column].page;
+    auto n = page ? std::min(uint64_t(page->size()), rblock.row_count) : 0;
+    for (uint64_t i = 0; i < n; ++i) {
+      index->insert(
+          static_cast<const char*>(page->data()) + i * vsize,
+          first_row + i);
+    }
+
+    first_row += rblock.row_count;
+  }
+
+  table.secondary_indexes.emplace(column, std::move(index));
+  return ZDB_SUCCESS;
+}
+
+} // namespace zdb
+
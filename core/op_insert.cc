@@ -56,6 +56,27 @@ zdb_err_t put_raw(
     rblock->columns[i].page->append(tuple_vals[i], tuple_lengths[i]);
   }
 
+  /* keep the indexes up to date. rows are found by the position of their
+     values in the pages, which is behind the row count of the table if tuples
+     without all columns were inserted */
+  auto first_row = table.row_count - rblock->row_count;
+  uint64_t key;
+  if (table.primary_index &&
+      tuple_count > 0 &&
+      get_index_key(table.columns[0].type, tuple_vals[0], &key)) {
+    table.primary_index->insert(
+        key,
+        first_row + rblock->columns[0].page->size() - 1);
+  }
+
+  for (const auto& index : table.secondary_indexes) {
+    if (size_t(index.first) < tuple_count) {
+      index.second->insert(
+          tuple_vals[index.first],
+          first_row + rblock->columns[index.first].page->size() - 1);
+    }
+  }
+
   rblock->row_count++;
   table.row_count++;
 
@@ -9,6 +9,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
 #include <set>
 #include <vector>
 #include "tsdb.h"
@@ -17,39 +21,148 @@
 
 namespace tsdb {
 
+/* the number of series indexes that are read ahead at once */
+static const size_t kLoadBatchSize = 1024;
+
+/**
+ * Ask the kernel to read ahead the series indexes in [begin, begin + n).
+ * The indexes are sorted by disk address, so adjacent indexes are merged into
+ * a single request
+ */
+static void adviseWillNeed(
+    int fd,
+    size_t bsize,
+    const std::vector<SeriesIndexRef>& series_indexes,
+    size_t begin,
+    size_t n) {
+#ifdef HAVE_POSIX_FADVISE
+  auto end = std::min(begin + n, series_indexes.size());
+  bool have_run = false;
+  uint64_t run_addr = 0;
+  uint64_t run_end = 0;
+  for (auto i = begin; i < end; ++i) {
+    const auto& series_index = series_indexes[i];
+    auto disk_addr = series_index.disk_addr * bsize;
+    auto disk_size = series_index.disk_size * bsize;
+    if (have_run && disk_addr > run_end) {
+      posix_fadvise(fd, run_addr, run_end - run_addr, POSIX_FADV_WILLNEED);
+      have_run = false;
+    }
+
+    if (!have_run) {
+      run_addr = disk_addr;
+      run_end = disk_addr;
+      have_run = true;
+    }
+
+    run_end = std::max(run_end, disk_addr + disk_size);
+  }
+
+  if (have_run) {
+    posix_fadvise(fd, run_addr, run_end - run_addr, POSIX_FADV_WILLNEED);
+  }
+#endif
+}
+
+static void decodeSeriesIndexRecords(
+    const char* records,
+    size_t nrecords,
+    std::vector<SeriesIndexRef>* series_indexes) {
+  series_indexes->resize(nrecords);
+  for (size_t i = 0; i < nrecords; ++i) {
+    auto record = records + i * sizeof(SeriesIndexRef);
+    (*series_indexes)[i].series_id = readUInt64LE(record);
+    (*series_indexes)[i].disk_addr = readUInt64LE(record + 8);
+    (*series_indexes)[i].disk_size = readUInt64LE(record + 16);
+  }
+}
+
 bool TSDB::load() {
   uint64_t txn_addr;
   uint64_t txn_size;
 
-  /* read metablock */
+  /* read the metablock slots and pick the newest valid one */
   {
-    std::string metablock;
-    metablock.resize(kMetaBlockSize);
+    std::string metablocks;
+    metablocks.resize(kMetaBlockSize * kMetaBlockCount);
 
-    if (pread(fd_, &metablock[0], metablock.size(), 0) <= 0) {
+    auto rc = pread(fd_, &metablocks[0], metablocks.size(), 0);
+    if (rc <= 0) {
       return false;
     }
 
-    if (memcmp(metablock.data(), kMagicBytes, sizeof(kMagicBytes)) != 0) {
+    bool found = false;
+    MetaBlock metablock;
+    for (size_t i = 0; i < kMetaBlockCount; ++i) {
+      auto slot_begin = i * kMetaBlockSize;
+      if (slot_begin >= size_t(rc)) {
+        break;
+      }
+
+      MetaBlock slot;
+      if (!decodeMetaBlock(
+            &metablocks[slot_begin],
+            std::min(kMetaBlockSize, size_t(rc) - slot_begin),
+            &slot)) {
+        continue;
+      }
+
+      /* files with fewer slots (e.g. unversioned files) may store page data
+         where the other slots would be */
+      if (i >= slot.slots) {
+        continue;
+      }
+
+      if (!found || slot.sequence > metablock.sequence) {
+        metablock = slot;
+        found = true;
+      }
+    }
+
+    if (!found) {
       return false;
     }
 
-    const char* metablock_cur = &metablock[0] + sizeof(kMagicBytes);
-    const char* metablock_end = &metablock[0] + metablock.size();
-    if (!readVarUInt(&metablock_cur, metablock_end, &txn_addr)) {
+    txn_addr = metablock.txn_addr;
+    txn_size = metablock.txn_size;
+    fpos_ = metablock.fpos;
+    meta_sequence_ = metablock.sequence;
+    meta_slots_ = metablock.slots;
+  }
+
+  /* everything between fpos and the end of the file was preallocated by a
+     previous writer and can be handed out without growing the file */
+  {
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
       return false;
     }
 
-    if (!readVarUInt(&metablock_cur, metablock_end, &txn_size)) {
+    fsize_ = std::max(fpos_, size_t(st.st_size));
+  }
+
+  /* read the transaction header to find out which format it uses */
+  {
+    std::string txn_header;
+    txn_header.resize(std::min(txn_size, uint64_t(kTxnHeaderSize)));
+    if (pread(fd_, &txn_header[0], txn_header.size(), txn_addr) <= 0) {
       return false;
     }
 
-    uint64_t fpos;
-    if (readVarUInt(&metablock_cur, metablock_end, &fpos)) {
-      fpos_ = fpos;
-    } else {
+    const char* txn_header_cur = &txn_header[0];
+    const char* txn_header_end = txn_header_cur + txn_header.size();
+
+    uint64_t flags;
+    uint64_t bsize;
+    if (!readVarUInt(&txn_header_cur, txn_header_end, &flags) ||
+        !readVarUInt(&txn_header_cur, txn_header_end, &bsize)) {
       return false;
     }
+
+    if (flags & kTxnFlagFixedLayout) {
+      bsize_ = bsize;
+      return loadFixedTransaction(txn_addr, txn_size);
+    }
   }
 
   /* read transaction */
@@ -83,42 +196,198 @@ bool TSDB::load() {
     return false;
   }
 
+  /* parse the full list of series indexes first */
+  std::vector<SeriesIndexRef> series_indexes;
   while (txn_data_cur < txn_data_end) {
-    uint64_t series_id;
-    if (!readVarUInt(&txn_data_cur, txn_data_end, &series_id)) {
+    SeriesIndexRef series_index;
+    if (!readVarUInt(&txn_data_cur, txn_data_end, &series_index.series_id)) {
       return false;
     }
 
-    if (series_id == 0) {
+    if (series_index.series_id == 0) {
       break;
     }
 
-    uint64_t seriesidx_disk_addr;
-    uint64_t seriesidx_disk_size;
-    if (!readVarUInt(&txn_data_cur, txn_data_end, &seriesidx_disk_addr)) {
+    if (!readVarUInt(&txn_data_cur, txn_data_end, &series_index.disk_addr)) {
       return false;
     }
 
-    if (!readVarUInt(&txn_data_cur, txn_data_end, &seriesidx_disk_size)) {
+    if (!readVarUInt(&txn_data_cur, txn_data_end, &series_index.disk_size)) {
       return false;
     }
 
-    // FIXME preload next N transaction pages using fadivse(WILLNEED)
+    series_indexes.emplace_back(series_index);
+  }
 
-    seriesidx_disk_addr *= bsize_;
-    seriesidx_disk_size *= bsize_;
-    if (!loadTransaction(series_id, seriesidx_disk_addr, seriesidx_disk_size)) {
-      return false;
-    }
+  /* unless all series are preloaded, only the table of series index
+     locations is kept in memory. each series index is loaded on first
+     access */
+  if (preload_series_) {
+    return loadSeries(&series_indexes);
   }
 
+  std::sort(
+      series_indexes.begin(),
+      series_indexes.end(),
+      [] (const SeriesIndexRef& a, const SeriesIndexRef& b) {
+        return a.series_id < b.series_id;
+      });
+
+  lazy_series_buf_ = std::move(series_indexes);
+  lazy_series_ = lazy_series_buf_.data();
+  lazy_series_count_ = lazy_series_buf_.size();
   return true;
 }
 
+bool TSDB::loadFixedTransaction(uint64_t txn_addr, uint64_t txn_size) {
+  auto records_offset = kTxnHeaderSize + sizeof(uint64_t);
+  if (txn_size < records_offset) {
+    return false;
+  }
+
+  /* accessing a mapping past the end of the file raises SIGBUS, so a
+     truncated file has to be rejected before it is mapped */
+  struct stat st;
+  if (fstat(fd_, &st) != 0 ||
+      txn_addr > uint64_t(st.st_size) ||
+      txn_size > uint64_t(st.st_size) - txn_addr) {
+    return false;
+  }
+
+  /* map the transaction. the records are 8 byte aligned since transactions
+     start at a block boundary */
+  auto map_addr = txn_addr - txn_addr % sysconf(_SC_PAGESIZE);
+  auto map_size = txn_addr + txn_size - map_addr;
+  auto map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd_, map_addr);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  txn_mmap_ = map;
+  txn_mmap_size_ = map_size;
+
+  auto txn_data = (const char*) map + (txn_addr - map_addr);
+  auto nseries = readUInt64LE(txn_data + kTxnHeaderSize);
+  if (nseries > (txn_size - records_offset) / sizeof(SeriesIndexRef)) {
+    return false;
+  }
+
+  auto records = txn_data + records_offset;
+  if (preload_series_) {
+    std::vector<SeriesIndexRef> series_indexes;
+    decodeSeriesIndexRecords(records, nseries, &series_indexes);
+    munmap(txn_mmap_, txn_mmap_size_);
+    txn_mmap_ = nullptr;
+    txn_mmap_size_ = 0;
+    return loadSeries(&series_indexes);
+  }
+
+  /* the records are sorted by series id, so on little endian machines they
+     are used as the lazy series table as they are */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  lazy_series_ = (const SeriesIndexRef*) records;
+#else
+  decodeSeriesIndexRecords(records, nseries, &lazy_series_buf_);
+  lazy_series_ = lazy_series_buf_.data();
+#endif
+
+  lazy_series_count_ = nseries;
+  return true;
+}
+
+bool TSDB::loadSeries(std::vector<SeriesIndexRef>* series_indexes_ptr) {
+  auto& series_indexes = *series_indexes_ptr;
+
+  /* load the series indexes in disk order as a single set of tasks. the jobs
+     are handed out in order, so the tasks advance through the file together;
+     whenever a task starts a new batch it advises the kernel to read ahead
+     the batch after it */
+  std::sort(
+      series_indexes.begin(),
+      series_indexes.end(),
+      [] (const SeriesIndexRef& a, const SeriesIndexRef& b) {
+        return a.disk_addr < b.disk_addr;
+      });
+
+  adviseWillNeed(fd_, bsize_, series_indexes, 0, kLoadBatchSize);
+
+  std::atomic<bool> success(true);
+  runParallel(series_indexes.size(), load_threads_, [&] (size_t i) {
+    if (!success) {
+      return;
+    }
+
+    if (i % kLoadBatchSize == 0) {
+      adviseWillNeed(
+          fd_,
+          bsize_,
+          series_indexes,
+          i + kLoadBatchSize,
+          kLoadBatchSize);
+    }
+
+    const auto& series_index = series_indexes[i];
+    std::unique_ptr<PageIndex> page_index;
+    if (!loadTransaction(
+          series_index.disk_addr * bsize_,
+          series_index.disk_size * bsize_,
+          &page_index) ||
+        !txn_map_.createSlot(series_index.series_id, std::move(page_index))) {
+      success = false;
+    }
+  });
+
+  return success;
+}
+
+const SeriesIndexRef* TSDB::findLazySeries(uint64_t series_id) const {
+  auto end = lazy_series_ + lazy_series_count_;
+  auto iter = std::lower_bound(
+      lazy_series_,
+      end,
+      series_id,
+      [] (const SeriesIndexRef& a, uint64_t b) {
+        return a.series_id < b;
+      });
+
+  if (iter == end || iter->series_id != series_id) {
+    return nullptr;
+  }
+
+  return iter;
+}
+
+bool TSDB::ensureSeriesLoaded(uint64_t series_id) {
+  auto series_index = findLazySeries(series_id);
+  if (!series_index) {
+    return true;
+  }
+
+  /* the series might have been loaded already. holding the stripe lock
+     while checking and loading makes sure it is loaded at most once */
+  std::unique_lock<std::mutex> lk(
+      lazy_load_mutex_[series_id % kLazyLoadStripes]);
+
+  Transaction txn;
+  if (txn_map_.startTransaction(series_id, true, &txn)) {
+    return true;
+  }
+
+  std::unique_ptr<PageIndex> page_index;
+  if (!loadTransaction(
+        series_index->disk_addr * bsize_,
+        series_index->disk_size * bsize_,
+        &page_index)) {
+    return false;
+  }
+
+  return txn_map_.createSlot(series_id, std::move(page_index));
+}
+
 bool TSDB::loadTransaction(
-    uint64_t series_id,
     uint64_t disk_addr,
-    uint64_t disk_size) {
+    uint64_t disk_size,
+    std::unique_ptr<PageIndex>* page_index) {
   std::string index_data;
   index_data.resize(disk_size);
 
@@ -130,6 +399,12 @@ bool TSDB::loadTransaction(
   posix_fadvise(fd_, disk_addr, disk_size, POSIX_FADV_DONTNEED);
 #endif
 
+  /* fixed layout series indexes start with a zero word. a zero value size is
+     invalid in the varint format */
+  if (index_data[0] == 0) {
+    return loadFixedSeriesIndex(index_data, disk_addr, disk_size, page_index);
+  }
+
   const char* index_data_cur = &index_data[0];
   const char* index_data_end = index_data_cur + index_data.size();
 
@@ -159,13 +434,16 @@ bool TSDB::loadTransaction(
 
   page_idx->setDiskSnapshot(disk_addr, disk_size);
 
-  if (!page_idx->alloc(index_len)) {
+  /* every page takes at least two bytes in the index */
+  if (index_len == 0 ||
+      index_len > size_t(index_data_end - index_data_cur) / 2) {
     return false;
   }
 
-  for (size_t i = 1; i < index_len; ++i) {
-    auto point = &page_idx->getSplitpoints()[i - 1].point;
-    if (!readVarUInt(&index_data_cur, index_data_end, point)) {
+  std::shared_ptr<PageIndexVersion> version(new PageIndexVersion());
+  version->splitpoints.resize(index_len - 1);
+  for (auto& splitpoint : version->splitpoints) {
+    if (!readVarUInt(&index_data_cur, index_data_end, &splitpoint.point)) {
       return false;
     }
   }
@@ -181,15 +459,80 @@ bool TSDB::loadTransaction(
       return false;
     }
 
-    auto page_id = page_map_.addColdPage(
+    PageIndexEntry entry;
+    entry.page_id = page_map_.addColdPage(
         value_size,
         page_addr * bsize_,
         page_size * bsize_);
 
-    page_idx->getEntries()[i].page_id = page_id;
+    version->entries.emplace_back(entry);
   }
 
-  return txn_map_.createSlot(series_id, std::move(page_idx));
+  page_idx->setVersion(std::move(version));
+
+  *page_index = std::move(page_idx);
+  return true;
+}
+
+bool TSDB::loadFixedSeriesIndex(
+    const std::string& index_data,
+    uint64_t disk_addr,
+    uint64_t disk_size,
+    std::unique_ptr<PageIndex>* page_index) {
+  auto data = index_data.data();
+  auto size = index_data.size();
+  if (size < kFixedSeriesIndexHeaderSize) {
+    return false;
+  }
+
+  auto value_size = readUInt64LE(data + 8);
+  auto metadata_len = readUInt64LE(data + 16);
+  auto index_len = readUInt64LE(data + 24);
+  if (value_size == 0 ||
+      index_len == 0 ||
+      index_len > size / (sizeof(uint64_t) * 2) ||
+      metadata_len > size) {
+    return false;
+  }
+
+  /* the metadata is padded so that all following fields are aligned */
+  auto metadata_offset = kFixedSeriesIndexHeaderSize;
+  auto splitpoints_offset =
+      metadata_offset + (metadata_len + sizeof(uint64_t) - 1) /
+      sizeof(uint64_t) * sizeof(uint64_t);
+  auto pages_offset =
+      splitpoints_offset + (index_len - 1) * sizeof(uint64_t);
+  if (pages_offset + index_len * sizeof(uint64_t) * 2 > size) {
+    return false;
+  }
+
+  std::unique_ptr<PageIndex> page_idx(
+      new PageIndex(
+          value_size,
+          std::string(data + metadata_offset, metadata_len)));
+
+  page_idx->setDiskSnapshot(disk_addr, disk_size);
+
+  std::shared_ptr<PageIndexVersion> version(new PageIndexVersion());
+  version->splitpoints.resize(index_len - 1);
+  for (size_t i = 0; i < index_len - 1; ++i) {
+    version->splitpoints[i].point = readUInt64LE(
+        data + splitpoints_offset + i * sizeof(uint64_t));
+  }
+
+  version->entries.resize(index_len);
+  for (size_t i = 0; i < index_len; ++i) {
+    auto page = data + pages_offset + i * sizeof(uint64_t) * 2;
+    version->entries[i].page_id = page_map_.addColdPage(
+        value_size,
+        readUInt64LE(page) * bsize_,
+        readUInt64LE(page + sizeof(uint64_t)) * bsize_);
+  }
+
+  page_idx->setVersion(std::move(version));
+
+  *page_index = std::move(page_idx);
+  return true;
 }
 
 } // namespace tsdb
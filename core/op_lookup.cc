@@ -0,0 +1,249 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+#include "zdb.h"
+#include "lock.h"
+#include "database.h"
+
+namespace zdb {
+
+/* matches are copied this many matches after their values are prefetched */
+static const size_t kLookupPrefetch = 8;
+
+/* a row that matches the key at index key of the batch */
+struct key_match {
+  size_t row_block;
+  uint64_t offset;
+  size_t key;
+};
+
+/* find the first row for every key in the batch. the primary key page of each
+   row block is read once for the whole batch */
+template <typename T>
+static void find_keys(
+    const table& tbl,
+    const T* keys,
+    size_t keys_count,
+    std::vector<key_match>* matches) {
+  /* the distinct keys of the batch. keys that are in the batch more than once
+     are chained through next */
+  std::unordered_map<T, size_t> batch;
+  std::vector<size_t> next(keys_count, size_t(-1));
+  batch.reserve(keys_count);
+  for (size_t k = 0; k < keys_count; ++k) {
+    auto iter = batch.emplace(keys[k], k);
+    if (!iter.second) {
+      next[k] = iter.first->second;
+      iter.first->second = k;
+    }
+  }
+
+  for (size_t b = 0; b < tbl.row_map.size() && !batch.empty(); ++b) {
+    const auto& rblock = tbl.row_map[b];
+    auto page = rblock.columns[0].page;
+    if (!page) {
+      continue;
+    }
+
+    auto values = static_cast<const T*>(page->data());
+    auto n = std::min(uint64_t(page->size()), rblock.row_count);
+    for (uint64_t i = 0; i < n && !batch.empty(); ++i) {
+      auto iter = batch.find(values[i]);
+      if (iter == batch.end()) {
+        continue;
+      }
+
+      for (auto k = iter->second; k != size_t(-1); k = next[k]) {
+        matches->emplace_back(key_match{b, i, k});
+      }
+
+      batch.erase(iter);
+    }
+  }
+}
+
+/* resolve the keys with the primary key index. the bucket of a later key is
+   prefetched before each probe so that the misses of different keys
+   overlap */
+static void find_keys_indexed(
+    const table& tbl,
+    const void* keys,
+    size_t keys_count,
+    std::vector<key_match>* matches) {
+  const auto& index = *tbl.primary_index;
+  auto type = tbl.columns[0].type;
+  auto vsize = type_size(type);
+  auto get_key = [keys, type, vsize] (size_t k, uint64_t* key) {
+    return get_index_key(
+        type,
+        static_cast<const char*>(keys) + k * vsize,
+        key);
+  };
+
+  std::vector<uint64_t> block_first_row;
+  uint64_t first_row = 0;
+  for (const auto& rblock : tbl.row_map) {
+    block_first_row.emplace_back(first_row);
+    first_row += rblock.row_count;
+  }
+
+  for (size_t k = 0; k < keys_count; ++k) {
+    uint64_t key;
+    if (k + kLookupPrefetch < keys_count &&
+        get_key(k + kLookupPrefetch, &key)) {
+      index.prefetch(key);
+    }
+
+    uint64_t row;
+    if (!get_key(k, &key) || !index.find(key, &row)) {
+      continue;
+    }
+
+    auto iter = std::upper_bound(
+        block_first_row.begin(),
+        block_first_row.end(),
+        row);
+
+    auto b = size_t(iter - block_first_row.begin()) - 1;
+    matches->emplace_back(key_match{b, row - block_first_row[b], k});
+  }
+}
+
+static bool find_keys(
+    const table& tbl,
+    const void* keys,
+    size_t keys_count,
+    std::vector<key_match>* matches) {
+  switch (tbl.columns[0].type) {
+    case ZDB_BOOL:
+      find_keys(tbl, static_cast<const uint8_t*>(keys), keys_count, matches);
+      return true;
+    case ZDB_UINT32:
+      find_keys(tbl, static_cast<const uint32_t*>(keys), keys_count, matches);
+      return true;
+    case ZDB_UINT64:
+      find_keys(tbl, static_cast<const uint64_t*>(keys), keys_count, matches);
+      return true;
+    case ZDB_INT32:
+      find_keys(tbl, static_cast<const int32_t*>(keys), keys_count, matches);
+      return true;
+    case ZDB_INT64:
+      find_keys(tbl, static_cast<const int64_t*>(keys), keys_count, matches);
+      return true;
+    case ZDB_FLOAT32:
+      find_keys(tbl, static_cast<const float*>(keys), keys_count, matches);
+      return true;
+    case ZDB_FLOAT64:
+      find_keys(tbl, static_cast<const double*>(keys), keys_count, matches);
+      return true;
+    default:
+      return false;
+  }
+}
+
+zdb_err_t lookup_batch(
+    database_ref db,
+    const std::string& table_name,
+    const void* keys,
+    size_t keys_count,
+    const int* columns,
+    void** buffers,
+    size_t columns_count,
+    uint8_t* found) {
+  assert(!!db);
+
+  /* acquire read lock */
+  lock_guard lk(&db->lock);
+  lk.lock_read();
+
+  /* find table */
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  const auto& table = table_iter->second;
+
+  /* check arguments */
+  if (table.columns.empty()) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  std::vector<size_t> vsizes;
+  for (size_t i = 0; i < columns_count; ++i) {
+    if (columns[i] < 0 || size_t(columns[i]) >= table.columns.size()) {
+      return ZDB_ERR_INVALID_ARGUMENT;
+    }
+
+    if (table.columns[columns[i]].type == ZDB_STRING) {
+      return ZDB_ERR_INVALID_ARGUMENT;
+    }
+
+    vsizes.emplace_back(type_size(table.columns[columns[i]].type));
+  }
+
+  /* resolve the keys to rows */
+  std::vector<key_match> matches;
+  if (table.primary_index) {
+    find_keys_indexed(table, keys, keys_count, &matches);
+  } else if (!find_keys(table, keys, keys_count, &matches)) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  memset(found, 0, keys_count);
+  for (size_t i = 0; i < columns_count; ++i) {
+    memset(buffers[i], 0, keys_count * vsizes[i]);
+  }
+
+  /* copy the values in row order, so that each page is walked forward once,
+     and prefetch the values of later matches while copying */
+  std::sort(
+      matches.begin(),
+      matches.end(),
+      [] (const key_match& a, const key_match& b) {
+        return a.row_block < b.row_block ||
+            (a.row_block == b.row_block && a.offset < b.offset);
+      });
+
+  for (size_t j = 0; j < matches.size(); ++j) {
+    if (j + kLookupPrefetch < matches.size()) {
+      const auto& ahead = matches[j + kLookupPrefetch];
+      const auto& rblock = table.row_map[ahead.row_block];
+      for (size_t i = 0; i < columns_count; ++i) {
+        auto page = rblock.columns[columns[i]].page;
+        if (page && ahead.offset < page->size()) {
+          __builtin_prefetch(
+              static_cast<const char*>(page->data()) +
+              ahead.offset * vsizes[i]);
+        }
+      }
+    }
+
+    const auto& m = matches[j];
+    const auto& rblock = table.row_map[m.row_block];
+    for (size_t i = 0; i < columns_count; ++i) {
+      auto page = rblock.columns[columns[i]].page;
+      if (page && m.offset < page->size()) {
+        memcpy(
+            static_cast<char*>(buffers[i]) + m.key * vsizes[i],
+            static_cast<const char*>(page->data()) + m.offset * vsizes[i],
+            vsizes[i]);
+      }
+    }
+
+    found[m.key] = 1;
+  }
+
+  return ZDB_SUCCESS;
+}
+
+} // namespace zdb
+
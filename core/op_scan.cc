@@ -0,0 +1,318 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include <algorithm>
+#include "zdb.h"
+#include "lock.h"
+#include "database.h"
+#include "filter.h"
+#include "parallel.h"
+
+namespace zdb {
+
+/* append the positions of the rows in a morsel that match all predicates.
+   the predicates are evaluated for one chunk of the zone maps at a time so
+   that the chunks they rule out are skipped without touching the values */
+static void scan_morsel(
+    const table& tbl,
+    const morsel& m,
+    const std::vector<predicate>& predicates,
+    std::vector<uint8_t>* mask,
+    std::vector<uint8_t>* scratch,
+    std::vector<uint64_t>* rows) {
+  for (auto begin = m.begin; begin < m.end; ) {
+    auto end = std::min(begin - begin % kZoneRows + kZoneRows, m.end);
+    if (evaluate_predicates(
+            tbl,
+            tbl.row_map[m.row_block],
+            begin,
+            end,
+            predicates,
+            mask,
+            scratch)) {
+      for (size_t i = 0; i < mask->size(); ++i) {
+        if ((*mask)[i]) {
+          rows->emplace_back(m.first_row + begin + i);
+        }
+      }
+    }
+
+    begin = end;
+  }
+}
+
+/* an index is used if it returns at most this fraction of the rows */
+static const uint64_t kIndexSelectivity = 32;
+
+/* answer a scan from a secondary index if one of the predicates is on an
+   indexed column and matches few enough rows that reading them one by one is
+   cheaper than scanning the range. the other predicates are evaluated for the
+   rows that the index returns. returns false if there is no such index */
+static bool scan_index(
+    const table& tbl,
+    const std::vector<predicate>& predicates,
+    uint64_t row_begin,
+    uint64_t row_end,
+    std::vector<uint64_t>* rows) {
+  if (tbl.secondary_indexes.empty()) {
+    return false;
+  }
+
+  row_end = std::min(row_end, tbl.row_count);
+  if (row_begin >= row_end) {
+    return false;
+  }
+
+  /* pick the most selective index */
+  const predicate* best = nullptr;
+  size_t best_count = (row_end - row_begin) / kIndexSelectivity;
+  for (const auto& pred : predicates) {
+    auto index = tbl.secondary_indexes.find(pred.column);
+    if (index == tbl.secondary_indexes.end()) {
+      continue;
+    }
+
+    auto count = index->second->count(pred);
+    if (count <= best_count) {
+      best = &pred;
+      best_count = count;
+    }
+  }
+
+  if (!best) {
+    return false;
+  }
+
+  std::vector<uint64_t> candidates;
+  tbl.secondary_indexes.at(best->column)->find(*best, &candidates);
+
+  std::vector<predicate> others;
+  for (const auto& pred : predicates) {
+    if (&pred != best) {
+      others.emplace_back(pred);
+    }
+  }
+
+  /* the candidates are sorted, so the row blocks are walked forward once */
+  std::vector<uint8_t> mask;
+  std::vector<uint8_t> scratch;
+  size_t b = 0;
+  uint64_t block_begin = 0;
+  for (auto row : candidates) {
+    if (row < row_begin) {
+      continue;
+    }
+
+    if (row >= row_end) {
+      break;
+    }
+
+    while (row >= block_begin + tbl.row_map[b].row_count) {
+      block_begin += tbl.row_map[b++].row_count;
+    }
+
+    auto offset = row - block_begin;
+    if (!others.empty() &&
+        !(evaluate_predicates(
+              tbl,
+              tbl.row_map[b],
+              offset,
+              offset + 1,
+              others,
+              &mask,
+              &scratch) && mask[0])) {
+      continue;
+    }
+
+    rows->emplace_back(row);
+  }
+
+  return true;
+}
+
+static zdb_err_t scan_table(
+    database_ref db,
+    const std::string& table_name,
+    const std::vector<predicate>& predicates,
+    std::vector<uint64_t>* rows,
+    size_t threads,
+    uint64_t row_begin,
+    uint64_t row_end) {
+  assert(!!db);
+
+  /* acquire read lock */
+  lock_guard lk(&db->lock);
+  lk.lock_read();
+
+  /* find table */
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  const auto& table = table_iter->second;
+
+  /* check arguments */
+  for (const auto& pred : predicates) {
+    if (!check_predicate(table, pred)) {
+      return ZDB_ERR_INVALID_ARGUMENT;
+    }
+  }
+
+  threads = get_scan_threads(*db->sched, threads);
+
+  rows->clear();
+  if (scan_index(table, predicates, row_begin, row_end, rows)) {
+    return ZDB_SUCCESS;
+  }
+
+  /* evaluate the predicates over the part of each row block that is in the
+     row range */
+  std::vector<morsel> morsels;
+  split_morsels(
+      table,
+      row_begin,
+      row_end,
+      threads > 1 ? kMorselRows : uint64_t(-1),
+      &morsels);
+
+  if (threads <= 1) {
+    std::vector<uint8_t> mask;
+    std::vector<uint8_t> scratch;
+    for (const auto& m : morsels) {
+      scan_morsel(table, m, predicates, &mask, &scratch, rows);
+    }
+
+    return ZDB_SUCCESS;
+  }
+
+  /* each morsel gets its own result list so that the lists can be joined in
+     row order once all morsels are done */
+  std::vector<std::vector<uint64_t>> morsel_rows(morsels.size());
+  std::vector<std::vector<uint8_t>> masks(threads);
+  std::vector<std::vector<uint8_t>> scratch(threads);
+  run_morsels(db->sched.get(), morsels.size(), threads, [&] (
+      size_t worker,
+      size_t i) {
+    scan_morsel(
+        table,
+        morsels[i],
+        predicates,
+        &masks[worker],
+        &scratch[worker],
+        &morsel_rows[i]);
+  });
+
+  for (const auto& r : morsel_rows) {
+    rows->insert(rows->end(), r.begin(), r.end());
+  }
+
+  return ZDB_SUCCESS;
+}
+
+zdb_err_t scan(
+    database_ref db,
+    const std::string& table_name,
+    const std::vector<predicate>& predicates,
+    std::vector<uint64_t>* rows,
+    uint64_t row_begin /* = 0 */,
+    uint64_t row_end /* = uint64_t(-1) */) {
+  return scan_table(
+      db,
+      table_name,
+      predicates,
+      rows,
+      1,
+      row_begin,
+      row_end);
+}
+
+zdb_err_t scan_parallel(
+    database_ref db,
+    const std::string& table_name,
+    const std::vector<predicate>& predicates,
+    std::vector<uint64_t>* rows,
+    size_t threads /* = 0 */,
+    uint64_t row_begin /* = 0 */,
+    uint64_t row_end /* = uint64_t(-1) */) {
+  return scan_table(
+      db,
+      table_name,
+      predicates,
+      rows,
+      threads,
+      row_begin,
+      row_end);
+}
+
+zdb_err_t scan_parallel(
+    database_ref db,
+    const std::string& table_name,
+    const int* columns,
+    size_t columns_count,
+    const scan_kernel& kernel,
+    size_t threads,
+    uint64_t row_begin /* = 0 */,
+    uint64_t row_end /* = uint64_t(-1) */) {
+  assert(!!db);
+
+  if (threads == 0) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  /* acquire read lock */
+  lock_guard lk(&db->lock);
+  lk.lock_read();
+
+  /* find table */
+  auto table_iter = db->meta.tables.find(table_name);
+  if (table_iter == db->meta.tables.end()) {
+    return ZDB_ERR_NOTFOUND;
+  }
+
+  const auto& table = table_iter->second;
+
+  /* check arguments */
+  for (size_t i = 0; i < columns_count; ++i) {
+    if (columns[i] < 0 || size_t(columns[i]) >= table.columns.size()) {
+      return ZDB_ERR_INVALID_ARGUMENT;
+    }
+
+    if (table.columns[columns[i]].type == ZDB_STRING) {
+      return ZDB_ERR_INVALID_ARGUMENT;
+    }
+  }
+
+  std::vector<morsel> morsels;
+  split_morsels(table, row_begin, row_end, kMorselRows, &morsels);
+
+  run_morsels(db->sched.get(), morsels.size(), threads, [&] (
+      size_t worker,
+      size_t i) {
+    const auto& m = morsels[i];
+    const auto& rblock = table.row_map[m.row_block];
+
+    std::vector<const void*> values(columns_count);
+    for (size_t c = 0; c < columns_count; ++c) {
+      auto vsize = type_size(table.columns[columns[c]].type);
+      auto page = rblock.columns[columns[c]].page;
+      if (page && page->size() >= m.end) {
+        values[c] = static_cast<const char*>(page->data()) + m.begin * vsize;
+      } else {
+        values[c] = nullptr;
+      }
+    }
+
+    kernel(worker, m.first_row + m.begin, m.end - m.begin, values.data());
+  });
+
+  return ZDB_SUCCESS;
+}
+
+} // namespace zdb
+
@@ -6,6 +6,7 @@
  * under the 3-Clause BSD License (BSD-3-Clause).
  */
 #include <assert.h>
+#include <algorithm>
 #include <stdexcept>
 #include "tuple.h"
 #include "metadata.h"
@@ -15,7 +16,71 @@ namespace zdb {
 template <typename T>
 void page_buf_fixed<T>::append(const void* val, size_t val_len) {
   assert(val_len == sizeof(T));
-  data.emplace_back(*static_cast<const T*>(val));
+  auto value = *static_cast<const T*>(val);
+  if (values.size() % kZoneRows == 0) {
+    zones.emplace_back();
+  }
+
+  auto& z = zones.back();
+  if (value == value) {
+    if (!z.has_minmax || value < z.min_value) {
+      z.min_value = value;
+    }
+
+    if (!z.has_minmax || z.max_value < value) {
+      z.max_value = value;
+    }
+
+    z.has_minmax = true;
+  }
+
+  values.emplace_back(value);
+}
+
+template <typename T>
+size_t page_buf_fixed<T>::size() const {
+  return values.size();
+}
+
+template <typename T>
+const void* page_buf_fixed<T>::data() const {
+  return values.data();
+}
+
+template <typename T>
+bool page_buf_fixed<T>::get_minmax(
+    size_t begin,
+    size_t end,
+    void* min,
+    void* max) const {
+  bool has_minmax = false;
+  T min_value;
+  T max_value;
+  auto last = std::min(zones.size(), (end + kZoneRows - 1) / kZoneRows);
+  for (auto i = begin / kZoneRows; i < last; ++i) {
+    const auto& z = zones[i];
+    if (!z.has_minmax) {
+      continue;
+    }
+
+    if (!has_minmax || z.min_value < min_value) {
+      min_value = z.min_value;
+    }
+
+    if (!has_minmax || max_value < z.max_value) {
+      max_value = z.max_value;
+    }
+
+    has_minmax = true;
+  }
+
+  if (!has_minmax) {
+    return false;
+  }
+
+  *static_cast<T*>(min) = min_value;
+  *static_cast<T*>(max) = max_value;
+  return true;
 }
 
 page_buf* page_malloc(zdb_type_t type) {
@@ -27,10 +92,26 @@ page_buf* page_malloc(zdb_type_t type) {
     case ZDB_UINT64: return new page_buf_uint64();
     case ZDB_FLOAT32: return new page_buf_float32();
     case ZDB_FLOAT64: return new page_buf_float64();
+    default: break;
   }
   
   throw std::runtime_error("invalid type");
 }
 
+size_t type_size(zdb_type_t type) {
+  switch (type) {
+    case ZDB_BOOL: return sizeof(uint8_t);
+    case ZDB_INT32: return sizeof(int32_t);
+    case ZDB_INT64: return sizeof(int64_t);
+    case ZDB_UINT32: return sizeof(uint32_t);
+    case ZDB_UINT64: return sizeof(uint64_t);
+    case ZDB_FLOAT32: return sizeof(float);
+    case ZDB_FLOAT64: return sizeof(double);
+    default: break;
+  }
+
+  throw std::runtime_error("invalid type");
+}
+
 } // namespace zdb
 
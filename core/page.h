@@ -11,6 +11,10 @@
 
 namespace zdb {
 
+/* the zone map of a page keeps the smallest and the largest value of each
+   chunk of this many rows */
+const size_t kZoneRows = 4096;
+
 struct page_info {
 };
 
@@ -18,17 +22,48 @@ class page_buf {
 public:
   virtual ~page_buf() = default;
   virtual void append(const void* val, size_t val_len) = 0;
+
+  /* the number of values in the page */
+  virtual size_t size() const = 0;
+
+  /* the values as one contiguous array of type_size() bytes each */
+  virtual const void* data() const = 0;
+
+  /* the zone map of the rows [begin, end): copies the smallest and the
+     largest value of the chunks of kZoneRows rows that overlap the range to
+     min and max. NaNs are ignored. returns false if these chunks have no
+     (non-NaN) values */
+  virtual bool get_minmax(
+      size_t begin,
+      size_t end,
+      void* min,
+      void* max) const = 0;
 };
 
 template <typename T>
 class page_buf_fixed : public page_buf {
 public:
   void append(const void* val, size_t val_len) override;
+  size_t size() const override;
+  const void* data() const override;
+  bool get_minmax(
+      size_t begin,
+      size_t end,
+      void* min,
+      void* max) const override;
 protected:
-  std::vector<T> data;
+  struct zone {
+    bool has_minmax = false;
+    T min_value;
+    T max_value;
+  };
+
+  std::vector<T> values;
+  std::vector<zone> zones;
 };
 
-using page_buf_bool = page_buf_fixed<bool>;
+/* bools are stored as one byte each so that the page can be read as an array */
+using page_buf_bool = page_buf_fixed<uint8_t>;
 using page_buf_int64 = page_buf_fixed<int64_t>;
 using page_buf_int32 = page_buf_fixed<int32_t>;
 using page_buf_uint64 = page_buf_fixed<uint64_t>;
@@ -38,5 +73,8 @@ using page_buf_float64 = page_buf_fixed<double>;
 
 page_buf* page_malloc(zdb_type_t type);
 
+/* the size of one value of a fixed size type in a page */
+size_t type_size(zdb_type_t type);
+
 } // namespace zdb
 
@@ -16,20 +16,31 @@
 
 namespace tsdb {
 
-PageBuffer::PageBuffer() : value_size_(0) {}
+PageBuffer::PageBuffer() : value_size_(0), timestamps_encoded_size_(0) {}
 
-PageBuffer::PageBuffer(size_t value_size) : value_size_(value_size) {}
+PageBuffer::PageBuffer(
+    size_t value_size) :
+    value_size_(value_size),
+    timestamps_encoded_size_(0) {}
 
 PageBuffer::PageBuffer(
     PageBuffer&& o) :
     value_size_(o.value_size_),
     timestamps_(std::move(o.timestamps_)),
-    values_(std::move(o.values_)) {}
+    values_(std::move(o.values_)),
+    timestamps_encoded_size_(o.timestamps_encoded_size_),
+    ooo_timestamps_(std::move(o.ooo_timestamps_)),
+    ooo_positions_(std::move(o.ooo_positions_)),
+    ooo_values_(std::move(o.ooo_values_)) {}
 
 PageBuffer& PageBuffer::operator=(const PageBuffer& o) {
   value_size_ = o.value_size_;
   timestamps_ = o.timestamps_;
   values_ = o.values_;
+  timestamps_encoded_size_ = o.timestamps_encoded_size_;
+  ooo_timestamps_ = o.ooo_timestamps_;
+  ooo_positions_ = o.ooo_positions_;
+  ooo_values_ = o.ooo_values_;
   return *this;
 }
 
@@ -37,60 +48,258 @@ PageBuffer& PageBuffer::operator=(PageBuffer&& o) {
   value_size_ = o.value_size_;
   timestamps_ = std::move(o.timestamps_);
   values_ = std::move(o.values_);
+  timestamps_encoded_size_ = o.timestamps_encoded_size_;
+  ooo_timestamps_ = std::move(o.ooo_timestamps_);
+  ooo_positions_ = std::move(o.ooo_positions_);
+  ooo_values_ = std::move(o.ooo_values_);
   return *this;
 }
 
 PageBuffer::~PageBuffer() {}
 
-void PageBuffer::insert(
-    size_t pos,
-    uint64_t time,
-    const void* value,
-    size_t value_len) {
+void PageBuffer::insert(uint64_t time, const void* value, size_t value_len) {
   assert(value_len == value_size_);
-  assert(pos <= values_.size());
-  timestamps_.insert(timestamps_.begin() + pos, time);
-  values_.insert(
-      values_.begin() + pos,
-      std::string((const char*) value, value_len));
+
+  /* the last value in the page arrays is always the newest one, the
+     out-of-order buffer only holds values that sort before it */
+  if (timestamps_.empty() || time > timestamps_.back()) {
+    append(time, value, value_len);
+  } else {
+    insertOutOfOrder(time, value);
+  }
 }
 
 void PageBuffer::append(uint64_t time, const void* value, size_t value_len) {
   assert(value_len == value_size_);
+  if (!timestamps_.empty() && time < timestamps_.back()) {
+    insertOutOfOrder(time, value);
+    return;
+  }
+
   timestamps_.push_back(time);
-  values_.push_back(std::string((const char*) value, value_len));
+  values_.insert(
+      values_.end(),
+      (const char*) value,
+      (const char*) value + value_len);
+  timestamps_encoded_size_ += getVarUIntSize(time);
+}
+
+void PageBuffer::appendRange(const PageBuffer& o, size_t begin, size_t end) {
+  assert(o.value_size_ == value_size_);
+  assert(begin <= end && end <= o.getSize());
+  if (begin == end) {
+    return;
+  }
+
+  if (!o.ooo_timestamps_.empty()) {
+    for (size_t pos = begin; pos < end; ++pos) {
+      uint64_t time;
+      o.getTimestamp(pos, &time);
+      assert(timestamps_.empty() || time >= timestamps_.back());
+      timestamps_.push_back(time);
+      timestamps_encoded_size_ += getVarUIntSize(time);
+    }
+
+    auto value_offset = values_.size();
+    values_.resize(timestamps_.size() * value_size_);
+    auto value = values_.data() + value_offset;
+    for (size_t pos = begin; pos < end; ++pos, value += value_size_) {
+      o.getValue(pos, value, value_size_);
+    }
+
+    return;
+  }
+
+  assert(timestamps_.empty() || o.timestamps_[begin] >= timestamps_.back());
+  timestamps_.insert(
+      timestamps_.end(),
+      o.timestamps_.begin() + begin,
+      o.timestamps_.begin() + end);
+
+  values_.insert(
+      values_.end(),
+      o.values_.begin() + begin * value_size_,
+      o.values_.begin() + end * value_size_);
+
+  for (size_t pos = begin; pos < end; ++pos) {
+    timestamps_encoded_size_ += getVarUIntSize(o.timestamps_[pos]);
+  }
+}
+
+void PageBuffer::insertOutOfOrder(uint64_t time, const void* value) {
+  /* the new value goes before all values with the same or a larger timestamp
+     in both runs */
+  auto ooo_idx = std::lower_bound(
+      ooo_timestamps_.begin(),
+      ooo_timestamps_.end(),
+      time) - ooo_timestamps_.begin();
+
+  auto page_idx = std::lower_bound(
+      timestamps_.begin(),
+      timestamps_.end(),
+      time) - timestamps_.begin();
+
+  ooo_timestamps_.insert(ooo_timestamps_.begin() + ooo_idx, time);
+  ooo_positions_.insert(
+      ooo_positions_.begin() + ooo_idx,
+      ooo_idx + page_idx);
+  ooo_values_.insert(
+      ooo_values_.begin() + ooo_idx * value_size_,
+      (const char*) value,
+      (const char*) value + value_size_);
+  timestamps_encoded_size_ += getVarUIntSize(time);
+
+  /* every following late value moves back by one */
+  for (size_t i = ooo_idx + 1; i < ooo_positions_.size(); ++i) {
+    ++ooo_positions_[i];
+  }
+
+  if (ooo_timestamps_.size() >= kMaxOutOfOrderEntries) {
+    seal();
+  }
+}
+
+void PageBuffer::seal() {
+  if (ooo_timestamps_.empty()) {
+    return;
+  }
+
+  /* merge back to front so that no value is overwritten before it was moved
+     to its final position */
+  size_t page_idx = timestamps_.size();
+  size_t ooo_idx = ooo_timestamps_.size();
+  timestamps_.resize(page_idx + ooo_idx);
+  values_.resize((page_idx + ooo_idx) * value_size_);
+
+  for (size_t pos = timestamps_.size(); ooo_idx > 0; ) {
+    --pos;
+
+    const char* src;
+    if (ooo_positions_[ooo_idx - 1] == pos) {
+      --ooo_idx;
+      timestamps_[pos] = ooo_timestamps_[ooo_idx];
+      src = ooo_values_.data() + ooo_idx * value_size_;
+    } else {
+      --page_idx;
+      timestamps_[pos] = timestamps_[page_idx];
+      src = values_.data() + page_idx * value_size_;
+    }
+
+    memcpy(values_.data() + pos * value_size_, src, value_size_);
+  }
+
+  ooo_timestamps_.clear();
+  ooo_positions_.clear();
+  ooo_values_.clear();
+}
+
+bool PageBuffer::lookupPosition(size_t pos, size_t* idx) const {
+  if (ooo_positions_.empty()) {
+    *idx = pos;
+    return false;
+  }
+
+  auto iter = std::lower_bound(
+      ooo_positions_.begin(),
+      ooo_positions_.end(),
+      pos);
+
+  size_t ooo_idx = iter - ooo_positions_.begin();
+  if (iter != ooo_positions_.end() && *iter == pos) {
+    *idx = ooo_idx;
+    return true;
+  } else {
+    *idx = pos - ooo_idx;
+    return false;
+  }
 }
 
 void PageBuffer::update(size_t pos, const void* value, size_t value_len) {
   assert(value_len == value_size_);
-  assert(pos <= values_.size());
-  values_[pos] = std::string((const char*) value, value_len);
+  assert(pos < getSize());
+
+  size_t idx;
+  if (lookupPosition(pos, &idx)) {
+    memcpy(ooo_values_.data() + idx * value_size_, value, value_size_);
+  } else {
+    memcpy(values_.data() + idx * value_size_, value, value_size_);
+  }
 }
 
 void PageBuffer::getTimestamp(size_t pos, uint64_t* timestamp) const {
-  assert(pos < timestamps_.size());
-  *timestamp = timestamps_[pos];
+  assert(pos < getSize());
+
+  size_t idx;
+  if (lookupPosition(pos, &idx)) {
+    *timestamp = ooo_timestamps_[idx];
+  } else {
+    *timestamp = timestamps_[idx];
+  }
 }
 
 void PageBuffer::getValue(size_t pos, void* value, size_t value_len) const {
-  assert(pos < values_.size());
+  assert(pos < getSize());
   assert(value_len == value_size_);
-  assert(values_[pos].size() == value_size_);
-  memcpy(value, values_[pos].data(), value_size_);
+
+  size_t idx;
+  if (lookupPosition(pos, &idx)) {
+    memcpy(value, ooo_values_.data() + idx * value_size_, value_size_);
+  } else {
+    memcpy(value, values_.data() + idx * value_size_, value_size_);
+  }
 }
 
 size_t PageBuffer::getSize() const {
-  return timestamps_.size();
+  return timestamps_.size() + ooo_timestamps_.size();
+}
+
+size_t PageBuffer::getMemorySize() const {
+  return
+      timestamps_.capacity() * sizeof(uint64_t) +
+      values_.capacity() +
+      ooo_timestamps_.capacity() * sizeof(uint64_t) +
+      ooo_positions_.capacity() * sizeof(size_t) +
+      ooo_values_.capacity();
+}
+
+size_t PageBuffer::getEncodedSize() const {
+  return
+      getVarUIntSize(getSize()) +
+      timestamps_encoded_size_ +
+      getSize() * value_size_;
 }
 
 void PageBuffer::encode(std::string* out) const {
-  writeVarUInt(out, timestamps_.size());
-  for (const auto& t : timestamps_) {
-    writeVarUInt(out, t);
+  assert(values_.size() == timestamps_.size() * value_size_);
+  writeVarUInt(out, getSize());
+
+  if (ooo_timestamps_.empty()) {
+    for (const auto& t : timestamps_) {
+      writeVarUInt(out, t);
+    }
+
+    out->append(values_.data(), values_.size());
+    return;
   }
-  for (const auto& v : values_) {
-    assert(v.size() == value_size_);
-    *out += v;
+
+  /* the page is const here, so write out the merged view instead of sealing
+     the page first */
+  size_t size = getSize();
+  for (size_t pos = 0, page_idx = 0, ooo_idx = 0; pos < size; ++pos) {
+    if (ooo_idx < ooo_positions_.size() && ooo_positions_[ooo_idx] == pos) {
+      writeVarUInt(out, ooo_timestamps_[ooo_idx++]);
+    } else {
+      writeVarUInt(out, timestamps_[page_idx++]);
+    }
+  }
+
+  out->reserve(out->size() + size * value_size_);
+  for (size_t pos = 0, page_idx = 0, ooo_idx = 0; pos < size; ++pos) {
+    if (ooo_idx < ooo_positions_.size() && ooo_positions_[ooo_idx] == pos) {
+      out->append(ooo_values_.data() + ooo_idx++ * value_size_, value_size_);
+    } else {
+      out->append(values_.data() + page_idx++ * value_size_, value_size_);
+    }
   }
 }
 
@@ -104,6 +313,7 @@ bool PageBuffer::decode(const char* data, size_t len) {
     return false;
   }
 
+  auto timestamps_begin = cur;
   timestamps_.resize(nentries);
   for (uint64_t i = 0; i < nentries; ++i) {
     if (!readVarUInt(&cur, end, &timestamps_[i])) {
@@ -111,16 +321,16 @@ bool PageBuffer::decode(const char* data, size_t len) {
     }
   }
 
-  values_.resize(nentries);
-  for (uint64_t i = 0; i < nentries; ++i) {
-    if (cur + value_size_ >= end) {
-      return false;
-    }
+  timestamps_encoded_size_ = cur - timestamps_begin;
 
-    values_[i] = std::string(cur, value_size_);
-    cur += value_size_;
+  if (nentries > size_t(end - cur) / value_size_) {
+    return false;
   }
 
+  values_.assign(cur, cur + nentries * value_size_);
+  ooo_timestamps_.clear();
+  ooo_positions_.clear();
+  ooo_values_.clear();
   return true;
 }
 
@@ -8,6 +8,8 @@
 #pragma once
 #include <stdlib.h>
 #include <algorithm>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace tsdb {
@@ -24,14 +26,32 @@ public:
   ~PageBuffer();
 
   void update(size_t pos, const void* value, size_t value_len);
-  void insert(size_t pos, uint64_t time, const void* value, size_t value_len);
+
+  /* insert a value in timestamp order. values that are newer than the last
+     value in the page are appended, older ("late") values are added to the
+     out-of-order buffer. the new value appears before existing values with
+     the same timestamp */
+  void insert(uint64_t time, const void* value, size_t value_len);
   void append(uint64_t time, const void* value, size_t value_len);
 
+  /* append the values at positions [begin, end) of another page. the values
+     must not be older than the last value in this page */
+  void appendRange(const PageBuffer& o, size_t begin, size_t end);
+
+  /* merge the out-of-order buffer into the page */
+  void seal();
+
   void getTimestamp(size_t pos, uint64_t* timestamp) const;
   void getValue(size_t pos, void* value, size_t value_len) const;
 
   size_t getSize() const;
 
+  /* approximate number of bytes of memory used by the buffer */
+  size_t getMemorySize() const;
+
+  /* the number of bytes encode() produces */
+  size_t getEncodedSize() const;
+
   void encode(std::string* out) const;
   bool decode(const char* data, size_t len);
 
@@ -41,8 +61,33 @@ protected:
 
   size_t value_size_;
   std::vector<uint64_t> timestamps_;
-  std::vector<std::string> values_;
+
+  /* all values are value_size_ bytes long and are stored back to back in a
+     single array, parallel to timestamps_ */
+  std::vector<char> values_;
+
+  /* the total varint encoded size of all timestamps in the page */
+  size_t timestamps_encoded_size_;
+
+  /* late values are kept in a small sorted run instead of being inserted into
+     the arrays above, which would move every following value. each entry
+     also records its position in the merged view of the page so that reads
+     can merge the two runs on the fly. the run is merged into the page once
+     it reaches kMaxOutOfOrderEntries entries */
+  static const size_t kMaxOutOfOrderEntries = 256;
+  std::vector<uint64_t> ooo_timestamps_;
+  std::vector<size_t> ooo_positions_;
+  std::vector<char> ooo_values_;
+
+  void insertOutOfOrder(uint64_t time, const void* value);
+
+  /* translate a position in the merged view to a position in the page
+     arrays or (if true is returned) in the out-of-order buffer */
+  bool lookupPosition(size_t pos, size_t* idx) const;
 };
 
+/* a pinned, immutable version of a page */
+using PageBufferRef = std::shared_ptr<const PageBuffer>;
+
 } // namespace tsdb
 
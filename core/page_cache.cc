@@ -0,0 +1,187 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <assert.h>
+#include <algorithm>
+#include "page_cache.h"
+
+namespace tsdb {
+
+/* the share of each shard's capacity that is reserved for the A1in queue */
+static const size_t kA1inRatio = 4;
+
+/* the minimum number of evicted page ids remembered per shard */
+static const size_t kMinGhosts = 16;
+
+PageCache::Shard::Shard() : a1in_size(0), am_size(0) {}
+
+PageCache::PageCache(
+    size_t capacity) :
+    shard_capacity_(capacity / kNumShards) {}
+
+PageCache::Shard* PageCache::getShard(PageIDType page_id) {
+  return &shards_[page_id % kNumShards];
+}
+
+bool PageCache::get(
+    PageIDType page_id,
+    uint64_t disk_addr,
+    PageBufferRef* buf,
+    bool promote /* = true */) {
+  auto shard = getShard(page_id);
+  std::unique_lock<std::mutex> lk(shard->mutex);
+
+  auto iter = shard->entries.find(page_id);
+  if (iter == shard->entries.end()) {
+    return false;
+  }
+
+  auto entry = iter->second;
+  if (entry->disk_addr != disk_addr) {
+    return false;
+  }
+
+  /* references to pages in A1in are not counted, so only pages in Am are
+     moved to the front of the LRU queue. pages that were prefetched after
+     they had been evicted from A1in are promoted on their first reference */
+  if (promote && entry->frequent) {
+    shard->am.splice(shard->am.begin(), shard->am, entry);
+  } else if (promote && eraseGhost(shard, page_id)) {
+    shard->am.splice(shard->am.begin(), shard->a1in, entry);
+    shard->a1in_size -= entry->size;
+    shard->am_size += entry->size;
+    entry->frequent = true;
+  }
+
+  *buf = entry->buffer;
+  return true;
+}
+
+void PageCache::put(
+    PageIDType page_id,
+    uint64_t disk_addr,
+    PageBufferRef buf,
+    size_t size,
+    bool promote /* = true */) {
+  if (size > shard_capacity_) {
+    erase(page_id);
+    return;
+  }
+
+  auto shard = getShard(page_id);
+  std::unique_lock<std::mutex> lk(shard->mutex);
+
+  /* if the page is already cached, replace it in place */
+  auto iter = shard->entries.find(page_id);
+  if (iter != shard->entries.end()) {
+    auto entry = iter->second;
+    auto& queue_size = entry->frequent ? shard->am_size : shard->a1in_size;
+    queue_size = queue_size - entry->size + size;
+    entry->disk_addr = disk_addr;
+    entry->buffer = std::move(buf);
+    entry->size = size;
+    evict(shard);
+    return;
+  }
+
+  /* pages that were recently evicted from A1in go straight into Am */
+  bool frequent = promote && eraseGhost(shard, page_id);
+
+  auto& queue = frequent ? shard->am : shard->a1in;
+  queue.emplace_front();
+  auto entry = queue.begin();
+  entry->page_id = page_id;
+  entry->disk_addr = disk_addr;
+  entry->buffer = std::move(buf);
+  entry->size = size;
+  entry->frequent = frequent;
+  shard->entries.emplace(page_id, entry);
+
+  if (frequent) {
+    shard->am_size += size;
+  } else {
+    shard->a1in_size += size;
+  }
+
+  evict(shard);
+}
+
+void PageCache::erase(PageIDType page_id) {
+  auto shard = getShard(page_id);
+  std::unique_lock<std::mutex> lk(shard->mutex);
+
+  auto iter = shard->entries.find(page_id);
+  if (iter != shard->entries.end()) {
+    removeEntry(shard, iter->second);
+  }
+
+  eraseGhost(shard, page_id);
+}
+
+size_t PageCache::getSize() {
+  size_t size = 0;
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> lk(shard.mutex);
+    size += shard.a1in_size + shard.am_size;
+  }
+
+  return size;
+}
+
+void PageCache::evict(Shard* shard) {
+  while (shard->a1in_size + shard->am_size > shard_capacity_) {
+    bool evict_a1in =
+        shard->a1in_size > shard_capacity_ / kA1inRatio ||
+        shard->am.empty();
+
+    if (!evict_a1in) {
+      removeEntry(shard, std::prev(shard->am.end()));
+      continue;
+    }
+
+    /* remember the id of the page evicted from A1in. a prefetched page may
+       still have a ghost from an earlier eviction */
+    auto page_id = shard->a1in.back().page_id;
+    removeEntry(shard, std::prev(shard->a1in.end()));
+    eraseGhost(shard, page_id);
+
+    shard->a1out.emplace_front(page_id);
+    shard->ghosts[page_id] = shard->a1out.begin();
+
+    auto max_ghosts = std::max(shard->entries.size() / 2, kMinGhosts);
+    while (shard->a1out.size() > max_ghosts) {
+      shard->ghosts.erase(shard->a1out.back());
+      shard->a1out.pop_back();
+    }
+  }
+}
+
+bool PageCache::eraseGhost(Shard* shard, PageIDType page_id) {
+  auto ghost = shard->ghosts.find(page_id);
+  if (ghost == shard->ghosts.end()) {
+    return false;
+  }
+
+  shard->a1out.erase(ghost->second);
+  shard->ghosts.erase(ghost);
+  return true;
+}
+
+void PageCache::removeEntry(Shard* shard, EntryList::iterator entry) {
+  shard->entries.erase(entry->page_id);
+
+  if (entry->frequent) {
+    shard->am_size -= entry->size;
+    shard->am.erase(entry);
+  } else {
+    shard->a1in_size -= entry->size;
+    shard->a1in.erase(entry);
+  }
+}
+
+} // namespace tsdb
+
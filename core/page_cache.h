@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "page_buffer.h"
+
+namespace tsdb {
+
+/**
+ * A memory-bounded cache of decoded clean pages. Each shard uses the 2Q
+ * replacement policy: pages enter a small FIFO queue (A1in) on first use and
+ * are only promoted to the main LRU queue (Am) if they are requested again
+ * after they have been evicted from A1in (tracked in the A1out ghost queue).
+ * A single large scan therefore only churns A1in and doesn't flush the
+ * working set from Am.
+ */
+class PageCache {
+public:
+
+  using PageIDType = size_t;
+
+  PageCache(size_t capacity);
+  PageCache(const PageCache& o) = delete;
+  PageCache& operator=(const PageCache& o) = delete;
+
+  /* return a reference to the cached page if it is cached for the given disk
+     address. if promote is false the lookup doesn't count as a reference */
+  bool get(
+      PageIDType page_id,
+      uint64_t disk_addr,
+      PageBufferRef* buf,
+      bool promote = true);
+
+  /* add a page to the cache (or replace the cached version of it). if promote
+     is false the insert doesn't count as a reference, so a recently evicted
+     page is not promoted to Am until it is requested again */
+  void put(
+      PageIDType page_id,
+      uint64_t disk_addr,
+      PageBufferRef buf,
+      size_t size,
+      bool promote = true);
+
+  void erase(PageIDType page_id);
+
+  size_t getSize();
+
+protected:
+
+  static const size_t kNumShards = 16;
+
+  struct CacheEntry {
+    PageIDType page_id;
+    uint64_t disk_addr;
+    PageBufferRef buffer;
+    size_t size;
+    bool frequent;
+  };
+
+  using EntryList = std::list<CacheEntry>;
+
+  struct Shard {
+    Shard();
+    std::mutex mutex;
+    EntryList a1in;
+    EntryList am;
+    std::unordered_map<PageIDType, EntryList::iterator> entries;
+    std::list<PageIDType> a1out;
+    std::unordered_map<PageIDType, std::list<PageIDType>::iterator> ghosts;
+    size_t a1in_size;
+    size_t am_size;
+  };
+
+  Shard* getShard(PageIDType page_id);
+  bool eraseGhost(Shard* shard, PageIDType page_id);
+  void evict(Shard* shard);
+  void removeEntry(Shard* shard, EntryList::iterator entry);
+
+  size_t shard_capacity_;
+  Shard shards_[kNumShards];
+};
+
+} // namespace tsdb
+
@@ -6,65 +6,98 @@
  * under the 3-Clause BSD License (BSD-3-Clause).
  */
 #include <assert.h>
+#include <algorithm>
+#include <set>
 #include "page_index.h"
+#include "page_map.h"
 
 namespace tsdb {
 
-PageIndex::PageIndex(
-    uint64_t value_size,
-    const std::string metadata) :
-    value_size_(value_size),
-    metadata_(metadata),
-    entries_(nullptr),
-    splitpoints_(nullptr),
-    size_(0),
-    disk_addr_(0),
-    disk_size_(0) {}
-
-bool PageIndex::alloc(size_t nentries) {
-  if (nentries == 0 || size_ > 0) {
-    return false;
-  }
+PageIndexVersion::PageIndexVersion() : retired_page_map(nullptr) {}
 
-  size_t nsplits = nentries - 1;
-  auto alloc = malloc(
-      sizeof(PageIndexEntry) * nentries +
-      sizeof(PageIndexSplitpoint) * nsplits);
+PageIndexVersion::PageIndexVersion(
+    const PageIndexVersion& o) :
+    entries(o.entries),
+    splitpoints(o.splitpoints),
+    retired_page_map(nullptr) {}
 
-  if (!alloc) {
-    return false;
+PageIndexVersion::~PageIndexVersion() {
+  if (retired_page_map) {
+    for (auto page_id : retired_pages) {
+      retired_page_map->deletePage(page_id);
+    }
   }
 
-  entries_ = (PageIndexEntry*) alloc;
-  splitpoints_ = (PageIndexSplitpoint*) (entries_ + nentries);
-  size_ = nentries;
-  return true;
-}
-
-PageIndex::~PageIndex() {
-  if (entries_) {
-    free(entries_);
+  /* a reader that pinned an old version keeps every later version alive.
+     free the links that only this version holds one at a time, so that a
+     long chain isn't destroyed by one nested destructor call per link */
+  auto link = std::move(next);
+  while (link && link.use_count() == 1) {
+    auto after = std::move(link->next);
+    link.reset();
+    link = std::move(after);
   }
 }
 
-PageIndexEntry* PageIndex::getEntries() {
-  return entries_;
+size_t PageIndexVersion::findPage(uint64_t timestamp) const {
+  assert(splitpoints.size() + 1 == entries.size());
+  auto iter = std::upper_bound(
+      splitpoints.begin(),
+      splitpoints.end(),
+      timestamp,
+      [] (uint64_t t, const PageIndexSplitpoint& s) {
+        return t < s.point;
+      });
+
+  return iter - splitpoints.begin();
 }
 
-const PageIndexEntry* PageIndex::getEntries() const {
-  return entries_;
+bool PageIndexVersion::isUnmergeable(size_t page_id) const {
+  std::unique_lock<std::mutex> lk(unmergeable_mutex);
+  return unmergeable_pages.count(page_id) > 0;
 }
 
-PageIndexSplitpoint* PageIndex::getSplitpoints() {
-  return splitpoints_;
+void PageIndexVersion::setUnmergeable(size_t page_id) const {
+  std::unique_lock<std::mutex> lk(unmergeable_mutex);
+  unmergeable_pages.insert(page_id);
 }
 
-const PageIndexSplitpoint* PageIndex::getSplitpoints() const {
-  return splitpoints_;
+PageIndex::PageIndex(
+    uint64_t value_size,
+    const std::string metadata) :
+    value_size_(value_size),
+    metadata_(metadata),
+    disk_addr_(0),
+    disk_size_(0) {}
+
+PageIndex::~PageIndex() {}
+
+PageIndexVersionRef PageIndex::getVersion() const {
+  std::unique_lock<std::mutex> lk(mutex_);
+  return version_;
 }
 
-size_t PageIndex::getSize() const {
-  return size_;
+void PageIndex::setVersion(
+    PageIndexVersionRef version,
+    PageMap* page_map /* = nullptr */) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (version_ && page_map) {
+    std::set<size_t> page_ids;
+    for (const auto& e : version->entries) {
+      page_ids.insert(e.page_id);
+    }
+
+    for (const auto& e : version_->entries) {
+      if (page_ids.count(e.page_id) == 0) {
+        version_->retired_pages.emplace_back(e.page_id);
+      }
+    }
+
+    version_->retired_page_map = page_map;
+    version_->next = version;
+  }
+
+  version_ = std::move(version);
 }
 
 size_t PageIndex::getValueSize() const {
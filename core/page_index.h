@@ -7,10 +7,15 @@
  */
 #pragma once
 #include <stdlib.h>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <vector>
 #include "page_buffer.h"
 
 namespace tsdb {
+class PageMap;
 
 struct PageIndexEntry {
   size_t page_id;
@@ -20,6 +25,41 @@ struct PageIndexSplitpoint {
   uint64_t point;
 };
 
+/* an immutable version of the page layout of a series. the page at position
+   i holds all values with splitpoints[i - 1] <= timestamp < splitpoints[i] */
+struct PageIndexVersion {
+  PageIndexVersion();
+  PageIndexVersion(const PageIndexVersion& o);
+  PageIndexVersion& operator=(const PageIndexVersion& o) = delete;
+  ~PageIndexVersion();
+
+  /* returns the position of the page that holds timestamp */
+  size_t findPage(uint64_t timestamp) const;
+
+  /* remember that a page of this version is too big to be merged with any of
+     its neighbours. pages only grow while the version is current and every
+     split or merge publishes a new version, so the neighbours don't have to
+     be read again on every write to the page */
+  bool isUnmergeable(size_t page_id) const;
+  void setUnmergeable(size_t page_id) const;
+
+  std::vector<PageIndexEntry> entries;
+  std::vector<PageIndexSplitpoint> splitpoints;
+
+  /* set once the version is replaced: the pages that are not part of the
+     next version are deleted when this version is destroyed. every version
+     keeps the next one alive, so a page is only deleted once all versions
+     that reference it are gone. the destructor frees the chain iteratively */
+  mutable PageMap* retired_page_map;
+  mutable std::vector<size_t> retired_pages;
+  mutable std::shared_ptr<const PageIndexVersion> next;
+
+  mutable std::mutex unmergeable_mutex;
+  mutable std::set<size_t> unmergeable_pages;
+};
+
+using PageIndexVersionRef = std::shared_ptr<const PageIndexVersion>;
+
 class PageIndex {
 public:
 
@@ -28,15 +68,14 @@ public:
   PageIndex& operator=(const PageIndex& o) = delete;
   ~PageIndex();
 
-  bool alloc(size_t nentries);
-
-  PageIndexEntry* getEntries();
-  const PageIndexEntry* getEntries() const;
+  /* pin the current version of the page layout */
+  PageIndexVersionRef getVersion() const;
 
-  PageIndexSplitpoint* getSplitpoints();
-  const PageIndexSplitpoint* getSplitpoints() const;
+  /* replace the current version. if page_map is non-null, pages that are not
+     part of the new version are deleted from it once no reader holds an
+     older version anymore */
+  void setVersion(PageIndexVersionRef version, PageMap* page_map = nullptr);
 
-  size_t getSize() const;
   size_t getValueSize() const;
 
   bool hasDiskSnapshot() const;
@@ -48,9 +87,8 @@ public:
 protected:
   uint64_t value_size_;
   std::string metadata_;
-  PageIndexEntry* entries_;
-  PageIndexSplitpoint* splitpoints_;
-  size_t size_;
+  mutable std::mutex mutex_;
+  PageIndexVersionRef version_;
   uint64_t disk_addr_;
   uint64_t disk_size_;
 };
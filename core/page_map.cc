@@ -6,68 +6,197 @@
  * under the 3-Clause BSD License (BSD-3-Clause).
  */
 #include <assert.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <functional>
+#include <stdexcept>
 #include "page_map.h"
 
 namespace tsdb {
 
-PageMap::PageMap(int fd) : fd_(fd), page_id_(0) {}
+PageMap::PageMapEntry* const PageMap::kColdEntry =
+    reinterpret_cast<PageMap::PageMapEntry*>(uintptr_t(1));
+
+PageMap::Segment::Segment() {
+  for (auto& entry : entries) {
+    entry.store(nullptr);
+  }
+}
+
+PageMap::PageMap(
+    int fd,
+    size_t cache_size,
+    zdb::scheduler_ref scheduler /* = zdb::get_default_scheduler() */) :
+    fd_(fd),
+    page_id_(0),
+    segments_(new std::atomic<Segment*>[kMaxSegments]),
+    dirty_bytes_(0),
+    cache_(cache_size),
+    scheduler_(std::move(scheduler)),
+    prefetch_tasks_(0),
+    prefetch_running_(0),
+    prefetch_stop_(false) {
+  for (size_t i = 0; i < kMaxSegments; ++i) {
+    segments_[i].store(nullptr);
+  }
+}
 
 PageMap::~PageMap() {
-  for (auto& e : map_) {
-    dropEntryReference(e.second);
+  stopPrefetch();
+
+  for (size_t i = 0; i < kMaxSegments; ++i) {
+    auto segment = segments_[i].load();
+    if (!segment) {
+      continue;
+    }
+
+    for (auto& entry : segment->entries) {
+      auto e = entry.load();
+      if (e != kColdEntry) {
+        delete e;
+      }
+    }
+
+    delete segment;
   }
 }
 
+PageMap::PageIDType PageMap::insertEntry(
+    PageMapEntry* entry,
+    const ColdPageEntry* cold_entry) {
+  auto page_id = page_id_.fetch_add(1) + 1;
+  auto segment_idx = page_id >> kSegmentBits;
+  if (segment_idx >= kMaxSegments) {
+    throw std::runtime_error("page table is full");
+  }
+
+  /* install the segment if this is the first page in it */
+  auto segment = segments_[segment_idx].load();
+  if (!segment) {
+    std::unique_ptr<Segment> new_segment(new Segment());
+    if (segments_[segment_idx].compare_exchange_strong(
+            segment,
+            new_segment.get())) {
+      segment = new_segment.release();
+    }
+  }
+
+  /* the cold record must be in place before the slot is published */
+  auto slot = page_id & (kSegmentSize - 1);
+  if (cold_entry) {
+    segment->cold_entries[slot] = *cold_entry;
+    entry = kColdEntry;
+  }
+
+  segment->entries[slot].store(entry);
+  return page_id;
+}
+
+PageMap::Segment* PageMap::getSegment(PageIDType page_id) {
+  auto segment_idx = page_id >> kSegmentBits;
+  if (segment_idx >= kMaxSegments) {
+    return nullptr;
+  }
+
+  return segments_[segment_idx].load();
+}
+
+PageMap::PageMapEntry* PageMap::getEntry(PageIDType page_id) {
+  auto segment = getSegment(page_id);
+  if (!segment) {
+    return nullptr;
+  }
+
+  return segment->entries[page_id & (kSegmentSize - 1)].load();
+}
+
+PageMap::PageMapEntry* PageMap::getHotEntry(PageIDType page_id) {
+  auto segment = getSegment(page_id);
+  if (!segment) {
+    return nullptr;
+  }
+
+  auto slot = page_id & (kSegmentSize - 1);
+  auto entry = segment->entries[slot].load();
+  if (entry != kColdEntry) {
+    return entry;
+  }
+
+  /* replace the cold record with a full entry. if we lose the race against
+     another writer (or a delete), use whatever is in the slot now */
+  const auto& cold_entry = segment->cold_entries[slot];
+  std::unique_ptr<PageMapEntry> hot_entry(new PageMapEntry());
+  hot_entry->version = 1;
+  hot_entry->value_size = cold_entry.value_size;
+  hot_entry->disk_addr = cold_entry.disk_addr;
+  hot_entry->disk_size = cold_entry.disk_size;
+  hot_entry->dirty_bytes = 0;
+
+  if (segment->entries[slot].compare_exchange_strong(entry, hot_entry.get())) {
+    return hot_entry.release();
+  }
+
+  return entry;
+}
+
+const PageMap::ColdPageEntry& PageMap::getColdEntry(PageIDType page_id) {
+  auto segment = getSegment(page_id);
+  assert(segment);
+  return segment->cold_entries[page_id & (kSegmentSize - 1)];
+}
+
 PageMap::PageIDType PageMap::allocPage(uint64_t value_size) {
   auto entry = new PageMapEntry();
-  entry->refcount = 1;
   entry->buffer.reset(new PageBuffer(value_size));
   entry->version = 1;
   entry->value_size = value_size;
   entry->disk_addr = 0;
   entry->disk_size = 0;
+  entry->dirty_bytes = 0;
 
-  std::unique_lock<std::mutex> lk(mutex_);
-
-  auto page_id = ++page_id_;
-  map_.emplace(page_id, entry);
-
-  return page_id;
+  return insertEntry(entry, nullptr);
 }
 
 PageMap::PageIDType PageMap::addColdPage(
     uint64_t value_size,
     uint64_t disk_addr,
     uint64_t disk_size) {
-  auto entry = new PageMapEntry();
-  entry->refcount = 1;
-  entry->version = 1;
-  entry->value_size = value_size;
-  entry->disk_addr = disk_addr;
-  entry->disk_size = disk_size;
-
-  std::unique_lock<std::mutex> lk(mutex_);
-
-  auto page_id = ++page_id_;
-  map_.emplace(page_id, entry);
+  /* pages that don't fit the compact record get a full entry right away */
+  if (disk_size > UINT32_MAX || value_size > UINT32_MAX) {
+    auto entry = new PageMapEntry();
+    entry->version = 1;
+    entry->value_size = value_size;
+    entry->disk_addr = disk_addr;
+    entry->disk_size = disk_size;
+    entry->dirty_bytes = 0;
+    return insertEntry(entry, nullptr);
+  }
 
-  return page_id;
+  ColdPageEntry cold_entry;
+  cold_entry.disk_addr = disk_addr;
+  cold_entry.disk_size = disk_size;
+  cold_entry.value_size = value_size;
+  return insertEntry(nullptr, &cold_entry);
 }
 
 bool PageMap::getPageInfo(PageIDType page_id, PageInfo* info) {
-  /* grab the main mutex and locate the page in our map */
-  std::unique_lock<std::mutex> map_lk(mutex_);
-  auto iter = map_.find(page_id);
-  if (iter == map_.end()) {
+  /* locate the page in our map */
+  EpochGuard epoch_guard(&epoch_);
+  auto entry = getEntry(page_id);
+  if (!entry) {
     return false;
   }
 
-  /* increment the entries refcount and unlock the main mutex */
-  auto entry = iter->second;
-  entry->refcount.fetch_add(1);
-  map_lk.unlock();
+  /* cold pages are clean and still at their first version */
+  if (entry == kColdEntry) {
+    const auto& cold_entry = getColdEntry(page_id);
+    info->version = 1;
+    info->is_dirty = false;
+    info->disk_addr = cold_entry.disk_addr;
+    info->disk_size = cold_entry.disk_size;
+    return true;
+  }
 
   /* grab the entries lock and copy the info */
   std::unique_lock<std::mutex> entry_lk(entry->lock);
@@ -75,75 +204,98 @@ bool PageMap::getPageInfo(PageIDType page_id, PageInfo* info) {
   info->is_dirty = !!entry->buffer;
   info->disk_addr = entry->disk_addr;
   info->disk_size = entry->disk_size;
-  entry_lk.unlock();
-
-  /* decrement the entries refcount and return */
-  dropEntryReference(entry);
   return true;
 }
 
 bool PageMap::getPage(
     PageIDType page_id,
-    PageBuffer* buf) {
-  /* grab the main mutex and locate the page in our map */
-  std::unique_lock<std::mutex> map_lk(mutex_);
-  auto iter = map_.find(page_id);
-  if (iter == map_.end()) {
+    PageBufferRef* buf,
+    uint64_t* version /* = nullptr */,
+    bool cache /* = true */) {
+  /* locate the page in our map */
+  EpochGuard epoch_guard(&epoch_);
+  auto entry = getEntry(page_id);
+  if (!entry) {
     return false;
   }
 
-  /* increment the entries refcount and unlock the main mutex */
-  auto entry = iter->second;
-  entry->refcount.fetch_add(1);
-  map_lk.unlock();
+  uint64_t value_size;
+  uint64_t disk_addr;
+  uint64_t disk_size;
+  if (entry == kColdEntry) {
+    const auto& cold_entry = getColdEntry(page_id);
+    value_size = cold_entry.value_size;
+    disk_addr = cold_entry.disk_addr;
+    disk_size = cold_entry.disk_size;
+
+    if (version) {
+      *version = 1;
+    }
+  } else {
+    /* grab the pages lock */
+    std::unique_lock<std::mutex> entry_lk(entry->lock);
 
-  /* grab the pages lock */
-  std::unique_lock<std::mutex> entry_lk(entry->lock);
+    if (version) {
+      *version = entry->version;
+    }
+
+    /* if the page is buffered in memory, pin the current version */
+    if (entry->buffer) {
+      *buf = entry->buffer;
+      return true;
+    }
+
+    value_size = entry->value_size;
+    disk_addr = entry->disk_addr;
+    disk_size = entry->disk_size;
+  }
+
+  /* try the page cache, then load the page from disk */
 
-  /* if the page is buffered in memory, copy and return */
-  if (entry->buffer) {
-    *buf = *entry->buffer;
-    entry_lk.unlock();
-    dropEntryReference(entry);
+  if (cache_.get(page_id, disk_addr, buf, cache)) {
     return true;
   }
 
-  /* load the page from disk */
-  auto value_size = entry->value_size;
-  auto disk_addr = entry->disk_addr;
-  auto disk_size = entry->disk_size;
-  entry_lk.unlock();
-  dropEntryReference(entry);
-  return loadPage(value_size, disk_addr, disk_size, buf);
+  std::shared_ptr<PageBuffer> loaded(new PageBuffer());
+  if (!loadPage(value_size, disk_addr, disk_size, loaded.get())) {
+    return false;
+  }
+
+  if (cache) {
+    cache_.put(page_id, disk_addr, loaded, loaded->getMemorySize());
+  }
+
+  *buf = std::move(loaded);
+  return true;
 }
 
 bool PageMap::modifyPage(
     PageIDType page_id,
     std::function<bool (PageBuffer* buf)> fn) {
-  /* grab the main mutex and locate the page in our map */
-  std::unique_lock<std::mutex> map_lk(mutex_);
-  auto iter = map_.find(page_id);
-  if (iter == map_.end()) {
+  /* locate the page in our map */
+  EpochGuard epoch_guard(&epoch_);
+  auto entry = getHotEntry(page_id);
+  if (!entry) {
     return false;
   }
 
-  /* increment the entries refcount and unlock the main mutex */
-  auto entry = iter->second;
-  entry->refcount.fetch_add(1);
-  map_lk.unlock();
-
   /* grab the entries lock  */
   std::unique_lock<std::mutex> entry_lk(entry->lock);
 
-  /* if the page is not in memory, load it */
+  /* if the page is not in memory, copy it from the page cache or load it. the
+     cached version is dropped as it is about to become stale */
+  PageBufferRef cached;
   if (!entry->buffer) {
     entry->buffer.reset(new PageBuffer());
-    if (!loadPage(
+    if (cache_.get(page_id, entry->disk_addr, &cached, false)) {
+      *entry->buffer = *cached;
+      cache_.erase(page_id);
+    } else if (!loadPage(
           entry->value_size,
           entry->disk_addr,
           entry->disk_size,
           entry->buffer.get())) {
-      entry->buffer.reset(nullptr);
+      entry->buffer.reset();
       return false;
     }
 
@@ -152,13 +304,31 @@ bool PageMap::modifyPage(
 #endif
   }
 
-  /* perform the modification */
+  /* if the current version is pinned by somebody else, modify a copy.
+     use_count() is a relaxed load, so the fence is required to order the
+     modification after the last read of a reader that just dropped its pin */
+  if (entry->buffer.use_count() > 1) {
+    std::shared_ptr<PageBuffer> buffer(new PageBuffer());
+    *buffer = *entry->buffer;
+    entry->buffer = std::move(buffer);
+  } else {
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  /* perform the modification. the next commit rewrites the whole page, so a
+     dirty page is accounted with its full encoded size. this also covers
+     pages that are filled with a copy of another page by a split or merge */
   auto rc = fn(entry->buffer.get());
   entry->version++;
-  entry_lk.unlock();
 
-  /* decrement the entries refcount and return */
-  dropEntryReference(entry);
+  auto dirty_bytes = entry->buffer->getEncodedSize();
+  if (dirty_bytes > entry->dirty_bytes) {
+    dirty_bytes_.fetch_add(dirty_bytes - entry->dirty_bytes);
+  } else {
+    dirty_bytes_.fetch_sub(entry->dirty_bytes - dirty_bytes);
+  }
+
+  entry->dirty_bytes = dirty_bytes;
   return rc;
 }
 
@@ -192,42 +362,67 @@ void PageMap::flushPage(
     uint64_t version,
     uint64_t disk_addr,
     uint64_t disk_size) {
-  /* grab the main mutex and locate the page in our map */
-  std::unique_lock<std::mutex> map_lk(mutex_);
-  auto iter = map_.find(page_id);
-  if (iter == map_.end()) {
+  /* locate the page in our map */
+  EpochGuard epoch_guard(&epoch_);
+  auto entry = getEntry(page_id);
+  if (!entry || entry == kColdEntry) {
     return;
   }
 
-  /* increment the entries refcount and unlock the main mutex */
-  auto entry = iter->second;
-  entry->refcount.fetch_add(1);
-  map_lk.unlock();
-
-  /* grab the entries lock and drop the buffer it the version matches */
+  /* grab the entries lock and drop the buffer it the version matches. the
+     buffer is now clean and is handed over to the page cache */
   std::unique_lock<std::mutex> entry_lk(entry->lock);
-  if (entry->version == version) {
+  if (entry->version == version && entry->buffer) {
     entry->disk_addr = disk_addr;
     entry->disk_size = disk_size;
-    entry->buffer.reset(nullptr);
-  }
 
-  entry_lk.unlock();
+    /* the page was written out in merged order; merge its out-of-order
+       buffer in memory too unless a reader still holds this version */
+    if (entry->buffer.use_count() == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      entry->buffer->seal();
+    }
 
-  /* decrement the entries refcount and return */
-  dropEntryReference(entry);
+    auto buffer_size = entry->buffer->getMemorySize();
+    cache_.put(page_id, disk_addr, entry->buffer, buffer_size);
+    entry->buffer.reset();
+    dirty_bytes_.fetch_sub(entry->dirty_bytes);
+    entry->dirty_bytes = 0;
+  }
 }
 
 void PageMap::deletePage(PageIDType page_id) {
-  std::unique_lock<std::mutex> map_lk(mutex_);
-  auto iter = map_.find(page_id);
-  if (iter == map_.end()) {
+  /* unlink the page from our map */
+  auto segment = getSegment(page_id);
+  if (!segment) {
+    return;
+  }
+
+  auto slot = page_id & (kSegmentSize - 1);
+  auto entry = segment->entries[slot].exchange(nullptr);
+  if (!entry) {
+    return;
+  }
+
+  cache_.erase(page_id);
+
+  /* cold pages have no entry to reclaim */
+  if (entry == kColdEntry) {
+#ifdef HAVE_POSIX_FADVISE
+    const auto& cold_entry = segment->cold_entries[slot];
+    posix_fadvise(
+        fd_,
+        cold_entry.disk_addr,
+        cold_entry.disk_size,
+        POSIX_FADV_DONTNEED);
+#endif
     return;
   }
 
-  auto entry = iter->second;
-  map_.erase(iter);
-  map_lk.unlock();
+  std::unique_lock<std::mutex> entry_lk(entry->lock);
+  dirty_bytes_.fetch_sub(entry->dirty_bytes);
+  entry->dirty_bytes = 0;
+  entry_lk.unlock();
 
   if (entry->disk_addr > 0 && !entry->buffer) {
 #ifdef HAVE_POSIX_FADVISE
@@ -235,17 +430,104 @@ void PageMap::deletePage(PageIDType page_id) {
 #endif
   }
 
-  dropEntryReference(entry);
+  /* readers might still hold a pointer to the entry */
+  epoch_.retire([entry] () {
+    delete entry;
+  });
 }
 
-void PageMap::dropEntryReference(PageMap::PageMapEntry* entry) {
-  if (std::atomic_fetch_sub_explicit(
-          &entry->refcount,
-          size_t(1),
-          std::memory_order_release) == 1) {
-    std::atomic_thread_fence(std::memory_order_acquire);
-    delete entry;
+void PageMap::prefetchPage(PageIDType page_id) {
+  std::unique_lock<std::mutex> lk(prefetch_mutex_);
+  if (prefetch_stop_ || prefetch_queue_.size() >= kMaxPrefetchQueueSize) {
+    return;
   }
+
+  prefetch_queue_.emplace_back(page_id);
+
+  /* start another task unless enough are already working off the queue */
+  if (prefetch_tasks_ >= kPrefetchTasks) {
+    return;
+  }
+
+  ++prefetch_tasks_;
+  prefetch_running_.fetch_add(1);
+  lk.unlock();
+
+  scheduler_->submit([this] () {
+    runPrefetchTask();
+    prefetch_running_.fetch_sub(1);
+  });
+}
+
+void PageMap::stopPrefetch() {
+  {
+    std::unique_lock<std::mutex> lk(prefetch_mutex_);
+    prefetch_stop_ = true;
+    prefetch_queue_.clear();
+  }
+
+  /* the tasks might still be queued, so help the scheduler instead of
+     blocking */
+  scheduler_->run_until([this] () { return prefetch_running_.load() == 0; });
+}
+
+void PageMap::runPrefetchTask() {
+  std::unique_lock<std::mutex> lk(prefetch_mutex_);
+  while (!prefetch_stop_ && !prefetch_queue_.empty()) {
+    auto page_id = prefetch_queue_.front();
+    prefetch_queue_.pop_front();
+
+    lk.unlock();
+    loadPageIntoCache(page_id);
+    lk.lock();
+  }
+
+  --prefetch_tasks_;
+}
+
+void PageMap::loadPageIntoCache(PageIDType page_id) {
+  /* locate the page in our map */
+  EpochGuard epoch_guard(&epoch_);
+  auto entry = getEntry(page_id);
+  if (!entry) {
+    return;
+  }
+
+  uint64_t value_size;
+  uint64_t disk_addr;
+  uint64_t disk_size;
+  if (entry == kColdEntry) {
+    const auto& cold_entry = getColdEntry(page_id);
+    value_size = cold_entry.value_size;
+    disk_addr = cold_entry.disk_addr;
+    disk_size = cold_entry.disk_size;
+  } else {
+    std::unique_lock<std::mutex> entry_lk(entry->lock);
+    if (entry->buffer || entry->disk_size == 0) {
+      return;
+    }
+
+    value_size = entry->value_size;
+    disk_addr = entry->disk_addr;
+    disk_size = entry->disk_size;
+  }
+
+  /* the prefetch doesn't count as a reference to the page */
+  PageBufferRef cached;
+  if (cache_.get(page_id, disk_addr, &cached, false)) {
+    return;
+  }
+
+  std::shared_ptr<PageBuffer> loaded(new PageBuffer());
+  if (!loadPage(value_size, disk_addr, disk_size, loaded.get())) {
+    return;
+  }
+
+  cache_.put(page_id, disk_addr, loaded, loaded->getMemorySize(), false);
+}
+
+uint64_t PageMap::getDirtyBytes() const {
+  return dirty_bytes_.load();
 }
 
 } // namespace tsdb
@@ -8,14 +8,17 @@
 #pragma once
 #include <stdlib.h>
 #include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <map>
 #include <mutex>
+#include <vector>
 #include "page_buffer.h"
+#include "page_cache.h"
+#include "epoch.h"
+#include "scheduler.h"
 
-namespace zdb {
-
-/*
+namespace tsdb {
 
 struct PageInfo {
   uint64_t version;
@@ -24,15 +27,16 @@ struct PageInfo {
   uint64_t disk_size;
 };
 
-*/
-
-class page_map {
+class PageMap {
 public:
 
-/*
   using PageIDType = size_t;
 
-  PageMap(int fd);
+  // background page reads run on the given scheduler
+  PageMap(
+      int fd,
+      size_t cache_size,
+      zdb::scheduler_ref scheduler = zdb::get_default_scheduler());
   PageMap(const PageMap& o) = delete;
   PageMap& operator=(const PageMap& o) = delete;
   ~PageMap();
@@ -46,8 +50,18 @@ public:
 
   bool getPageInfo(PageIDType page_id, PageInfo* info);
 
-  bool getPage(PageIDType page_id, PageBuffer* buf);
+  // pin the current version of the page. the returned snapshot is never
+  // modified; writers replace it instead. if version is non-null it is set
+  // to the version of the snapshot. clean pages that are read from disk are
+  // kept in the page cache unless cache is false
+  bool getPage(
+      PageIDType page_id,
+      PageBufferRef* buf,
+      uint64_t* version = nullptr,
+      bool cache = true);
 
+  // modify the page in place. if the current version of the page is pinned by
+  // a reader, the modification is applied to a copy (copy-on-write)
   bool modifyPage(
       PageIDType page_id,
       std::function<bool (PageBuffer* buf)> fn);
@@ -60,19 +74,67 @@ public:
 
   void deletePage(PageIDType page_id);
 
+  // read the page into the page cache in a background task. the request is
+  // dropped if the page is already in memory or if too many are queued
+  void prefetchPage(PageIDType page_id);
+
+  // drop the queued requests and wait for the prefetch tasks to finish. must
+  // be called before the file is closed
+  void stopPrefetch();
+
+  // the encoded size of all pages that were modified since they were last
+  // flushed, i.e. roughly the number of page bytes the next commit writes
+  uint64_t getDirtyBytes() const;
+
 protected:
 
+  // page ids are dense, so the page table is a two-level array indexed by
+  // page id: a fixed directory of lazily allocated segments. lookups don't
+  // take any locks; entries are only accessed under an EpochGuard and
+  // deleted entries are reclaimed through the epoch manager
+  static const size_t kSegmentBits = 14;
+  static const size_t kSegmentSize = size_t(1) << kSegmentBits;
+  static const size_t kMaxSegments = size_t(1) << 16;
+
   struct PageMapEntry {
-    std::unique_ptr<PageBuffer> buffer;
+    std::shared_ptr<PageBuffer> buffer;
     std::mutex lock;
     uint64_t version;
     uint64_t value_size;
     uint64_t disk_addr;
     uint64_t disk_size;
-    std::atomic<size_t> refcount;
+    uint64_t dirty_bytes;
   };
 
-  void dropEntryReference(PageMap::PageMapEntry* entry);
+  // pages added by addColdPage don't get a PageMapEntry until they are first
+  // modified. until then their slot holds kColdEntry and the page is described
+  // by a compact record that is never changed after the page is added
+  struct ColdPageEntry {
+    uint64_t disk_addr;
+    uint32_t disk_size;
+    uint32_t value_size;
+  };
+
+  static PageMapEntry* const kColdEntry;
+
+  struct Segment {
+    Segment();
+    std::atomic<PageMapEntry*> entries[kSegmentSize];
+    ColdPageEntry cold_entries[kSegmentSize];
+  };
+
+  PageIDType insertEntry(PageMapEntry* entry, const ColdPageEntry* cold_entry);
+
+  Segment* getSegment(PageIDType page_id);
+
+  // must be called with an EpochGuard held. returns kColdEntry for cold pages
+  PageMapEntry* getEntry(PageIDType page_id);
+
+  // must be called with an EpochGuard held. allocates the full entry if the
+  // page is cold
+  PageMapEntry* getHotEntry(PageIDType page_id);
+
+  const ColdPageEntry& getColdEntry(PageIDType page_id);
 
   bool loadPage(
       uint64_t disk_addr,
@@ -80,14 +142,25 @@ protected:
       uint64_t value_size,
       PageBuffer* buffer);
 
-  int fd_;
-  std::mutex mutex_;
-  PageIDType page_id_;
-  std::map<PageIDType, PageMapEntry*> map_;
-*/
-};
+  // the queued requests are worked off by up to this many scheduler tasks
+  static const size_t kPrefetchTasks = 4;
+  static const size_t kMaxPrefetchQueueSize = 4096;
 
-using page_map_ref = std::shared_ptr<page_map>;
+  void runPrefetchTask();
+  void loadPageIntoCache(PageIDType page_id);
 
-} // namespace zdb
+  int fd_;
+  std::atomic<PageIDType> page_id_;
+  std::unique_ptr<std::atomic<Segment*>[]> segments_;
+  EpochManager epoch_;
+  std::atomic<uint64_t> dirty_bytes_;
+  PageCache cache_;
+  zdb::scheduler_ref scheduler_;
+  std::mutex prefetch_mutex_;
+  std::deque<PageIDType> prefetch_queue_;
+  size_t prefetch_tasks_;
+  std::atomic<size_t> prefetch_running_;
+  bool prefetch_stop_;
+};
 
+} // namespace tsdb
@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "parallel.h"
+
+namespace zdb {
+
+void split_morsels(
+    const table& tbl,
+    uint64_t row_begin,
+    uint64_t row_end,
+    uint64_t morsel_rows,
+    std::vector<morsel>* morsels) {
+  morsels->clear();
+
+  uint64_t block_begin = 0;
+  for (size_t b = 0; b < tbl.row_map.size(); ++b) {
+    if (block_begin >= row_end) {
+      break;
+    }
+
+    auto first_row = block_begin;
+    auto block_end = block_begin + tbl.row_map[b].row_count;
+    auto begin = std::max(row_begin, block_begin) - block_begin;
+    auto end = std::min(row_end, block_end) - block_begin;
+    block_begin = block_end;
+
+    while (begin < end) {
+      morsel m;
+      m.row_block = b;
+      m.begin = begin;
+      m.end = end - begin > morsel_rows ? begin + morsel_rows : end;
+      m.first_row = first_row;
+      morsels->emplace_back(m);
+      begin = m.end;
+    }
+  }
+}
+
+size_t get_scan_threads(const scheduler& sched, size_t threads) {
+  return threads > 0 ? threads : sched.size();
+}
+
+namespace {
+
+/* the morsels [begin, end) that are left for one worker. the owner takes
+   morsels from the front, thieves take them from the back */
+struct morsel_queue {
+  std::mutex mutex;
+  size_t begin;
+  size_t end;
+};
+
+} // namespace
+
+void run_morsels(
+    scheduler* sched,
+    size_t morsels,
+    size_t threads,
+    const std::function<void (size_t worker, size_t morsel)>& fn) {
+  threads = std::min(threads, morsels);
+  if (threads <= 1) {
+    for (size_t i = 0; i < morsels; ++i) {
+      fn(0, i);
+    }
+
+    return;
+  }
+
+  std::vector<morsel_queue> queues(threads);
+  for (size_t w = 0; w < threads; ++w) {
+    queues[w].begin = morsels * w / threads;
+    queues[w].end = morsels * (w + 1) / threads;
+  }
+
+  auto pop = [&queues] (size_t w, size_t* m) {
+    std::unique_lock<std::mutex> lk(queues[w].mutex);
+    if (queues[w].begin == queues[w].end) {
+      return false;
+    }
+
+    *m = queues[w].begin++;
+    return true;
+  };
+
+  auto steal = [&queues, threads] (size_t w) {
+    for (size_t i = 1; i < threads; ++i) {
+      auto& victim = queues[(w + i) % threads];
+      size_t begin;
+      size_t end;
+      {
+        std::unique_lock<std::mutex> lk(victim.mutex);
+        if (victim.begin == victim.end) {
+          continue;
+        }
+
+        end = victim.end;
+        begin = end - (end - victim.begin + 1) / 2;
+        victim.end = begin;
+      }
+
+      std::unique_lock<std::mutex> lk(queues[w].mutex);
+      queues[w].begin = begin;
+      queues[w].end = end;
+      return true;
+    }
+
+    return false;
+  };
+
+  auto worker = [&pop, &steal, &fn] (size_t w) {
+    for (;;) {
+      size_t m;
+      if (!pop(w, &m)) {
+        if (!steal(w)) {
+          return;
+        }
+
+        continue;
+      }
+
+      fn(w, m);
+    }
+  };
+
+  std::atomic<size_t> running(threads - 1);
+  for (size_t w = 1; w < threads; ++w) {
+    sched->submit([&worker, &running, w] () {
+      worker(w);
+      running.fetch_sub(1);
+    });
+  }
+
+  worker(0);
+
+  sched->run_until([&running] () { return running.load() == 0; });
+}
+
+} // namespace zdb
+
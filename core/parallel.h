@@ -0,0 +1,57 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <vector>
+#include "metadata.h"
+#include "scheduler.h"
+
+namespace zdb {
+
+/* rows per morsel of a parallel scan */
+const uint64_t kMorselRows = 65536;
+
+/* a range of rows [begin, end) in one row block. first_row is the position
+   of the first row of the block in the table */
+struct morsel {
+  size_t row_block;
+  uint64_t begin;
+  uint64_t end;
+  uint64_t first_row;
+};
+
+/* split the rows [row_begin, row_end) of a table into morsels of up to
+   morsel_rows rows, in row order */
+void split_morsels(
+    const table& tbl,
+    uint64_t row_begin,
+    uint64_t row_end,
+    uint64_t morsel_rows,
+    std::vector<morsel>* morsels);
+
+/* the number of tasks to use for a scan, one per scheduler thread if
+   threads is 0 */
+size_t get_scan_threads(const scheduler& sched, size_t threads);
+
+/**
+ * Call fn(worker, i) for every morsel index i in [0, morsels) from up to
+ * threads tasks on the scheduler, where worker is the index of the task.
+ * Each task starts on an even share of the morsels and, once that is done,
+ * steals half of the remaining morsels of another task, so a few slow
+ * morsels don't leave the other threads idle. The calling thread runs the
+ * first task and helps the scheduler until the others are done.
+ */
+void run_morsels(
+    scheduler* sched,
+    size_t morsels,
+    size_t threads,
+    const std::function<void (size_t worker, size_t morsel)>& fn);
+
+} // namespace zdb
+
@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <string.h>
+#include <algorithm>
+#include "predicate.h"
+
+namespace zdb {
+
+enum compare_op { CMP_EQ, CMP_LT, CMP_LE, CMP_GT, CMP_GE };
+
+/* the comparison is a template parameter so that the switch is resolved at
+   compile time and the comparison is inlined into the target specific kernels
+   below. the operands are passed by reference as vector arguments would change
+   the calling convention between targets */
+template <compare_op kOp, typename V, typename R>
+static inline __attribute__((always_inline))
+void compare_values(const V& a, const V& b, R* r) {
+  switch (kOp) {
+    case CMP_EQ: *r = a == b; break;
+    case CMP_LT: *r = a < b; break;
+    case CMP_LE: *r = a <= b; break;
+    case CMP_GT: *r = a > b; break;
+    case CMP_GE: *r = a >= b; break;
+  }
+}
+
+template <typename T, compare_op kOp, bool kOr>
+static void compare_scalar(
+    const T* values,
+    size_t count,
+    T operand,
+    uint8_t* mask) {
+  for (size_t i = 0; i < count; ++i) {
+    uint8_t m;
+    compare_values<kOp>(values[i], operand, &m);
+    mask[i] = kOr ? (mask[i] | m) : (mask[i] & m);
+  }
+}
+
+/* vector comparisons return lanes of all ones or all zeros in an integer
+   type of the same width as T, which are narrowed to one byte per value */
+template <typename T, size_t kBytes, compare_op kOp, bool kOr>
+static inline __attribute__((always_inline))
+void compare_vector(
+    const T* values,
+    size_t count,
+    T operand,
+    uint8_t* mask) {
+  static const size_t kLanes = kBytes / sizeof(T);
+  typedef T tvec __attribute__((vector_size(kBytes)));
+  typedef uint8_t mvec __attribute__((vector_size(kLanes)));
+
+  tvec operands = tvec{} + operand;
+  size_t i = 0;
+  for (; i + kLanes <= count; i += kLanes) {
+    tvec v;
+    memcpy(&v, values + i, sizeof(v));
+    decltype(v == operands) c;
+    compare_values<kOp>(v, operands, &c);
+    mvec m = __builtin_convertvector(c, mvec) & uint8_t(1);
+
+    mvec cur;
+    memcpy(&cur, mask + i, sizeof(cur));
+    cur = kOr ? (cur | m) : (cur & m);
+    memcpy(mask + i, &cur, sizeof(cur));
+  }
+
+  for (; i < count; ++i) {
+    uint8_t m;
+    compare_values<kOp>(values[i], operand, &m);
+    mask[i] = kOr ? (mask[i] | m) : (mask[i] & m);
+  }
+}
+
+#if defined(__x86_64__)
+
+template <typename T, compare_op kOp, bool kOr>
+static void compare_sse2(
+    const T* values,
+    size_t count,
+    T operand,
+    uint8_t* mask) {
+  compare_vector<T, 16, kOp, kOr>(values, count, operand, mask);
+}
+
+template <typename T, compare_op kOp, bool kOr>
+__attribute__((target("avx2")))
+static void compare_avx2(
+    const T* values,
+    size_t count,
+    T operand,
+    uint8_t* mask) {
+  compare_vector<T, 32, kOp, kOr>(values, count, operand, mask);
+}
+
+#endif
+
+template <typename T>
+const compare_kernels<T>& get_compare_kernels(simd_level level) {
+  static const compare_kernels<T> scalar = {
+    &compare_scalar<T, CMP_EQ, false>,
+    &compare_scalar<T, CMP_LT, false>,
+    &compare_scalar<T, CMP_LE, false>,
+    &compare_scalar<T, CMP_GT, false>,
+    &compare_scalar<T, CMP_GE, false>,
+    &compare_scalar<T, CMP_EQ, true>
+  };
+
+#if defined(__x86_64__)
+  static const compare_kernels<T> sse2 = {
+    &compare_sse2<T, CMP_EQ, false>,
+    &compare_sse2<T, CMP_LT, false>,
+    &compare_sse2<T, CMP_LE, false>,
+    &compare_sse2<T, CMP_GT, false>,
+    &compare_sse2<T, CMP_GE, false>,
+    &compare_sse2<T, CMP_EQ, true>
+  };
+
+  static const compare_kernels<T> avx2 = {
+    &compare_avx2<T, CMP_EQ, false>,
+    &compare_avx2<T, CMP_LT, false>,
+    &compare_avx2<T, CMP_LE, false>,
+    &compare_avx2<T, CMP_GT, false>,
+    &compare_avx2<T, CMP_GE, false>,
+    &compare_avx2<T, CMP_EQ, true>
+  };
+#endif
+
+  switch (std::min(level, simd_detect())) {
+#if defined(__x86_64__)
+    case SIMD_AVX2: return avx2;
+    case SIMD_SSE2: return sse2;
+#endif
+    default: return scalar;
+  }
+}
+
+template <typename T>
+const compare_kernels<T>& get_compare_kernels() {
+  return get_compare_kernels<T>(simd_detect());
+}
+
+#define ZDB_COMPARE_KERNELS(T) \
+    template const compare_kernels<T>& get_compare_kernels<T>( \
+        simd_level level); \
+    template const compare_kernels<T>& get_compare_kernels<T>();
+
+ZDB_COMPARE_KERNELS(uint8_t)
+ZDB_COMPARE_KERNELS(uint32_t)
+ZDB_COMPARE_KERNELS(uint64_t)
+ZDB_COMPARE_KERNELS(int32_t)
+ZDB_COMPARE_KERNELS(int64_t)
+ZDB_COMPARE_KERNELS(float)
+ZDB_COMPARE_KERNELS(double)
+
+} // namespace zdb
+
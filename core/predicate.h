@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include "zdb.h"
+#include "simd.h"
+
+namespace zdb {
+
+/**
+ * Kernels that compare a contiguous array of column values against an
+ * operand and combine the result with a byte mask (one byte per value, 0 or
+ * 1). The comparison kernels AND the result into the mask, eq_or ORs it into
+ * the mask.
+ */
+template <typename T>
+struct compare_kernels {
+  using kernel = void (*)(
+      const T* values,
+      size_t count,
+      T operand,
+      uint8_t* mask);
+
+  kernel eq;
+  kernel lt;
+  kernel le;
+  kernel gt;
+  kernel ge;
+  kernel eq_or;
+};
+
+/* returns the kernels for the given instruction set or, if the cpu doesn't
+   support it, for the best one it does support */
+template <typename T>
+const compare_kernels<T>& get_compare_kernels(simd_level level);
+
+template <typename T>
+const compare_kernels<T>& get_compare_kernels();
+
+} // namespace zdb
+
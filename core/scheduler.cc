@@ -0,0 +1,225 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include "scheduler.h"
+
+namespace zdb {
+
+/* the scheduler whose tasks the current thread may run without blocking and,
+   on worker threads, the index of the worker */
+static thread_local const scheduler* current_scheduler = nullptr;
+static thread_local size_t current_worker = size_t(-1);
+
+static size_t get_threads(const scheduler_options& opts) {
+  if (opts.threads > 0) {
+    return opts.threads;
+  }
+
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+scheduler::scheduler(
+    const scheduler_options& opts_) :
+    opts(opts_),
+    nthreads(get_threads(opts_)),
+    queued(0),
+    available(0),
+    next_queue(0),
+    stop(false) {
+  for (size_t i = 0; i < nthreads; ++i) {
+    queues.emplace_back(new worker_queue());
+  }
+}
+
+scheduler::~scheduler() {
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+    stop = true;
+  }
+
+  cv.notify_all();
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+size_t scheduler::size() const {
+  return nthreads;
+}
+
+void scheduler::start() {
+  for (size_t i = 0; i < nthreads; ++i) {
+    threads.emplace_back(&scheduler::run_worker, this, i);
+  }
+}
+
+void scheduler::submit(std::function<void ()> task) {
+  std::call_once(started, [this] () { start(); });
+
+  auto on_scheduler = current_scheduler == this;
+  size_t q;
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (!on_scheduler) {
+      space_cv.wait(lk, [this] () { return queued < opts.max_queued_tasks; });
+    }
+
+    ++queued;
+    if (on_scheduler && current_worker < nthreads) {
+      q = current_worker;
+    } else {
+      q = next_queue++ % nthreads;
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(queues[q]->mutex);
+    queues[q]->tasks.emplace_back(std::move(task));
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+    ++available;
+  }
+
+  cv.notify_all();
+}
+
+bool scheduler::pop(size_t worker, std::function<void ()>* task) {
+  bool found = false;
+
+  /* the newest task of the own deque is the most likely to be in cache */
+  if (worker < nthreads) {
+    auto& q = *queues[worker];
+    std::unique_lock<std::mutex> lk(q.mutex);
+    if (!q.tasks.empty()) {
+      *task = std::move(q.tasks.back());
+      q.tasks.pop_back();
+      found = true;
+    }
+  }
+
+  /* steal the oldest task from the other deques */
+  for (size_t i = 1; !found && i <= nthreads; ++i) {
+    auto& q = *queues[(worker + i) % nthreads];
+    std::unique_lock<std::mutex> lk(q.mutex);
+    if (!q.tasks.empty()) {
+      *task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      found = true;
+    }
+  }
+
+  if (!found) {
+    return false;
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+    --available;
+    --queued;
+  }
+
+  space_cv.notify_one();
+  return true;
+}
+
+void scheduler::run_task(std::function<void ()>* task) {
+  (*task)();
+  *task = nullptr;
+
+  /* wake up the threads in run_until. taking the mutex orders the
+     notification after the waiters last check */
+  {
+    std::unique_lock<std::mutex> lk(mutex);
+  }
+
+  cv.notify_all();
+}
+
+void scheduler::run_worker(size_t worker) {
+  current_scheduler = this;
+  current_worker = worker;
+
+#if defined(__linux__)
+  if (opts.pin_threads) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker % std::max(std::thread::hardware_concurrency(), 1u), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+#endif
+
+  for (;;) {
+    std::function<void ()> task;
+    if (pop(worker, &task)) {
+      run_task(&task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lk(mutex);
+    if (available > 0) {
+      continue;
+    }
+
+    if (stop) {
+      return;
+    }
+
+    cv.wait(lk);
+  }
+}
+
+void scheduler::run_until(const std::function<bool ()>& done) {
+  auto prev_scheduler = current_scheduler;
+  auto prev_worker = current_worker;
+  if (current_scheduler != this) {
+    current_scheduler = this;
+    current_worker = size_t(-1);
+  }
+
+  while (!done()) {
+    std::function<void ()> task;
+    if (pop(current_worker, &task)) {
+      run_task(&task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lk(mutex);
+    if (done()) {
+      break;
+    }
+
+    if (available == 0) {
+      cv.wait(lk);
+    }
+  }
+
+  current_scheduler = prev_scheduler;
+  current_worker = prev_worker;
+}
+
+scheduler_ref get_default_scheduler() {
+  static scheduler_ref sched(new scheduler());
+  return sched;
+}
+
+zdb_err_t scheduler_init(const scheduler_options& opts, scheduler_ref* sched) {
+  if (opts.max_queued_tasks == 0) {
+    return ZDB_ERR_INVALID_ARGUMENT;
+  }
+
+  sched->reset(new scheduler(opts));
+  return ZDB_SUCCESS;
+}
+
+} // namespace zdb
+
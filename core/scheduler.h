@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "zdb.h"
+
+namespace zdb {
+
+/**
+ * A work-stealing task scheduler. Each worker has its own deque of tasks. A
+ * worker runs the newest task from its own deque and, once that is empty,
+ * steals the oldest task from another worker's deque. The worker threads are
+ * started on the first submit.
+ *
+ * One scheduler can be shared by several databases, so that parallel
+ * operations on all of them together don't use more threads than there are
+ * cores.
+ */
+class scheduler {
+public:
+
+  explicit scheduler(const scheduler_options& opts = scheduler_options());
+  scheduler(const scheduler& o) = delete;
+  scheduler& operator=(const scheduler& o) = delete;
+
+  /* runs the tasks that are still queued and stops the workers */
+  ~scheduler();
+
+  /* the number of worker threads */
+  size_t size() const;
+
+  /* queue a task. tasks submitted from a worker go to the workers own deque,
+     other tasks are spread over the deques. if the queue is full, submit
+     blocks until there is room, except on worker threads and threads that
+     are inside run_until, which must not wait for their own tasks */
+  void submit(std::function<void ()> task);
+
+  /* run queued tasks on the calling thread until done returns true. threads
+     that wait for tasks they submitted use this instead of blocking, so that
+     waiting on a worker can't deadlock the scheduler */
+  void run_until(const std::function<bool ()>& done);
+
+protected:
+
+  struct worker_queue {
+    std::mutex mutex;
+    std::deque<std::function<void ()>> tasks;
+  };
+
+  void start();
+  void run_worker(size_t worker);
+
+  /* pop the newest task of the given worker or, if that is empty or worker
+     is not a worker index, steal the oldest task of another worker */
+  bool pop(size_t worker, std::function<void ()>* task);
+  void run_task(std::function<void ()>* task);
+
+  const scheduler_options opts;
+  const size_t nthreads;
+  std::vector<std::unique_ptr<worker_queue>> queues;
+  std::vector<std::thread> threads;
+  std::once_flag started;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::condition_variable space_cv;
+  size_t queued;
+  size_t available;
+  size_t next_queue;
+  bool stop;
+};
+
+/* the scheduler that databases use unless they are given another one. it has
+   one worker per core */
+scheduler_ref get_default_scheduler();
+
+} // namespace zdb
+
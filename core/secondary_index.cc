@@ -0,0 +1,275 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <string.h>
+#include <algorithm>
+#include "secondary_index.h"
+
+namespace zdb {
+
+template <typename T>
+class secondary_index_fixed : public secondary_index {
+public:
+  void insert(const void* value, uint64_t row) override;
+  size_t count(const predicate& pred) const override;
+  void find(
+      const predicate& pred,
+      std::vector<uint64_t>* rows) const override;
+
+protected:
+
+  /* entries that are buffered before they are sorted into a run */
+  static const size_t kBufferSize = 1024;
+
+  struct entry {
+    T value;
+    uint64_t row;
+
+    bool operator<(const entry& o) const {
+      return value < o.value || (!(o.value < value) && row < o.row);
+    }
+  };
+
+  using entry_iter = typename std::vector<entry>::const_iterator;
+  using range = std::pair<entry_iter, entry_iter>;
+
+  /* the ranges of a sorted run that match a predicate */
+  void get_ranges(
+      const std::vector<entry>& run,
+      const predicate& pred,
+      std::vector<range>* ranges) const;
+
+  bool matches(T value, const predicate& pred) const;
+
+  void flush();
+
+  std::vector<std::vector<entry>> runs;
+  std::vector<entry> buffer;
+};
+
+template <typename T>
+static T get_operand(const predicate& pred, size_t i) {
+  T v;
+  memcpy(&v, pred.operands.data() + i * sizeof(T), sizeof(T));
+  return v;
+}
+
+template <typename T>
+void secondary_index_fixed<T>::insert(const void* value, uint64_t row) {
+  entry e;
+  memcpy(&e.value, value, sizeof(T));
+  e.row = row;
+
+  /* NaNs don't match any predicate and have no place in the sort order */
+  if (!(e.value == e.value)) {
+    return;
+  }
+
+  buffer.emplace_back(e);
+  if (buffer.size() >= kBufferSize) {
+    flush();
+  }
+}
+
+template <typename T>
+void secondary_index_fixed<T>::flush() {
+  std::sort(buffer.begin(), buffer.end());
+  runs.emplace_back(std::move(buffer));
+  buffer.clear();
+
+  /* merge the newest run into the previous one while that is no more than
+     twice as large */
+  while (runs.size() > 1 &&
+         runs[runs.size() - 2].size() <= runs.back().size() * 2) {
+    auto& a = runs[runs.size() - 2];
+    auto& b = runs.back();
+    std::vector<entry> merged;
+    merged.reserve(a.size() + b.size());
+    std::merge(
+        a.begin(),
+        a.end(),
+        b.begin(),
+        b.end(),
+        std::back_inserter(merged));
+
+    runs.pop_back();
+    runs.back() = std::move(merged);
+  }
+}
+
+template <typename T>
+void secondary_index_fixed<T>::get_ranges(
+    const std::vector<entry>& run,
+    const predicate& pred,
+    std::vector<range>* ranges) const {
+  auto lower = [&run] (T v) {
+    return std::lower_bound(
+        run.begin(),
+        run.end(),
+        v,
+        [] (const entry& e, T v) { return e.value < v; });
+  };
+
+  auto upper = [&run] (T v) {
+    return std::upper_bound(
+        run.begin(),
+        run.end(),
+        v,
+        [] (T v, const entry& e) { return v < e.value; });
+  };
+
+  auto v = get_operand<T>(pred, 0);
+  switch (pred.op) {
+    case ZDB_PREDICATE_EQ:
+      ranges->emplace_back(lower(v), upper(v));
+      break;
+    case ZDB_PREDICATE_LT:
+      ranges->emplace_back(run.begin(), lower(v));
+      break;
+    case ZDB_PREDICATE_LE:
+      ranges->emplace_back(run.begin(), upper(v));
+      break;
+    case ZDB_PREDICATE_GT:
+      ranges->emplace_back(upper(v), run.end());
+      break;
+    case ZDB_PREDICATE_GE:
+      ranges->emplace_back(lower(v), run.end());
+      break;
+    case ZDB_PREDICATE_BETWEEN: {
+      auto begin = lower(v);
+      auto end = upper(get_operand<T>(pred, 1));
+      ranges->emplace_back(begin, std::max(begin, end));
+      break;
+    }
+    case ZDB_PREDICATE_IN: {
+      /* operands that are given more than once are only looked up once */
+      std::vector<T> operands(pred.operands.size() / sizeof(T));
+      for (size_t i = 0; i < operands.size(); ++i) {
+        operands[i] = get_operand<T>(pred, i);
+      }
+
+      std::sort(operands.begin(), operands.end());
+      operands.erase(
+          std::unique(operands.begin(), operands.end()),
+          operands.end());
+
+      for (auto o : operands) {
+        ranges->emplace_back(lower(o), upper(o));
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+template <typename T>
+bool secondary_index_fixed<T>::matches(T value, const predicate& pred) const {
+  auto v = get_operand<T>(pred, 0);
+  switch (pred.op) {
+    case ZDB_PREDICATE_EQ:
+      return value == v;
+    case ZDB_PREDICATE_LT:
+      return value < v;
+    case ZDB_PREDICATE_LE:
+      return value <= v;
+    case ZDB_PREDICATE_GT:
+      return value > v;
+    case ZDB_PREDICATE_GE:
+      return value >= v;
+    case ZDB_PREDICATE_BETWEEN:
+      return value >= v && value <= get_operand<T>(pred, 1);
+    case ZDB_PREDICATE_IN:
+      for (size_t i = 0; i < pred.operands.size() / sizeof(T); ++i) {
+        if (value == get_operand<T>(pred, i)) {
+          return true;
+        }
+      }
+
+      return false;
+    default:
+      return false;
+  }
+}
+
+template <typename T>
+size_t secondary_index_fixed<T>::count(const predicate& pred) const {
+  size_t n = 0;
+
+  std::vector<range> ranges;
+  for (const auto& run : runs) {
+    ranges.clear();
+    get_ranges(run, pred, &ranges);
+    for (const auto& r : ranges) {
+      n += r.second - r.first;
+    }
+  }
+
+  for (const auto& e : buffer) {
+    n += matches(e.value, pred);
+  }
+
+  return n;
+}
+
+template <typename T>
+void secondary_index_fixed<T>::find(
+    const predicate& pred,
+    std::vector<uint64_t>* rows) const {
+  auto first = rows->size();
+
+  std::vector<range> ranges;
+  for (const auto& run : runs) {
+    ranges.clear();
+    get_ranges(run, pred, &ranges);
+    for (const auto& r : ranges) {
+      for (auto iter = r.first; iter != r.second; ++iter) {
+        rows->emplace_back(iter->row);
+      }
+    }
+  }
+
+  for (const auto& e : buffer) {
+    if (matches(e.value, pred)) {
+      rows->emplace_back(e.row);
+    }
+  }
+
+  /* the entries are sorted by value, and there is one entry per row */
+  std::sort(rows->begin() + first, rows->end());
+}
+
+std::unique_ptr<secondary_index> make_secondary_index(zdb_type_t type) {
+  switch (type) {
+    case ZDB_BOOL:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<uint8_t>());
+    case ZDB_UINT32:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<uint32_t>());
+    case ZDB_UINT64:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<uint64_t>());
+    case ZDB_INT32:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<int32_t>());
+    case ZDB_INT64:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<int64_t>());
+    case ZDB_FLOAT32:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<float>());
+    case ZDB_FLOAT64:
+      return std::unique_ptr<secondary_index>(
+          new secondary_index_fixed<double>());
+    default:
+      return nullptr;
+  }
+}
+
+} // namespace zdb
+
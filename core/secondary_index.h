@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include "zdb.h"
+
+namespace zdb {
+
+/**
+ * An in-memory index from the values of a column to the rows that contain
+ * them. New entries are buffered and then sorted into runs of (value, row)
+ * pairs. Runs of similar size are merged, so there are O(log n) runs and an
+ * insert costs O(log n) amortized. Lookups binary search each run.
+ */
+class secondary_index {
+public:
+  virtual ~secondary_index() = default;
+
+  /* index the value of a row. rows must be added in ascending order */
+  virtual void insert(const void* value, uint64_t row) = 0;
+
+  /* the number of rows that match a predicate on the indexed column */
+  virtual size_t count(const predicate& pred) const = 0;
+
+  /* append the rows that match a predicate on the indexed column, in
+     ascending order */
+  virtual void find(
+      const predicate& pred,
+      std::vector<uint64_t>* rows) const = 0;
+};
+
+std::unique_ptr<secondary_index> make_secondary_index(zdb_type_t type);
+
+} // namespace zdb
+
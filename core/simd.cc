@@ -0,0 +1,26 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include "simd.h"
+
+namespace zdb {
+
+simd_level simd_detect() {
+#if defined(__x86_64__)
+  static const simd_level level = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+  }();
+
+  return level;
+#else
+  return SIMD_SCALAR;
+#endif
+}
+
+} // namespace zdb
+
@@ -0,0 +1,23 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+
+namespace zdb {
+
+/* the instruction sets that kernels are compiled for */
+enum simd_level {
+  SIMD_SCALAR = 0,
+  SIMD_SSE2 = 1,
+  SIMD_AVX2 = 2
+};
+
+/* returns the best instruction set supported by this cpu */
+simd_level simd_detect();
+
+} // namespace zdb
+
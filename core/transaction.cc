@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include "transaction.h"
+
+namespace tsdb {
+
+Transaction::Transaction() :
+    page_index_(nullptr),
+    page_map_(nullptr),
+    readonly_(true) {}
+
+Transaction::Transaction(
+    PageIndex* page_index,
+    PageMap* page_map,
+    bool readonly) :
+    page_index_(page_index),
+    page_map_(page_map),
+    readonly_(readonly) {}
+
+PageIndex* Transaction::getPageIndex() const {
+  return page_index_;
+}
+
+PageMap* Transaction::getPageMap() const {
+  return page_map_;
+}
+
+bool Transaction::isReadonly() const {
+  return readonly_;
+}
+
+TransactionMap::TransactionMap(PageMap* page_map) : page_map_(page_map) {}
+
+bool TransactionMap::createSlot(
+    uint64_t series_id,
+    std::unique_ptr<PageIndex> page_index) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (map_.count(series_id) > 0) {
+    return false;
+  }
+
+  map_.emplace(series_id, std::move(page_index));
+  return true;
+}
+
+void TransactionMap::listSlots(std::set<uint64_t>* series_ids) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  for (const auto& slot : map_) {
+    series_ids->insert(slot.first);
+  }
+}
+
+bool TransactionMap::startTransaction(
+    uint64_t series_id,
+    bool readonly,
+    Transaction* txn) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  auto slot = map_.find(series_id);
+  if (slot == map_.end()) {
+    return false;
+  }
+
+  *txn = Transaction(slot->second.get(), page_map_, readonly);
+  return true;
+}
+
+} // namespace tsdb
+
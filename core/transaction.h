@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include "page_map.h"
+#include "page_index.h"
+
+namespace tsdb {
+
+/**
+ * A transaction binds the page index of one series to the page map that holds
+ * its pages. Readonly transactions must not modify the series.
+ */
+class Transaction {
+public:
+
+  Transaction();
+  Transaction(PageIndex* page_index, PageMap* page_map, bool readonly);
+
+  PageIndex* getPageIndex() const;
+  PageMap* getPageMap() const;
+  bool isReadonly() const;
+
+protected:
+  PageIndex* page_index_;
+  PageMap* page_map_;
+  bool readonly_;
+};
+
+/**
+ * The transaction map owns the page index of every series in the database
+ */
+class TransactionMap {
+public:
+
+  TransactionMap(PageMap* page_map);
+  TransactionMap(const TransactionMap& o) = delete;
+  TransactionMap& operator=(const TransactionMap& o) = delete;
+
+  /* returns false if a slot for the series already exists */
+  bool createSlot(uint64_t series_id, std::unique_ptr<PageIndex> page_index);
+
+  void listSlots(std::set<uint64_t>* series_ids);
+
+  /* returns false if there is no slot for the series */
+  bool startTransaction(
+      uint64_t series_id,
+      bool readonly,
+      Transaction* txn);
+
+protected:
+  PageMap* page_map_;
+  std::mutex mutex_;
+  std::map<uint64_t, std::unique_ptr<PageIndex>> map_;
+};
+
+} // namespace tsdb
+
@@ -6,23 +6,53 @@
  * under the 3-Clause BSD License (BSD-3-Clause).
  */
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "tsdb.h"
 #include "page_index.h"
+#include "checksum.h"
+#include "varint.h"
 
 namespace tsdb {
 
 const size_t TSDB::kMetaBlockSize = 512;
-const size_t TSDB::kDefaultBlockSize = 512;
+const size_t TSDB::kMetaBlockCount = 2;
+const uint64_t TSDB::kMetaBlockVersion = 1;
+const size_t TSDB::kDefaultBlockSize = 4096;
+const size_t TSDB::kDefaultExtentSize = 64 * 1024 * 1024;
+const size_t TSDB::kDefaultPageCacheSize = 64 * 1024 * 1024;
+const size_t TSDB::kDefaultPageSplitSize = 64 * 1024;
+const uint64_t TSDB::kTxnFlagFixedLayout = 1;
+const size_t TSDB::kTxnHeaderSize = 16;
+const size_t TSDB::kFixedSeriesIndexHeaderSize = 32;
 const char TSDB::kMagicBytes[4] = {0x17, 0x42, 0x05, 0x23};
 
+TSDBOptions::TSDBOptions() :
+    block_size(TSDB::kDefaultBlockSize),
+    extent_size(TSDB::kDefaultExtentSize),
+    scheduler(zdb::get_default_scheduler()),
+    commit_threads(0),
+    load_threads(0),
+    checkpoint_interval_ms(0),
+    checkpoint_dirty_bytes(0),
+    fixed_layout(false),
+    preload_series(false),
+    page_cache_size(TSDB::kDefaultPageCacheSize),
+    page_split_size(TSDB::kDefaultPageSplitSize) {}
+
 bool TSDB::createDatabase(
     std::unique_ptr<TSDB>* db,
     const std::string& filename,
-    size_t block_size /* = kDefaultBlockSize */) {
+    const TSDBOptions& opts /* = TSDBOptions() */) {
+  auto block_size = opts.block_size;
   assert(block_size >= kMetaBlockSize);
 
   int fd = ::open(
@@ -34,22 +64,29 @@ bool TSDB::createDatabase(
     return false;
   }
 
-  db->reset(new TSDB(fd, block_size, block_size));
+  /* the first blocks of the file are reserved for the metablock slots */
+  auto fpos = kMetaBlockSize * kMetaBlockCount;
+  fpos = ((fpos + block_size - 1) / block_size) * block_size;
+
+  db->reset(new TSDB(fd, fpos, block_size, opts));
+  (*db)->startCheckpointer();
   return true;
 }
 
 bool TSDB::openDatabase(
     std::unique_ptr<TSDB>* db,
-    const std::string& filename) {
+    const std::string& filename,
+    const TSDBOptions& opts /* = TSDBOptions() */) {
   int fd = ::open(filename.c_str(), O_RDWR | O_CLOEXEC);
   if (fd < 0) {
     return false;
   }
 
-  std::unique_ptr<TSDB> loading(new TSDB(fd, 0, 0));
+  std::unique_ptr<TSDB> loading(new TSDB(fd, 0, 0, opts));
 
   if (loading->load()) {
     *db = std::move(loading);
+    (*db)->startCheckpointer();
     return true;
   } else {
     return false;
@@ -59,18 +96,72 @@ bool TSDB::openDatabase(
 TSDB::TSDB(
     int fd,
     size_t fpos,
-    size_t bsize) :
+    size_t bsize,
+    const TSDBOptions& opts) :
     fd_(fd),
     fpos_(fpos),
+    fsize_(0),
     bsize_(bsize),
-    page_map_(fd),
-    txn_map_(&page_map_) {
+    extent_size_(opts.extent_size),
+    scheduler_(opts.scheduler ? opts.scheduler : zdb::get_default_scheduler()),
+    commit_threads_(opts.commit_threads),
+    load_threads_(opts.load_threads),
+    preload_series_(opts.preload_series),
+    fixed_layout_(opts.fixed_layout),
+    page_split_size_(opts.page_split_size),
+    meta_sequence_(0),
+    meta_slots_(kMetaBlockCount),
+    page_map_(fd, opts.page_cache_size, scheduler_),
+    txn_map_(&page_map_),
+    lazy_series_(nullptr),
+    lazy_series_count_(0),
+    txn_mmap_(nullptr),
+    txn_mmap_size_(0),
+    checkpoint_interval_ms_(opts.checkpoint_interval_ms),
+    checkpoint_dirty_bytes_(opts.checkpoint_dirty_bytes),
+    checkpoint_stop_(false) {
 #ifdef HAVE_POSIX_FADVISE
   posix_fadvise(fd_, 0, 0, POSIX_FADV_RANDOM);
 #endif
 }
 
+void TSDB::runParallel(
+    size_t njobs,
+    size_t ntasks,
+    std::function<void (size_t)> fn) {
+  if (ntasks == 0) {
+    ntasks = scheduler_->size();
+  }
+
+  std::atomic<size_t> next_job(0);
+  auto worker = [&next_job, njobs, &fn] () {
+    for (size_t i; (i = next_job.fetch_add(1)) < njobs; ) {
+      fn(i);
+    }
+  };
+
+  std::atomic<size_t> running(0);
+  for (size_t i = 1; i < std::min(ntasks, njobs); ++i) {
+    running.fetch_add(1);
+    scheduler_->submit([&worker, &running] () {
+      worker();
+      running.fetch_sub(1);
+    });
+  }
+
+  worker();
+
+  scheduler_->run_until([&running] () { return running.load() == 0; });
+}
+
 TSDB::~TSDB() {
+  stopCheckpointer();
+  page_map_.stopPrefetch();
+
+  if (txn_mmap_) {
+    munmap(txn_mmap_, txn_mmap_size_);
+  }
+
   close(fd_);
 }
 
@@ -82,15 +173,21 @@ bool TSDB::createSeries(
     return false;
   }
 
+  /* the series might exist on disk without being loaded yet */
+  if (findLazySeries(series_id)) {
+    return false;
+  }
+
   std::unique_ptr<PageIndex> page_index(
       new PageIndex(
           value_size,
           std::string(metadata)));
 
-  page_index->alloc(1);
-
-  auto page_index_entry = page_index->getEntries();
-  page_index_entry->page_id = page_map_.allocPage(value_size);
+  std::shared_ptr<PageIndexVersion> version(new PageIndexVersion());
+  PageIndexEntry page_index_entry;
+  page_index_entry.page_id = page_map_.allocPage(value_size);
+  version->entries.emplace_back(page_index_entry);
+  page_index->setVersion(std::move(version));
 
   return txn_map_.createSlot(
       series_id,
@@ -99,6 +196,10 @@ bool TSDB::createSeries(
 
 bool TSDB::listSeries(std::set<uint64_t>* series_ids) {
   txn_map_.listSlots(series_ids);
+  for (size_t i = 0; i < lazy_series_count_; ++i) {
+    series_ids->insert(lazy_series_[i].series_id);
+  }
+
   return true;
 }
 
@@ -111,13 +212,17 @@ bool TSDB::getCursor(
     return false;
   }
 
+  if (!ensureSeriesLoaded(series_id)) {
+    return false;
+  }
+
   /* start transaction */
   Transaction txn;
   if (!txn_map_.startTransaction(series_id, readonly, &txn)) {
     return false;
   }
 
-  *cursor = Cursor(&page_map_, std::move(txn));
+  *cursor = Cursor(&page_map_, std::move(txn), page_split_size_);
 
   switch (seek_type) {
     case SEEK_FIRST:
@@ -138,6 +243,10 @@ bool TSDB::getSeriesMetadata(uint64_t series_id, std::string* metadata) {
     return false;
   }
 
+  if (!ensureSeriesLoaded(series_id)) {
+    return false;
+  }
+
   Transaction txn;
   if (!txn_map_.startTransaction(series_id, true, &txn)) {
     return false;
@@ -147,6 +256,78 @@ bool TSDB::getSeriesMetadata(uint64_t series_id, std::string* metadata) {
   return true;
 }
 
+void TSDB::encodeMetaBlock(const MetaBlock& metablock, std::string* out) {
+  *out = std::string(kMagicBytes, sizeof(kMagicBytes));
+  writeVarUInt(out, kMetaBlockVersion);
+  writeVarUInt(out, metablock.sequence);
+  writeVarUInt(out, metablock.slots);
+  writeVarUInt(out, metablock.txn_addr);
+  writeVarUInt(out, metablock.txn_size);
+  writeVarUInt(out, metablock.fpos);
+
+  /* append the checksum of everything before it (little endian) */
+  auto crc = computeCRC32(out->data(), out->size());
+  for (size_t i = 0; i < sizeof(crc); ++i) {
+    *out += char((crc >> (i * 8)) & 0xff);
+  }
+
+  assert(out->size() <= kMetaBlockSize);
+}
+
+bool TSDB::decodeMetaBlock(
+    const char* data,
+    size_t len,
+    MetaBlock* metablock) {
+  if (len < sizeof(kMagicBytes) ||
+      memcmp(data, kMagicBytes, sizeof(kMagicBytes)) != 0) {
+    return false;
+  }
+
+  auto cur = data + sizeof(kMagicBytes);
+  auto end = data + len;
+  uint64_t version;
+  if (!readVarUInt(&cur, end, &version)) {
+    return false;
+  }
+
+  /* unversioned metablocks start with the transaction address, which is
+     always at least one block past the start of the file */
+  if (version != kMetaBlockVersion) {
+    metablock->version = 0;
+    metablock->sequence = 0;
+    metablock->slots = 1;
+    metablock->txn_addr = version;
+    return
+        version >= kMetaBlockSize &&
+        readVarUInt(&cur, end, &metablock->txn_size) &&
+        readVarUInt(&cur, end, &metablock->fpos);
+  }
+
+  metablock->version = version;
+  if (!readVarUInt(&cur, end, &metablock->sequence) ||
+      !readVarUInt(&cur, end, &metablock->slots) ||
+      !readVarUInt(&cur, end, &metablock->txn_addr) ||
+      !readVarUInt(&cur, end, &metablock->txn_size) ||
+      !readVarUInt(&cur, end, &metablock->fpos)) {
+    return false;
+  }
+
+  if (metablock->slots < 1 || metablock->slots > kMetaBlockCount) {
+    return false;
+  }
+
+  uint32_t crc = 0;
+  if (cur + sizeof(crc) > end) {
+    return false;
+  }
+
+  for (size_t i = 0; i < sizeof(crc); ++i) {
+    crc |= uint32_t((unsigned char) cur[i]) << (i * 8);
+  }
+
+  return crc == computeCRC32(data, cur - data);
+}
+
 bool TSDB::allocPage(
     uint64_t min_size,
     uint64_t* page_addr,
@@ -157,19 +338,28 @@ bool TSDB::allocPage(
   *page_addr = fpos_;
   auto new_fpos = fpos_ + *page_size;
 
+  /* if the page doesn't fit into the already preallocated part of the file,
+     grow the file by (at least) one more extent */
+  if (new_fpos > fsize_) {
+    auto new_fsize = std::max(fsize_ + extent_size_, new_fpos);
+    new_fsize = ((new_fsize + bsize_ - 1) / bsize_) * bsize_;
+
 #ifdef HAVE_POSIX_FALLOCATE
-  if (posix_fallocate(fd_, fpos_, *page_size) != 0) {
-    return false;
-  }
+    if (posix_fallocate(fd_, fsize_, new_fsize - fsize_) != 0) {
+      return false;
+    }
 #else
-  /* fall back to using ftruncate if the os doesn't support a preallocation call
-     we skip the hack where a single zero byte is written to the end of file to 
-     actually 'force' the allocation. */
-  if (ftruncate(fd_, new_fpos) != 0) {
-    return false;
-  }
+    /* fall back to using ftruncate if the os doesn't support a preallocation
+       call we skip the hack where a single zero byte is written to the end of
+       file to actually 'force' the allocation. */
+    if (ftruncate(fd_, new_fsize) != 0) {
+      return false;
+    }
 #endif
 
+    fsize_ = new_fsize;
+  }
+
   fpos_ = new_fpos;
   return true;
 }
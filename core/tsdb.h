@@ -7,20 +7,101 @@
  */
 #pragma once
 #include <stdlib.h>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include "transaction.h"
 #include "page_map.h"
+#include "page_index.h"
 #include "page_buffer.h"
-#include "cursor.h"
+#include "tsdb_cursor.h"
+#include "scheduler.h"
 
 namespace tsdb {
 
+struct TSDBOptions {
+  TSDBOptions();
+
+  /* the size of a block in bytes. all pages are aligned to and padded to the
+     block size. only used when creating a new database */
+  size_t block_size;
+
+  /* the database file is grown in extents of this many bytes so that pages
+     can be handed out without a syscall per page */
+  size_t extent_size;
+
+  /* the scheduler that runs the parallel parts of commits and loads and the
+     background page reads. databases that share a scheduler together don't
+     use more threads than it has. defaults to zdb::get_default_scheduler() */
+  zdb::scheduler_ref scheduler;
+
+  /* the maximum number of tasks that encode pages during a commit. one per
+     scheduler thread if 0 */
+  size_t commit_threads;
+
+  /* the maximum number of tasks that read series indexes when opening a
+     database. one per scheduler thread if 0 */
+  size_t load_threads;
+
+  /* if non-zero, a background thread commits the database once this many
+     milliseconds have passed since the last commit and there are changes */
+  uint64_t checkpoint_interval_ms;
+
+  /* if non-zero, a background thread commits the database once roughly this
+     many bytes have been modified since the last commit */
+  uint64_t checkpoint_dirty_bytes;
+
+  /* if true, commits write the transaction and series indexes as fixed width,
+     aligned records. the transaction is then memory mapped and searched in
+     place when the database is opened instead of being parsed */
+  bool fixed_layout;
+
+  /* if true, all series indexes are loaded when the database is opened.
+     otherwise each series index is loaded the first time it is accessed */
+  bool preload_series;
+
+  /* the maximum amount of memory used to cache clean pages */
+  size_t page_cache_size;
+
+  /* pages are split in two once their encoded size exceeds this many bytes.
+     adjacent pages are merged once they fit into half of it */
+  size_t page_split_size;
+};
+
+/* the location of a series index on disk, in blocks. this is also the
+   record format of fixed layout transactions */
+struct SeriesIndexRef {
+  uint64_t series_id;
+  uint64_t disk_addr;
+  uint64_t disk_size;
+};
+
+static_assert(sizeof(SeriesIndexRef) == 24, "SeriesIndexRef must be packed");
+
 class TSDB {
 public:
 
   static const size_t kMetaBlockSize;
+  static const size_t kMetaBlockCount;
+  static const uint64_t kMetaBlockVersion;
   static const size_t kDefaultBlockSize;
+  static const size_t kDefaultExtentSize;
+  static const size_t kDefaultPageCacheSize;
+  static const size_t kDefaultPageSplitSize;
+  /* fixed layout transactions start with the varint flags and block size,
+     zero padded to kTxnHeaderSize bytes. they are followed by the number of
+     series and one SeriesIndexRef record per series, sorted by series id.
+     fixed layout series indexes start with four words (zero, value size,
+     metadata length, number of pages) followed by the metadata padded to 8
+     bytes, the splitpoints and one (address, size) pair per page. all words
+     are 64 bit little endian */
+  static const uint64_t kTxnFlagFixedLayout;
+  static const size_t kTxnHeaderSize;
+  static const size_t kFixedSeriesIndexHeaderSize;
   static const char kMagicBytes[4];
 
   enum SeekType {
@@ -35,12 +116,13 @@ public:
 
   static bool openDatabase(
       std::unique_ptr<TSDB>* db,
-      const std::string& filename);
+      const std::string& filename,
+      const TSDBOptions& opts = TSDBOptions());
 
   static bool createDatabase(
       std::unique_ptr<TSDB>* db,
       const std::string& filename,
-      size_t block_size = kDefaultBlockSize);
+      const TSDBOptions& opts = TSDBOptions());
 
   bool createSeries(
       uint64_t series_id,
@@ -66,13 +148,54 @@ public:
 
 protected:
 
-  TSDB(int fd, size_t fpos, size_t block_size);
+  /* the database has kMetaBlockCount metablock slots at the start of the
+     file. commits alternate between the slots and on load the valid slot
+     with the highest sequence number wins. files written before the slots
+     were introduced have a single unversioned metablock (version 0) and
+     their pages start right after the first block, so they keep committing
+     to the first slot only */
+  struct MetaBlock {
+    uint64_t version;
+    uint64_t sequence;
+    uint64_t slots;
+    uint64_t txn_addr;
+    uint64_t txn_size;
+    uint64_t fpos;
+  };
+
+  static void encodeMetaBlock(const MetaBlock& metablock, std::string* out);
+  static bool decodeMetaBlock(
+      const char* data,
+      size_t len,
+      MetaBlock* metablock);
+
+  TSDB(int fd, size_t fpos, size_t block_size, const TSDBOptions& opts);
+
+  /**
+   * Call fn(i) for each i in [0, njobs) from up to ntasks tasks on the
+   * scheduler (one per scheduler thread if 0). The jobs are handed out in
+   * order. The calling thread runs the first task and helps the scheduler
+   * until the others are done
+   */
+  void runParallel(
+      size_t njobs,
+      size_t ntasks,
+      std::function<void (size_t)> fn);
 
   bool load();
+  bool loadFixedTransaction(uint64_t txn_addr, uint64_t txn_size);
+  bool loadSeries(std::vector<SeriesIndexRef>* series_indexes);
+  bool ensureSeriesLoaded(uint64_t series_id);
+  const SeriesIndexRef* findLazySeries(uint64_t series_id) const;
   bool loadTransaction(
-      uint64_t series_id,
       uint64_t disk_addr,
-      uint64_t disk_size);
+      uint64_t disk_size,
+      std::unique_ptr<PageIndex>* page_index);
+  bool loadFixedSeriesIndex(
+      const std::string& index_data,
+      uint64_t disk_addr,
+      uint64_t disk_size,
+      std::unique_ptr<PageIndex>* page_index);
 
   // bool insert(
   //     uint64_t series_id,
@@ -85,12 +208,45 @@ protected:
       uint64_t* page_addr,
       uint64_t* page_size);
 
+  void startCheckpointer();
+  void stopCheckpointer();
+  void runCheckpointer();
+
   int fd_;
   size_t fpos_;
+  size_t fsize_;
   size_t bsize_;
+  size_t extent_size_;
+  zdb::scheduler_ref scheduler_;
+  size_t commit_threads_;
+  size_t load_threads_;
+  bool preload_series_;
+  bool fixed_layout_;
+  size_t page_split_size_;
+  uint64_t meta_sequence_;
+  size_t meta_slots_;
   PageMap page_map_;
   TransactionMap txn_map_;
+
+  /* the series that were not loaded when the database was opened, sorted by
+     series id. the table is not modified after open; a series is loaded once
+     it is in txn_map_. loads of the same series are serialized by one of the
+     lazy load mutexes. the table either points into the memory mapped
+     transaction or into lazy_series_buf_ */
+  static const size_t kLazyLoadStripes = 16;
+  const SeriesIndexRef* lazy_series_;
+  size_t lazy_series_count_;
+  std::vector<SeriesIndexRef> lazy_series_buf_;
+  std::mutex lazy_load_mutex_[kLazyLoadStripes];
+  void* txn_mmap_;
+  size_t txn_mmap_size_;
   std::mutex commit_mutex_;
+  uint64_t checkpoint_interval_ms_;
+  uint64_t checkpoint_dirty_bytes_;
+  std::thread checkpoint_thread_;
+  std::mutex checkpoint_mutex_;
+  std::condition_variable checkpoint_cv_;
+  bool checkpoint_stop_;
 };
 
 } // namespace tsdb
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#pragma once
+#include <stdlib.h>
+#include <functional>
+#include "transaction.h"
+#include "page_map.h"
+#include "page_index.h"
+#include "page_buffer.h"
+
+namespace tsdb {
+
+class Cursor {
+public:
+
+  Cursor();
+  Cursor(PageMap* page_map, Transaction&& txn, size_t page_split_size);
+  Cursor(Cursor&& o);
+  Cursor(const Cursor& o) = delete;
+  Cursor& operator=(const Cursor& o) = delete;
+  Cursor& operator=(Cursor&& o);
+
+  bool valid();
+
+  void get(uint64_t* timestamp, void* value, size_t value_len);
+  uint64_t getTime();
+  void getValue(void* value, size_t value_len);
+
+  /* seek to the first entry that is greater or equal. seeks pin the current
+     version of the series index; the cursor keeps reading that version */
+  bool seekTo(uint64_t timestamp);
+  bool seekToFirst();
+  bool seekToLast();
+
+  bool next();
+  bool next(uint64_t* timestamp, void* value, size_t value_len);
+
+  /* insert in timestamp order (new value will appear before existing values
+     with the same timestamp). writes split the page once it grows beyond the
+     split size and merge it with a neighbour once it is underfull. there
+     must only be one writable cursor per series */
+  void insert(uint64_t timestamp, const void* value, size_t value_len);
+
+  void append(uint64_t timestamp, const void* value, size_t value_len);
+
+  void update(const void* value, size_t value_len);
+
+  /* if disabled, pages read by this cursor are not added to the page cache.
+     use this for large scans that shouldn't flush the working set */
+  void setCaching(bool enable);
+
+  /* if non-zero, the cursor reads up to this many of the following pages
+     into the page cache in the background while it is positioned on a
+     page, so that a sequential scan doesn't wait for every page read.
+     cursors with caching disabled don't read ahead */
+  void setReadahead(size_t pages);
+
+protected:
+
+  bool openPage(size_t page_pos);
+  bool nextPage();
+
+  bool modifyPageAt(
+      uint64_t timestamp,
+      std::function<bool (PageBuffer* buf)> fn);
+
+  void rebalancePage();
+  bool splitPage();
+  bool mergePage();
+
+  Transaction txn_;
+  PageIndexVersionRef index_;
+  size_t page_pos_;
+  size_t page_id_;
+  PageMap* page_map_;
+  PageBufferRef page_buf_;
+  bool page_buf_valid_;
+  size_t page_buf_pos_;
+  size_t page_split_size_;
+  bool caching_;
+  size_t readahead_;
+  size_t readahead_end_;
+};
+
+} // namespace tsdb
@@ -68,5 +68,32 @@ bool readVarUInt(std::istream* is, uint64_t* value) {
   return true;
 }
 
+size_t getVarUIntSize(uint64_t value) {
+  size_t bytes = 1;
+  while (value >>= 7) {
+    ++bytes;
+  }
+
+  return bytes;
+}
+
+void writeUInt64LE(std::string* str, uint64_t value) {
+  char buf[8];
+  for (size_t i = 0; i < 8; ++i) {
+    buf[i] = (value >> (8 * i)) & 0xff;
+  }
+
+  str->append(buf, sizeof(buf));
+}
+
+uint64_t readUInt64LE(const char* data) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    value |= uint64_t((unsigned char) data[i]) << (8 * i);
+  }
+
+  return value;
+}
+
 } // namespace tsdb
 
@@ -20,6 +20,14 @@ bool readVarUInt(const char** cursor, const char* end, uint64_t* value);
 
 bool readVarUInt(std::istream* is, uint64_t* value);
 
+/* returns the number of bytes writeVarUInt uses to encode value */
+size_t getVarUIntSize(uint64_t value);
+
+/* fixed width little endian encoding */
+void writeUInt64LE(std::string* str, uint64_t value);
+
+uint64_t readUInt64LE(const char* data);
+
 
 } // namespace tsdb
 
@@ -19,7 +19,7 @@ extern "C" {
 typedef enum {
   ZDB_FETCH_AHEAD = 1,
   ZDB_FETCH_SINGLE = 2,
-  ZDB_FETCH_ALL = 2
+  ZDB_FETCH_ALL = 3
 } zdb_cursor_advise_t;
 
 typedef enum {
@@ -33,6 +33,24 @@ typedef enum {
   ZDB_STRING = 8
 } zdb_type_t;
 
+typedef enum {
+  ZDB_AGGREGATE_COUNT = 1,
+  ZDB_AGGREGATE_SUM = 2,
+  ZDB_AGGREGATE_MIN = 3,
+  ZDB_AGGREGATE_MAX = 4,
+  ZDB_AGGREGATE_AVG = 5
+} zdb_aggregate_t;
+
+typedef enum {
+  ZDB_PREDICATE_EQ = 1,
+  ZDB_PREDICATE_LT = 2,
+  ZDB_PREDICATE_LE = 3,
+  ZDB_PREDICATE_GT = 4,
+  ZDB_PREDICATE_GE = 5,
+  ZDB_PREDICATE_BETWEEN = 6,
+  ZDB_PREDICATE_IN = 7
+} zdb_predicate_op_t;
+
 typedef enum {
   ZDB_SUCCESS = 0,
   ZDB_ERR_OTHER,
@@ -207,8 +225,10 @@ int zdb_cursor_seek_primary_key_string(
  * ZDB Public C++ API
  */
 #ifdef __cplusplus
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 #include <initializer_list>
 
 namespace zdb {
@@ -218,12 +238,35 @@ class tuple;
 using tuple_ref = std::shared_ptr<tuple>;
 class cursor;
 using cursor_ref = std::shared_ptr<cursor>;
+class scheduler;
+using scheduler_ref = std::shared_ptr<scheduler>;
 
 zdb_err_t open(const std::string& filename, int oflags, database_ref* db);
 
+struct scheduler_options {
+  /* the number of worker threads, one per core if 0 */
+  size_t threads = 0;
+
+  /* pin worker i to cpu i (modulo the number of cpus) */
+  bool pin_threads = false;
+
+  /* submitting a task blocks while this many tasks are queued */
+  size_t max_queued_tasks = 4096;
+};
+
+/* create a scheduler with its own worker threads */
+zdb_err_t scheduler_init(const scheduler_options& opts, scheduler_ref* sched);
+
+/* run the parallel operations of the database on the given scheduler. by
+   default all databases share one scheduler with one thread per core */
+zdb_err_t set_scheduler(database_ref db, scheduler_ref sched);
+
 int commit(database_ref db);
 
-cursor cursor_init(database_ref db);
+zdb_err_t cursor_init(
+    database_ref db,
+    const std::string& table_name,
+    cursor_ref* cursor);
 
 zdb_err_t table_add(
     database_ref db,
@@ -305,6 +348,130 @@ int lookup_string(
     tuple_ref* tuple,
     const std::initializer_list<int> columns = {});
 
+/* add a hash index on the primary key (the first column) of a table. the
+   index makes lookups and primary key seeks take constant time and is kept
+   up to date on insert */
+zdb_err_t primary_index_add(database_ref db, const std::string& table_name);
+
+/* add a secondary index on a column of a table. the index is kept up to date
+   on insert, and scans use it instead of reading the column when a
+   predicate on the column matches few rows */
+zdb_err_t index_add(
+    database_ref db,
+    const std::string& table_name,
+    int column);
+
+/* look up a batch of keys in the primary key (the first column) of a table.
+   keys is an array of keys_count values of the type of the first column. for
+   each key k, the values of the first row with that key are copied to
+   buffers[i][k] for each columns[i] and found[k] is set to 1. if there is no
+   such row, found[k] is set to 0 and the values are zero */
+zdb_err_t lookup_batch(
+    database_ref db,
+    const std::string& table_name,
+    const void* keys,
+    size_t keys_count,
+    const int* columns,
+    void** buffers,
+    size_t columns_count,
+    uint8_t* found);
+
+/* aggregate the values of a column in the rows [row_begin, row_end). result
+   points to a uint64_t for COUNT and to a double for AVG. for SUM it points
+   to an int64_t, uint64_t or double depending on whether the column is
+   signed, unsigned (or bool) or floating point. for MIN and MAX it points to
+   a value of the column type. rows without a value are skipped */
+zdb_err_t aggregate(
+    database_ref db,
+    const std::string& table_name,
+    int column,
+    zdb_aggregate_t fn,
+    void* result,
+    uint64_t row_begin = 0,
+    uint64_t row_end = uint64_t(-1));
+
+/* like aggregate, but splits the rows into morsels that are aggregated by up
+   to threads tasks on the database scheduler (one per scheduler thread if 0)
+   and merges the partial results */
+zdb_err_t aggregate_parallel(
+    database_ref db,
+    const std::string& table_name,
+    int column,
+    zdb_aggregate_t fn,
+    void* result,
+    size_t threads = 0,
+    uint64_t row_begin = 0,
+    uint64_t row_end = uint64_t(-1));
+
+/* a condition on one column. the operands are values of the column type
+   stored back to back. BETWEEN takes two operands (inclusive bounds), IN
+   takes one or more and all other ops take exactly one */
+struct predicate {
+  int column;
+  zdb_predicate_op_t op;
+  std::string operands;
+};
+
+template <typename T>
+predicate make_predicate(
+    int column,
+    zdb_predicate_op_t op,
+    std::initializer_list<T> operands) {
+  predicate p;
+  p.column = column;
+  p.op = op;
+  for (const auto& o : operands) {
+    p.operands.append(reinterpret_cast<const char*>(&o), sizeof(T));
+  }
+
+  return p;
+}
+
+/* return the positions of the rows in [row_begin, row_end) that match all
+   predicates, in ascending order. rows without a value for a predicate column
+   don't match */
+zdb_err_t scan(
+    database_ref db,
+    const std::string& table_name,
+    const std::vector<predicate>& predicates,
+    std::vector<uint64_t>* rows,
+    uint64_t row_begin = 0,
+    uint64_t row_end = uint64_t(-1));
+
+/* like scan, but evaluates the predicates in up to threads tasks on the
+   database scheduler (one per scheduler thread if 0). the rows are returned
+   in the same order as by scan */
+zdb_err_t scan_parallel(
+    database_ref db,
+    const std::string& table_name,
+    const std::vector<predicate>& predicates,
+    std::vector<uint64_t>* rows,
+    size_t threads = 0,
+    uint64_t row_begin = 0,
+    uint64_t row_end = uint64_t(-1));
+
+/* a kernel that scan_parallel runs on one morsel, the rows [first_row,
+   first_row + rows). values[i] points at the values of columns[i] for these
+   rows or is nullptr if the column has no values for them. kernels are
+   called concurrently from up to threads tasks. worker is the index of the
+   calling task, which is less than threads, so partial results can be kept
+   per worker and merged once scan_parallel returns */
+using scan_kernel = std::function<void (
+    size_t worker,
+    uint64_t first_row,
+    size_t rows,
+    const void** values)>;
+
+zdb_err_t scan_parallel(
+    database_ref db,
+    const std::string& table_name,
+    const int* columns,
+    size_t columns_count,
+    const scan_kernel& kernel,
+    size_t threads,
+    uint64_t row_begin = 0,
+    uint64_t row_end = uint64_t(-1));
+
 } // namespace zdb
 #endif
 
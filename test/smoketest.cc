@@ -7,10 +7,19 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <unistd.h>
+#include <atomic>
 #include "../core/util/exception.h"
 #include "../core/util/time.h"
 #include "../core/zdb.h"
+#include "../core/cursor.h"
+#include "../core/aggregate.h"
+#include "../core/predicate.h"
+#include "../core/scheduler.h"
+#include "../core/hash_index.h"
+#include "../core/secondary_index.h"
 #include "unittest.h"
 
 UNIT_TEST(ZDBTest);
@@ -42,4 +51,1086 @@ TEST_CASE(ZDBTest, TestCreateAndInsert, [] () {
   }
 });
 
+TEST_CASE(ZDBTest, TestCursorNextBatch, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_time;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "time", ZDB_UINT64, &col_time));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_INT32, &col_val));
+
+  const uint64_t row_count = 10000;
+  for (uint64_t i = 0; i < row_count; ++i) {
+    int32_t val = -int32_t(i);
+    const void* tuple[2];
+    tuple[col_time] = &i;
+    tuple[col_val] = &val;
+    size_t tuple_size[2];
+    tuple_size[col_time] = sizeof(uint64_t);
+    tuple_size[col_val] = sizeof(int32_t);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 2));
+  }
+
+  {
+    zdb::cursor_ref cursor;
+    EXPECT(zdb::cursor_init(db, "nosuchtbl", &cursor) == ZDB_ERR_NOTFOUND);
+  }
+
+  /* row by row */
+  {
+    zdb::cursor_ref cursor;
+    EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+    uint64_t n = 0;
+    while (cursor->next() == ZDB_SUCCESS) {
+      EXPECT_EQ(cursor->tell(), n);
+      EXPECT_EQ(cursor->get_uint64(col_time), n);
+      EXPECT_EQ(cursor->get_int32(col_val), -int32_t(n));
+      ++n;
+    }
+
+    EXPECT_EQ(n, row_count);
+  }
+
+  /* copied batches */
+  {
+    zdb::cursor_ref cursor;
+    EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+    EXPECT_SUCCESS(cursor->seek_position(99));
+
+    std::vector<uint64_t> times(1024);
+    std::vector<int32_t> vals(1024);
+    int columns[2];
+    columns[0] = col_time;
+    columns[1] = col_val;
+    void* buffers[2];
+    buffers[0] = times.data();
+    buffers[1] = vals.data();
+
+    uint64_t n = 100;
+    for (;;) {
+      size_t rows;
+      EXPECT_SUCCESS(cursor->next_batch(columns, buffers, 2, 1024, &rows));
+      if (rows == 0) {
+        break;
+      }
+
+      for (size_t i = 0; i < rows; ++i, ++n) {
+        EXPECT_EQ(times[i], n);
+        EXPECT_EQ(vals[i], -int32_t(n));
+      }
+
+      EXPECT_EQ(cursor->tell(), n - 1);
+    }
+
+    EXPECT_EQ(n, row_count);
+  }
+
+  /* borrowed batches */
+  {
+    zdb::cursor_ref cursor;
+    EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+
+    int columns[1];
+    columns[0] = col_val;
+    const void* buffers[1];
+    uint64_t n = 0;
+    for (;;) {
+      size_t rows;
+      EXPECT_SUCCESS(
+          cursor->next_batch_borrow(columns, buffers, 1, 4096, &rows));
+      if (rows == 0) {
+        break;
+      }
+
+      auto vals = static_cast<const int32_t*>(buffers[0]);
+      for (size_t i = 0; i < rows; ++i, ++n) {
+        EXPECT_EQ(vals[i], -int32_t(n));
+      }
+    }
+
+    EXPECT_EQ(n, row_count);
+
+    int bad_columns[1];
+    bad_columns[0] = 5;
+    size_t rows;
+    EXPECT(
+        cursor->next_batch_borrow(bad_columns, buffers, 1, 1, &rows) ==
+        ZDB_ERR_INVALID_ARGUMENT);
+  }
+});
+
+TEST_CASE(ZDBTest, TestAggregateKernels, [] () {
+  std::vector<int32_t> ints;
+  std::vector<double> doubles;
+  for (int32_t i = 0; i < 1001; ++i) {
+    ints.emplace_back((i * 7919) % 2003 - 1000);
+    doubles.emplace_back(ints.back() * 0.5);
+  }
+
+  for (auto level : { zdb::SIMD_SCALAR, zdb::SIMD_SSE2, zdb::SIMD_AVX2 }) {
+    for (size_t n = 1; n < ints.size(); n += 97) {
+      int64_t isum = 0;
+      int32_t imin = ints[0];
+      int32_t imax = ints[0];
+      double dsum = 0;
+      for (size_t i = 0; i < n; ++i) {
+        isum += ints[i];
+        dsum += doubles[i];
+        imin = std::min(imin, ints[i]);
+        imax = std::max(imax, ints[i]);
+      }
+
+      const auto& ik = zdb::get_aggregate_kernels<int32_t>(level);
+      int64_t ksum = 0;
+      int32_t kmin = ints[0];
+      int32_t kmax = ints[0];
+      ik.sum(ints.data(), n, &ksum);
+      ik.min(ints.data(), n, &kmin);
+      ik.max(ints.data(), n, &kmax);
+      EXPECT_EQ(ksum, isum);
+      EXPECT_EQ(kmin, imin);
+      EXPECT_EQ(kmax, imax);
+
+      const auto& dk = zdb::get_aggregate_kernels<double>(level);
+      double kdsum = 0;
+      dk.sum(doubles.data(), n, &kdsum);
+      EXPECT_EQ(kdsum, dsum);
+    }
+  }
+
+  /* NaN values are skipped, even if they are the first values of the input */
+  std::vector<double> nans;
+  for (size_t i = 0; i < 101; ++i) {
+    nans.emplace_back(i % 5 == 0 || i < 8 ? NAN : doubles[i]);
+  }
+
+  for (auto level : { zdb::SIMD_SCALAR, zdb::SIMD_SSE2, zdb::SIMD_AVX2 }) {
+    double dmin = nans[8];
+    double dmax = nans[8];
+    for (size_t i = 8; i < nans.size(); ++i) {
+      if (!std::isnan(nans[i])) {
+        dmin = std::min(dmin, nans[i]);
+        dmax = std::max(dmax, nans[i]);
+      }
+    }
+
+    const auto& dk = zdb::get_aggregate_kernels<double>(level);
+    double kmin = nans[8];
+    double kmax = nans[8];
+    dk.min(nans.data(), nans.size(), &kmin);
+    dk.max(nans.data(), nans.size(), &kmax);
+    EXPECT_EQ(kmin, dmin);
+    EXPECT_EQ(kmax, dmax);
+  }
+});
+
+TEST_CASE(ZDBTest, TestAggregate, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_INT64, &col_val));
+  int col_flag;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "flag", ZDB_BOOL, &col_flag));
+
+  for (int64_t i = 0; i < 1000; ++i) {
+    int64_t val = i - 100;
+    bool flag = i % 3 == 0;
+    const void* tuple[2];
+    tuple[col_val] = &val;
+    tuple[col_flag] = &flag;
+    size_t tuple_size[2];
+    tuple_size[col_val] = sizeof(int64_t);
+    tuple_size[col_flag] = sizeof(bool);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 2));
+  }
+
+  uint64_t count;
+  EXPECT_SUCCESS(
+      zdb::aggregate(db, "mytbl", col_val, ZDB_AGGREGATE_COUNT, &count));
+  EXPECT_EQ(count, 1000);
+
+  int64_t sum;
+  EXPECT_SUCCESS(zdb::aggregate(db, "mytbl", col_val, ZDB_AGGREGATE_SUM, &sum));
+  EXPECT_EQ(sum, 999 * 1000 / 2 - 100 * 1000);
+
+  int64_t min;
+  EXPECT_SUCCESS(
+      zdb::aggregate(db, "mytbl", col_val, ZDB_AGGREGATE_MIN, &min, 10, 20));
+  EXPECT_EQ(min, -90);
+
+  int64_t max;
+  EXPECT_SUCCESS(
+      zdb::aggregate(db, "mytbl", col_val, ZDB_AGGREGATE_MAX, &max, 10, 20));
+  EXPECT_EQ(max, -81);
+
+  double avg;
+  EXPECT_SUCCESS(
+      zdb::aggregate(db, "mytbl", col_val, ZDB_AGGREGATE_AVG, &avg, 100, 201));
+  EXPECT_EQ(avg, 50);
+
+  uint64_t flags;
+  EXPECT_SUCCESS(
+      zdb::aggregate(db, "mytbl", col_flag, ZDB_AGGREGATE_SUM, &flags));
+  EXPECT_EQ(flags, 334);
+
+  EXPECT(
+      zdb::aggregate(db, "mytbl", col_val, ZDB_AGGREGATE_MAX, &max, 5, 5) ==
+      ZDB_ERR_NOTFOUND);
+  EXPECT(
+      zdb::aggregate(db, "mytbl", 7, ZDB_AGGREGATE_MAX, &max) ==
+      ZDB_ERR_INVALID_ARGUMENT);
+
+  /* min and max skip NaN values */
+  EXPECT_SUCCESS(zdb::table_add(db, "nantbl"));
+  int col_f;
+  EXPECT_SUCCESS(zdb::column_add(db, "nantbl", "f", ZDB_FLOAT64, &col_f));
+  for (double f : { double(NAN), double(NAN), 3.0, double(NAN), -2.0, 5.0 }) {
+    const void* tuple[1] = { &f };
+    size_t tuple_size[1] = { sizeof(double) };
+    EXPECT_SUCCESS(zdb::put_raw(db, "nantbl", tuple, tuple_size, 1));
+  }
+
+  double fmin;
+  EXPECT_SUCCESS(zdb::aggregate(db, "nantbl", col_f, ZDB_AGGREGATE_MIN, &fmin));
+  EXPECT_EQ(fmin, -2);
+
+  double fmax;
+  EXPECT_SUCCESS(zdb::aggregate(db, "nantbl", col_f, ZDB_AGGREGATE_MAX, &fmax));
+  EXPECT_EQ(fmax, 5);
+
+  EXPECT_SUCCESS(
+      zdb::aggregate(db, "nantbl", col_f, ZDB_AGGREGATE_MIN, &fmin, 0, 2));
+  EXPECT(std::isnan(fmin));
+});
+
+TEST_CASE(ZDBTest, TestCompareKernels, [] () {
+  std::vector<int64_t> values;
+  for (int64_t i = 0; i < 1001; ++i) {
+    values.emplace_back((i * 7919) % 2003 - 1000);
+  }
+
+  const auto& scalar = zdb::get_compare_kernels<int64_t>(zdb::SIMD_SCALAR);
+  for (auto level : { zdb::SIMD_SSE2, zdb::SIMD_AVX2 }) {
+    const auto& k = zdb::get_compare_kernels<int64_t>(level);
+    for (size_t n = 1; n < values.size(); n += 97) {
+      for (int64_t operand : { -1000, -3, 0, 17, 1002 }) {
+        std::vector<uint8_t> expect(n, 1);
+        std::vector<uint8_t> mask(n, 1);
+        scalar.lt(values.data(), n, operand, expect.data());
+        scalar.ge(values.data(), n, operand - 500, expect.data());
+        k.lt(values.data(), n, operand, mask.data());
+        k.ge(values.data(), n, operand - 500, mask.data());
+        EXPECT(mask == expect);
+
+        std::vector<uint8_t> expect_in(n, 0);
+        std::vector<uint8_t> mask_in(n, 0);
+        scalar.eq_or(values.data(), n, operand, expect_in.data());
+        scalar.eq_or(values.data(), n, -operand, expect_in.data());
+        k.eq_or(values.data(), n, operand, mask_in.data());
+        k.eq_or(values.data(), n, -operand, mask_in.data());
+        EXPECT(mask_in == expect_in);
+      }
+    }
+  }
+});
+
+TEST_CASE(ZDBTest, TestScan, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_INT32, &col_val));
+  int col_price;
+  EXPECT_SUCCESS(
+      zdb::column_add(db, "mytbl", "price", ZDB_FLOAT64, &col_price));
+
+  std::vector<int32_t> vals;
+  std::vector<double> prices;
+  for (int32_t i = 0; i < 1000; ++i) {
+    int32_t val = (i * 37) % 101;
+    double price = i * 0.25;
+    const void* tuple[2];
+    tuple[col_val] = &val;
+    tuple[col_price] = &price;
+    size_t tuple_size[2];
+    tuple_size[col_val] = sizeof(int32_t);
+    tuple_size[col_price] = sizeof(double);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 2));
+    vals.emplace_back(val);
+    prices.emplace_back(price);
+  }
+
+  std::vector<uint64_t> rows;
+  std::vector<uint64_t> expect;
+
+  std::vector<zdb::predicate> eq;
+  eq.emplace_back(zdb::make_predicate<int32_t>(col_val, ZDB_PREDICATE_EQ, {7}));
+  EXPECT_SUCCESS(zdb::scan(db, "mytbl", eq, &rows));
+  for (size_t i = 0; i < vals.size(); ++i) {
+    if (vals[i] == 7) {
+      expect.emplace_back(i);
+    }
+  }
+
+  EXPECT(rows == expect);
+
+  /* multiple predicates are combined with AND */
+  std::vector<zdb::predicate> range;
+  range.emplace_back(
+      zdb::make_predicate<int32_t>(col_val, ZDB_PREDICATE_BETWEEN, {10, 20}));
+  range.emplace_back(
+      zdb::make_predicate<double>(col_price, ZDB_PREDICATE_LT, {100.0}));
+  EXPECT_SUCCESS(zdb::scan(db, "mytbl", range, &rows, 50, 900));
+  expect.clear();
+  for (size_t i = 50; i < 900; ++i) {
+    if (vals[i] >= 10 && vals[i] <= 20 && prices[i] < 100) {
+      expect.emplace_back(i);
+    }
+  }
+
+  EXPECT(rows == expect);
+  EXPECT(!rows.empty());
+
+  std::vector<zdb::predicate> in;
+  in.emplace_back(
+      zdb::make_predicate<int32_t>(col_val, ZDB_PREDICATE_IN, {3, 99, 5000}));
+  EXPECT_SUCCESS(zdb::scan(db, "mytbl", in, &rows));
+  expect.clear();
+  for (size_t i = 0; i < vals.size(); ++i) {
+    if (vals[i] == 3 || vals[i] == 99) {
+      expect.emplace_back(i);
+    }
+  }
+
+  EXPECT(rows == expect);
+
+  /* read the matching rows back */
+  zdb::cursor_ref cursor;
+  EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+  std::vector<int32_t> out_vals(rows.size());
+  std::vector<double> out_prices(rows.size());
+  int columns[2];
+  columns[0] = col_val;
+  columns[1] = col_price;
+  void* buffers[2];
+  buffers[0] = out_vals.data();
+  buffers[1] = out_prices.data();
+  EXPECT_SUCCESS(
+      cursor->read_rows(rows.data(), rows.size(), columns, buffers, 2));
+  for (size_t i = 0; i < rows.size(); ++i) {
+    EXPECT_EQ(out_vals[i], vals[rows[i]]);
+    EXPECT_EQ(out_prices[i], prices[rows[i]]);
+  }
+
+  uint64_t bad_row = 1000;
+  EXPECT(
+      cursor->read_rows(&bad_row, 1, columns, buffers, 2) ==
+      ZDB_ERR_NOTFOUND);
+  cursor.reset();
+
+  /* values outside of the zone map of the page don't match */
+  std::vector<zdb::predicate> none;
+  none.emplace_back(
+      zdb::make_predicate<int32_t>(col_val, ZDB_PREDICATE_GT, {100}));
+  EXPECT_SUCCESS(zdb::scan(db, "mytbl", none, &rows));
+  EXPECT(rows.empty());
+
+  std::vector<zdb::predicate> bad;
+  bad.emplace_back(
+      zdb::make_predicate<int64_t>(col_val, ZDB_PREDICATE_EQ, {7}));
+  EXPECT(zdb::scan(db, "mytbl", bad, &rows) == ZDB_ERR_INVALID_ARGUMENT);
+});
+
+TEST_CASE(ZDBTest, TestZoneMaps, [] () {
+  /* the zone map has one entry per chunk of kZoneRows rows */
+  std::unique_ptr<zdb::page_buf> page(zdb::page_malloc(ZDB_INT64));
+  for (int64_t i = 0; i < int64_t(zdb::kZoneRows * 3 + 10); ++i) {
+    page->append(&i, sizeof(i));
+  }
+
+  int64_t min;
+  int64_t max;
+  EXPECT(page->get_minmax(0, 1, &min, &max));
+  EXPECT_EQ(min, 0);
+  EXPECT_EQ(max, zdb::kZoneRows - 1);
+  EXPECT(page->get_minmax(zdb::kZoneRows + 5, zdb::kZoneRows + 6, &min, &max));
+  EXPECT_EQ(min, zdb::kZoneRows);
+  EXPECT_EQ(max, zdb::kZoneRows * 2 - 1);
+  EXPECT(page->get_minmax(100, zdb::kZoneRows * 2 + 1, &min, &max));
+  EXPECT_EQ(min, 0);
+  EXPECT_EQ(max, zdb::kZoneRows * 3 - 1);
+  EXPECT(page->get_minmax(zdb::kZoneRows * 3, page->size(), &min, &max));
+  EXPECT_EQ(min, zdb::kZoneRows * 3);
+  EXPECT_EQ(max, zdb::kZoneRows * 3 + 9);
+
+  /* chunks of only NaNs have no zone map */
+  std::unique_ptr<zdb::page_buf> fpage(zdb::page_malloc(ZDB_FLOAT64));
+  for (size_t i = 0; i < zdb::kZoneRows * 2; ++i) {
+    double f = i < zdb::kZoneRows ? NAN : double(i);
+    fpage->append(&f, sizeof(f));
+  }
+
+  double fmin;
+  double fmax;
+  EXPECT(!fpage->get_minmax(0, zdb::kZoneRows, &fmin, &fmax));
+  EXPECT(fpage->get_minmax(0, zdb::kZoneRows + 1, &fmin, &fmax));
+  EXPECT_EQ(fmin, zdb::kZoneRows);
+
+  /* scans and filtered cursors over sorted values skip the chunks that the
+     zone maps rule out and still return every matching row */
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_INT64, &col_val));
+  for (int64_t i = 0; i < 20000; ++i) {
+    const void* tuple[1] = { &i };
+    size_t tuple_size[1] = { sizeof(int64_t) };
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 1));
+  }
+
+  std::vector<zdb::predicate> range;
+  range.emplace_back(
+      zdb::make_predicate<int64_t>(
+          col_val,
+          ZDB_PREDICATE_BETWEEN,
+          {9000, 13000}));
+  std::vector<uint64_t> rows;
+  EXPECT_SUCCESS(zdb::scan(db, "mytbl", range, &rows, 100));
+  EXPECT_EQ(rows.size(), 4001);
+  EXPECT_EQ(rows.front(), 9000);
+  EXPECT_EQ(rows.back(), 13000);
+
+  zdb::cursor_ref cursor;
+  EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+  EXPECT_SUCCESS(cursor->filter(range[0]));
+  int64_t expect = 9000;
+  while (cursor->next() == ZDB_SUCCESS) {
+    EXPECT_EQ(cursor->get_int64(col_val), expect);
+    ++expect;
+  }
+
+  EXPECT_EQ(expect, 13001);
+});
+
+TEST_CASE(ZDBTest, TestCursorProjection, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_a;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "a", ZDB_INT64, &col_a));
+  int col_b;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "b", ZDB_INT64, &col_b));
+  int col_c;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "c", ZDB_UINT32, &col_c));
+
+  for (int64_t i = 0; i < 10000; ++i) {
+    int64_t a = i;
+    int64_t b = -i;
+    uint32_t c = i % 7;
+    const void* tuple[3];
+    tuple[col_a] = &a;
+    tuple[col_b] = &b;
+    tuple[col_c] = &c;
+    size_t tuple_size[3];
+    tuple_size[col_a] = sizeof(int64_t);
+    tuple_size[col_b] = sizeof(int64_t);
+    tuple_size[col_c] = sizeof(uint32_t);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 3));
+  }
+
+  zdb::cursor_ref cursor;
+  EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+  EXPECT_SUCCESS(cursor->use("a"));
+  EXPECT(cursor->use("x") == ZDB_ERR_NOTFOUND);
+
+  /* the filter column doesn't need to be used */
+  EXPECT_SUCCESS(cursor->filter(
+      zdb::make_predicate<uint32_t>(col_c, ZDB_PREDICATE_EQ, {3})));
+  EXPECT(
+      cursor->filter(
+          zdb::make_predicate<uint32_t>(9, ZDB_PREDICATE_EQ, {3})) ==
+      ZDB_ERR_INVALID_ARGUMENT);
+
+  std::vector<int64_t> a(1000);
+  void* buffers[1];
+  buffers[0] = a.data();
+  size_t rows;
+
+  int unused_column = col_b;
+  EXPECT(
+      cursor->next_batch(&unused_column, buffers, 1, 1000, &rows) ==
+      ZDB_ERR_INVALID_ARGUMENT);
+
+  const void* borrowed[1];
+  EXPECT(
+      cursor->next_batch_borrow(&col_a, borrowed, 1, 1000, &rows) ==
+      ZDB_ERR_INVALID_ARGUMENT);
+
+  /* the batches only contain matching rows and span filter chunks */
+  int64_t expect = 3;
+  for (;;) {
+    EXPECT_SUCCESS(cursor->next_batch(&col_a, buffers, 1, 1000, &rows));
+    if (rows == 0) {
+      break;
+    }
+
+    for (size_t i = 0; i < rows; ++i) {
+      EXPECT_EQ(a[i], expect);
+      expect += 7;
+    }
+  }
+
+  EXPECT_EQ(expect, 9999 + 7);
+
+  /* next skips to the next matching row */
+  EXPECT_SUCCESS(cursor->seek_position(5000));
+  EXPECT_SUCCESS(cursor->next());
+  EXPECT_EQ(cursor->get_int64(col_a), 5001);
+  EXPECT_EQ(cursor->tell(), 5001);
+  EXPECT_SUCCESS(cursor->next());
+  EXPECT_EQ(cursor->get_int64(col_a), 5008);
+});
+
+TEST_CASE(ZDBTest, TestScanParallel, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_INT64, &col_val));
+  int col_price;
+  EXPECT_SUCCESS(
+      zdb::column_add(db, "mytbl", "price", ZDB_FLOAT64, &col_price));
+
+  /* enough rows for several morsels */
+  for (int64_t i = 0; i < 300000; ++i) {
+    int64_t val = (i * 7919) % 10007;
+    double price = i % 1000;
+    const void* tuple[2];
+    tuple[col_val] = &val;
+    tuple[col_price] = &price;
+    size_t tuple_size[2];
+    tuple_size[col_val] = sizeof(int64_t);
+    tuple_size[col_price] = sizeof(double);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 2));
+  }
+
+  std::vector<zdb::predicate> preds;
+  preds.emplace_back(
+      zdb::make_predicate<int64_t>(col_val, ZDB_PREDICATE_LT, {100}));
+  std::vector<uint64_t> rows;
+  EXPECT_SUCCESS(zdb::scan(db, "mytbl", preds, &rows, 10, 290000));
+  for (size_t threads : { 1, 3, 8 }) {
+    std::vector<uint64_t> parallel_rows;
+    EXPECT_SUCCESS(zdb::scan_parallel(
+        db, "mytbl", preds, &parallel_rows, threads, 10, 290000));
+    EXPECT(parallel_rows == rows);
+  }
+
+  for (auto fn : { ZDB_AGGREGATE_SUM, ZDB_AGGREGATE_MIN, ZDB_AGGREGATE_MAX }) {
+    int64_t expect;
+    int64_t result;
+    EXPECT_SUCCESS(zdb::aggregate(db, "mytbl", col_val, fn, &expect, 5));
+    EXPECT_SUCCESS(
+        zdb::aggregate_parallel(db, "mytbl", col_val, fn, &result, 4, 5));
+    EXPECT_EQ(result, expect);
+  }
+
+  /* a user kernel that keeps one partial sum per worker */
+  const size_t kThreads = 4;
+  std::vector<double> sums(kThreads);
+  std::vector<uint64_t> counts(kThreads);
+  EXPECT_SUCCESS(zdb::scan_parallel(
+      db,
+      "mytbl",
+      &col_price,
+      1,
+      [&sums, &counts] (
+          size_t worker,
+          uint64_t /* first_row */,
+          size_t rows,
+          const void** values) {
+        auto prices = static_cast<const double*>(values[0]);
+        for (size_t i = 0; i < rows; ++i) {
+          sums[worker] += prices[i];
+        }
+
+        counts[worker] += rows;
+      },
+      kThreads));
+
+  double sum = 0;
+  uint64_t count = 0;
+  for (size_t i = 0; i < kThreads; ++i) {
+    sum += sums[i];
+    count += counts[i];
+  }
+
+  EXPECT_EQ(count, 300000);
+  EXPECT_EQ(sum, 300.0 * 999 * 1000 / 2);
+});
+
+TEST_CASE(ZDBTest, TestScheduler, [] () {
+  zdb::scheduler_options opts;
+  opts.threads = 2;
+  opts.max_queued_tasks = 8;
+  zdb::scheduler_ref sched;
+  EXPECT_SUCCESS(zdb::scheduler_init(opts, &sched));
+  EXPECT_EQ(sched->size(), 2);
+
+  /* more tasks than fit into the queue, each of which submits and waits for
+     subtasks from inside the scheduler */
+  std::atomic<size_t> done(0);
+  std::atomic<size_t> subtasks(0);
+  for (size_t i = 0; i < 100; ++i) {
+    sched->submit([&sched, &done, &subtasks] () {
+      std::atomic<size_t> pending(10);
+      for (size_t j = 0; j < 10; ++j) {
+        sched->submit([&pending, &subtasks] () {
+          subtasks.fetch_add(1);
+          pending.fetch_sub(1);
+        });
+      }
+
+      sched->run_until([&pending] () { return pending.load() == 0; });
+      done.fetch_add(1);
+    });
+  }
+
+  sched->run_until([&done] () { return done.load() == 100; });
+  EXPECT_EQ(subtasks.load(), 1000);
+
+  /* parallel scans that are started from scheduler tasks */
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::set_scheduler(db, sched));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_UINT64, &col_val));
+  for (uint64_t i = 0; i < 200000; ++i) {
+    const void* tuple[1];
+    tuple[0] = &i;
+    size_t tuple_size[1];
+    tuple_size[0] = sizeof(uint64_t);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 1));
+  }
+
+  std::atomic<size_t> scans(0);
+  std::vector<uint64_t> sums(4);
+  for (size_t i = 0; i < sums.size(); ++i) {
+    sched->submit([&db, &scans, &sums, i] () {
+      zdb::aggregate_parallel(
+          db,
+          "mytbl",
+          0,
+          ZDB_AGGREGATE_SUM,
+          &sums[i],
+          4);
+      scans.fetch_add(1);
+    });
+  }
+
+  sched->run_until([&scans] () { return scans.load() == 4; });
+  for (auto sum : sums) {
+    EXPECT_EQ(sum, uint64_t(199999) * 200000 / 2);
+  }
+});
+
+TEST_CASE(ZDBTest, TestLookupBatch, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_key;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "key", ZDB_UINT64, &col_key));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_INT32, &col_val));
+  int col_price;
+  EXPECT_SUCCESS(
+      zdb::column_add(db, "mytbl", "price", ZDB_FLOAT64, &col_price));
+
+  for (uint64_t i = 0; i < 100000; ++i) {
+    uint64_t key = i * 3;
+    int32_t val = -int32_t(i);
+    double price = i * 0.5;
+    const void* tuple[3];
+    tuple[col_key] = &key;
+    tuple[col_val] = &val;
+    tuple[col_price] = &price;
+    size_t tuple_size[3];
+    tuple_size[col_key] = sizeof(uint64_t);
+    tuple_size[col_val] = sizeof(int32_t);
+    tuple_size[col_price] = sizeof(double);
+    EXPECT_SUCCESS(zdb::put_raw(db, "mytbl", tuple, tuple_size, 3));
+  }
+
+  /* a duplicate key is found twice, a key that isn't a multiple of three is
+     not found at all */
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    keys.emplace_back((i * 7919) % 100000 * 3);
+  }
+
+  keys.emplace_back(keys[17]);
+  keys.emplace_back(301);
+
+  std::vector<int32_t> vals(keys.size());
+  std::vector<double> prices(keys.size());
+  std::vector<uint8_t> found(keys.size());
+  int columns[2];
+  columns[0] = col_val;
+  columns[1] = col_price;
+  void* buffers[2];
+  buffers[0] = vals.data();
+  buffers[1] = prices.data();
+  EXPECT_SUCCESS(zdb::lookup_batch(
+      db,
+      "mytbl",
+      keys.data(),
+      keys.size(),
+      columns,
+      buffers,
+      2,
+      found.data()));
+
+  for (size_t k = 0; k < keys.size(); ++k) {
+    if (keys[k] % 3 == 0) {
+      EXPECT_EQ(found[k], 1);
+      EXPECT_EQ(vals[k], -int32_t(keys[k] / 3));
+      EXPECT_EQ(prices[k], keys[k] / 3 * 0.5);
+    } else {
+      EXPECT_EQ(found[k], 0);
+      EXPECT_EQ(vals[k], 0);
+    }
+  }
+
+  int bad_column = 7;
+  EXPECT(
+      zdb::lookup_batch(
+          db,
+          "mytbl",
+          keys.data(),
+          keys.size(),
+          &bad_column,
+          buffers,
+          1,
+          found.data()) == ZDB_ERR_INVALID_ARGUMENT);
+});
+
+TEST_CASE(ZDBTest, TestHashIndex, [] () {
+  zdb::hash_index index;
+  for (uint64_t i = 0; i < 100000; ++i) {
+    EXPECT(index.insert(i * 0x9e3779b97f4a7c15ULL, i));
+
+    /* keys stay visible while the index grows */
+    uint64_t row;
+    EXPECT(index.find((i / 2) * 0x9e3779b97f4a7c15ULL, &row));
+    EXPECT_EQ(row, i / 2);
+  }
+
+  EXPECT_EQ(index.size(), 100000);
+  EXPECT(!index.insert(0, 7));
+
+  for (uint64_t i = 0; i < 100000; ++i) {
+    uint64_t row;
+    EXPECT(index.find(i * 0x9e3779b97f4a7c15ULL, &row));
+    EXPECT_EQ(row, i);
+  }
+
+  uint64_t row;
+  EXPECT(!index.find(1, &row));
+});
+
+TEST_CASE(ZDBTest, TestPrimaryIndex, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_key;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "key", ZDB_INT64, &col_key));
+  int col_val;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "val", ZDB_UINT32, &col_val));
+
+  auto insert = [&] (int64_t key, uint32_t val) {
+    const void* tuple[2];
+    tuple[col_key] = &key;
+    tuple[col_val] = &val;
+    size_t tuple_size[2];
+    tuple_size[col_key] = sizeof(int64_t);
+    tuple_size[col_val] = sizeof(uint32_t);
+    return zdb::put_raw(db, "mytbl", tuple, tuple_size, 2);
+  };
+
+  /* the first half of the rows is indexed when the index is added, the
+     second half on insert */
+  for (uint32_t i = 0; i < 50000; ++i) {
+    EXPECT_SUCCESS(insert(int64_t(i) * 7919 % 100003 - 50000, i));
+  }
+
+  EXPECT_SUCCESS(zdb::primary_index_add(db, "mytbl"));
+  EXPECT(zdb::primary_index_add(db, "mytbl") == ZDB_ERR_EXISTS);
+
+  for (uint32_t i = 50000; i < 100000; ++i) {
+    EXPECT_SUCCESS(insert(int64_t(i) * 7919 % 100003 - 50000, i));
+  }
+
+  /* a duplicate key still finds the first row */
+  EXPECT_SUCCESS(insert(-50000, 123456));
+
+  {
+    zdb::cursor_ref cursor;
+    EXPECT_SUCCESS(zdb::cursor_init(db, "mytbl", &cursor));
+    for (uint32_t i = 0; i < 100000; i += 37) {
+      EXPECT_SUCCESS(
+          cursor->seek_primary_key_int64(int64_t(i) * 7919 % 100003 - 50000));
+      EXPECT_EQ(cursor->get_uint32(col_val), i);
+      EXPECT_EQ(cursor->tell(), i);
+    }
+
+    EXPECT_SUCCESS(cursor->seek_primary_key_int64(-50000));
+    EXPECT_EQ(cursor->get_uint32(col_val), 0);
+    EXPECT(cursor->seek_primary_key_int64(100000) == ZDB_ERR_NOTFOUND);
+    EXPECT(cursor->seek_primary_key_uint32(1) == ZDB_ERR_INVALID_ARGUMENT);
+  }
+
+  std::vector<int64_t> keys;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    keys.emplace_back(int64_t(i) * 104729 % 100003 * 7919 % 100003 - 50000);
+  }
+
+  keys.emplace_back(100000);
+
+  std::vector<uint32_t> vals(keys.size());
+  std::vector<uint8_t> found(keys.size());
+  void* buffers[1];
+  buffers[0] = vals.data();
+  EXPECT_SUCCESS(zdb::lookup_batch(
+      db,
+      "mytbl",
+      keys.data(),
+      keys.size(),
+      &col_val,
+      buffers,
+      1,
+      found.data()));
+
+  for (size_t k = 0; k + 1 < keys.size(); ++k) {
+    EXPECT_EQ(found[k], 1);
+    EXPECT_EQ(vals[k], uint32_t(k) * 104729 % 100003);
+  }
+
+  EXPECT_EQ(found.back(), 0);
+
+  /* rows are found by the position of their values in the pages, also after
+     a tuple without a key, and NaN keys are never found. the index agrees
+     with a search of the key column whether it is added before or after the
+     rows are inserted */
+  for (auto table : { "plain", "early", "late" }) {
+    EXPECT_SUCCESS(zdb::table_add(db, table));
+    int col_fkey;
+    EXPECT_SUCCESS(zdb::column_add(db, table, "key", ZDB_FLOAT64, &col_fkey));
+    int col_fval;
+    EXPECT_SUCCESS(zdb::column_add(db, table, "val", ZDB_UINT32, &col_fval));
+    if (std::string(table) == "early") {
+      EXPECT_SUCCESS(zdb::primary_index_add(db, table));
+    }
+
+    auto finsert = [&] (double key, uint32_t val) {
+      const void* tuple[2];
+      tuple[col_fkey] = &key;
+      tuple[col_fval] = &val;
+      size_t tuple_size[2];
+      tuple_size[col_fkey] = sizeof(double);
+      tuple_size[col_fval] = sizeof(uint32_t);
+      return zdb::put_raw(db, table, tuple, tuple_size, 2);
+    };
+
+    EXPECT_SUCCESS(finsert(1.0, 10));
+    EXPECT_SUCCESS(zdb::put_raw(db, table, nullptr, nullptr, 0));
+    EXPECT_SUCCESS(finsert(2.0, 20));
+    EXPECT_SUCCESS(finsert(NAN, 30));
+    EXPECT_SUCCESS(finsert(3.0, 40));
+    if (std::string(table) == "late") {
+      EXPECT_SUCCESS(zdb::primary_index_add(db, table));
+    }
+
+    std::vector<double> fkeys;
+    for (double k : { 1.0, 2.0, double(NAN), 3.0 }) {
+      fkeys.emplace_back(k);
+    }
+
+    std::vector<uint32_t> fvals(fkeys.size());
+    std::vector<uint8_t> ffound(fkeys.size());
+    void* fbuffers[1];
+    fbuffers[0] = fvals.data();
+    EXPECT_SUCCESS(zdb::lookup_batch(
+        db,
+        table,
+        fkeys.data(),
+        fkeys.size(),
+        &col_fval,
+        fbuffers,
+        1,
+        ffound.data()));
+
+    EXPECT_EQ(ffound[0], 1);
+    EXPECT_EQ(fvals[0], 10);
+    EXPECT_EQ(ffound[1], 1);
+    EXPECT_EQ(fvals[1], 20);
+    EXPECT_EQ(ffound[2], 0);
+    EXPECT_EQ(ffound[3], 1);
+    EXPECT_EQ(fvals[3], 40);
+
+    zdb::cursor_ref cursor;
+    EXPECT_SUCCESS(zdb::cursor_init(db, table, &cursor));
+    EXPECT_SUCCESS(cursor->seek_primary_key_float64(2.0));
+    EXPECT_EQ(cursor->get_uint32(col_fval), 20);
+    EXPECT(cursor->seek_primary_key_float64(NAN) == ZDB_ERR_NOTFOUND);
+  }
+});
+
+TEST_CASE(ZDBTest, TestSecondaryIndex, [] () {
+  auto index = zdb::make_secondary_index(ZDB_FLOAT64);
+  for (uint64_t i = 0; i < 10000; ++i) {
+    double value = i % 3 == 0 ? NAN : double(i % 100);
+    index->insert(&value, i);
+  }
 
+  auto between =
+      zdb::make_predicate<double>(0, ZDB_PREDICATE_BETWEEN, {10, 12});
+  std::vector<uint64_t> rows;
+  index->find(between, &rows);
+  EXPECT_EQ(index->count(between), rows.size());
+
+  std::vector<uint64_t> expect;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    if (i % 3 != 0 && i % 100 >= 10 && i % 100 <= 12) {
+      expect.emplace_back(i);
+    }
+  }
+
+  EXPECT(rows == expect);
+});
+
+TEST_CASE(ZDBTest, TestIndexScan, [] () {
+  zdb::database_ref db;
+  EXPECT_SUCCESS(zdb::open("/tmp/__test.zdb", ZDB_OPEN_DEFAULT, &db));
+  EXPECT_SUCCESS(zdb::table_add(db, "mytbl"));
+  int col_time;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "time", ZDB_UINT64, &col_time));
+  int col_user;
+  EXPECT_SUCCESS(zdb::column_add(db, "mytbl", "user", ZDB_UINT32, &col_user));
+
+  std::vector<uint32_t> users;
+  auto insert = [&] (uint64_t i) {
+    uint32_t user = (i * 7919) % 5000;
+    const void* tuple[2];
+    tuple[col_time] = &i;
+    tuple[col_user] = &user;
+    size_t tuple_size[2];
+    tuple_size[col_time] = sizeof(uint64_t);
+    tuple_size[col_user] = sizeof(uint32_t);
+    users.emplace_back(user);
+    return zdb::put_raw(db, "mytbl", tuple, tuple_size, 2);
+  };
+
+  /* half of the rows are indexed when the index is added, the rest on
+     insert */
+  for (uint64_t i = 0; i < 50000; ++i) {
+    EXPECT_SUCCESS(insert(i));
+  }
+
+  EXPECT_SUCCESS(zdb::index_add(db, "mytbl", col_user));
+  EXPECT(zdb::index_add(db, "mytbl", col_user) == ZDB_ERR_EXISTS);
+  EXPECT(zdb::index_add(db, "mytbl", 9) == ZDB_ERR_INVALID_ARGUMENT);
+
+  for (uint64_t i = 50000; i < 100000; ++i) {
+    EXPECT_SUCCESS(insert(i));
+  }
+
+  std::vector<std::vector<zdb::predicate>> queries(4);
+  queries[0].emplace_back(
+      zdb::make_predicate<uint32_t>(col_user, ZDB_PREDICATE_EQ, {42}));
+  queries[1].emplace_back(
+      zdb::make_predicate<uint32_t>(col_user, ZDB_PREDICATE_IN, {7, 4999, 7}));
+  queries[1].emplace_back(
+      zdb::make_predicate<uint64_t>(col_time, ZDB_PREDICATE_GE, {20000}));
+  queries[2].emplace_back(
+      zdb::make_predicate<uint32_t>(col_user, ZDB_PREDICATE_BETWEEN, {10, 20}));
+
+  /* not selective, scanned */
+  queries[3].emplace_back(
+      zdb::make_predicate<uint32_t>(col_user, ZDB_PREDICATE_GT, {100}));
+
+  for (const auto& query : queries) {
+    std::vector<uint64_t> rows;
+    EXPECT_SUCCESS(zdb::scan(db, "mytbl", query, &rows, 1000, 90000));
+
+    std::vector<uint64_t> expect;
+    for (uint64_t i = 1000; i < 90000; ++i) {
+      bool match = true;
+      for (const auto& pred : query) {
+        uint32_t operands[3];
+        memcpy(operands, pred.operands.data(), pred.operands.size());
+        if (pred.column == col_time) {
+          match &= i >= 20000;
+        } else if (pred.op == ZDB_PREDICATE_EQ) {
+          match &= users[i] == operands[0];
+        } else if (pred.op == ZDB_PREDICATE_IN) {
+          match &= users[i] == operands[0] || users[i] == operands[1];
+        } else if (pred.op == ZDB_PREDICATE_BETWEEN) {
+          match &= users[i] >= operands[0] && users[i] <= operands[1];
+        } else {
+          match &= users[i] > operands[0];
+        }
+      }
+
+      if (match) {
+        expect.emplace_back(i);
+      }
+    }
+
+    EXPECT(!expect.empty());
+    EXPECT(rows == expect);
+  }
+
+  /* a tuple without the indexed column leaves the column behind the row
+     count. the index finds rows by the position of their values in the page,
+     like a scan of the column does */
+  for (auto table : { "plain", "indexed" }) {
+    EXPECT_SUCCESS(zdb::table_add(db, table));
+    EXPECT_SUCCESS(zdb::column_add(db, table, "time", ZDB_UINT64, &col_time));
+    EXPECT_SUCCESS(zdb::column_add(db, table, "user", ZDB_UINT32, &col_user));
+    if (std::string(table) == "indexed") {
+      EXPECT_SUCCESS(zdb::index_add(db, table, col_user));
+    }
+
+    auto sinsert = [&] (uint64_t time, uint32_t user, size_t tuple_count) {
+      const void* tuple[2];
+      tuple[col_time] = &time;
+      tuple[col_user] = &user;
+      size_t tuple_size[2];
+      tuple_size[col_time] = sizeof(uint64_t);
+      tuple_size[col_user] = sizeof(uint32_t);
+      return zdb::put_raw(db, table, tuple, tuple_size, tuple_count);
+    };
+
+    for (uint64_t i = 0; i < 100; ++i) {
+      EXPECT_SUCCESS(sinsert(i, 1000 + i, 2));
+    }
+
+    EXPECT_SUCCESS(sinsert(100, 5, 2));
+    EXPECT_SUCCESS(sinsert(101, 0, 1));
+    EXPECT_SUCCESS(sinsert(102, 5, 2));
+    EXPECT_SUCCESS(sinsert(103, 6, 2));
+
+    std::vector<zdb::predicate> eq;
+    eq.emplace_back(
+        zdb::make_predicate<uint32_t>(col_user, ZDB_PREDICATE_EQ, {5}));
+    std::vector<uint64_t> rows;
+    EXPECT_SUCCESS(zdb::scan(db, table, eq, &rows));
+    EXPECT_EQ(rows.size(), 2);
+    EXPECT_EQ(rows[0], 100);
+    EXPECT_EQ(rows[1], 101);
+  }
+});
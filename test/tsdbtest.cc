@@ -0,0 +1,1382 @@
+/**
+ * Copyright (c) 2016, Paul Asmuth <paul@asmuth.com>
+ * All rights reserved.
+ * 
+ * This file is part of the "libzdb" project. libzdb is free software licensed
+ * under the 3-Clause BSD License (BSD-3-Clause).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+#include "../core/tsdb.h"
+#include "../core/varint.h"
+#include "unittest.h"
+
+using namespace tsdb;
+
+UNIT_TEST(TSDBTest);
+
+static uint64_t count_series(TSDB* db, uint64_t series_id) {
+  Cursor cursor;
+  if (!db->getCursor(series_id, &cursor)) {
+    return uint64_t(-1);
+  }
+
+  uint64_t n = 0;
+  for (; cursor.valid(); cursor.next()) {
+    ++n;
+  }
+
+  return n;
+}
+
+using SeriesValue = std::pair<uint64_t, uint64_t>;
+using SeriesValues = std::multimap<uint64_t, uint64_t>;
+
+static void verify_series(
+    TSDB* db,
+    uint64_t series_id,
+    const SeriesValues& expected) {
+  Cursor cursor;
+  EXPECT(db->getCursor(series_id, &cursor));
+  std::multiset<SeriesValue> values;
+  uint64_t last_time = 0;
+  for (; cursor.valid(); cursor.next()) {
+    uint64_t time;
+    uint64_t value;
+    cursor.get(&time, &value, sizeof(value));
+    EXPECT(time >= last_time);
+    last_time = time;
+    values.emplace(time, value);
+  }
+
+  std::multiset<SeriesValue> expected_values(expected.begin(), expected.end());
+  EXPECT(values == expected_values);
+
+  std::mt19937 rng(7);
+  for (size_t i = 0; i < 300; ++i) {
+    uint64_t time = rng() % (expected.rbegin()->first + 2);
+    Cursor seek;
+    EXPECT(db->getCursor(series_id, &seek, true, TSDB::SEEK_NONE));
+    bool found = seek.seekTo(time) && seek.valid();
+    auto iter = expected.lower_bound(time);
+    EXPECT_EQ(found, iter != expected.end());
+    if (found) {
+      EXPECT_EQ(seek.getTime(), iter->first);
+    }
+  }
+}
+
+TEST_CASE(TSDBTest, TestCommitAndReopen, [] () {
+  const char* filename = "/tmp/__test_commit.tsdb";
+  const uint64_t num_series = 50;
+  const uint64_t num_values = 3000;
+  unlink(filename);
+
+  {
+    std::unique_ptr<TSDB> db;
+    TSDBOptions opts;
+    opts.extent_size = 1024 * 1024;
+    opts.commit_threads = 8;
+    EXPECT(TSDB::createDatabase(&db, filename, opts));
+    for (uint64_t s = 1; s <= num_series; ++s) {
+      EXPECT(db->createSeries(s, sizeof(uint64_t), "meta" + std::to_string(s)));
+    }
+
+    for (uint64_t round = 0; round < 3; ++round) {
+      for (uint64_t s = 1; s <= num_series; ++s) {
+        Cursor cursor;
+        EXPECT(db->getCursor(s, &cursor, false));
+        for (uint64_t i = 0; i < num_values; ++i) {
+          uint64_t value = s * 1000000 + round * num_values + i;
+          cursor.append(round * num_values + i + 1, &value, sizeof(value));
+        }
+      }
+
+      EXPECT(db->commit());
+    }
+
+    Cursor cursor;
+    EXPECT(db->getCursor(7, &cursor, false));
+    EXPECT(cursor.seekTo(100));
+    uint64_t value = 42;
+    cursor.insert(100, &value, sizeof(value));
+    EXPECT(db->commit());
+  }
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename));
+  std::set<uint64_t> series_ids;
+  EXPECT(db->listSeries(&series_ids));
+  EXPECT_EQ(series_ids.size(), num_series);
+
+  for (uint64_t s = 1; s <= num_series; ++s) {
+    std::string metadata;
+    EXPECT(db->getSeriesMetadata(s, &metadata));
+    EXPECT_EQ(metadata, "meta" + std::to_string(s));
+
+    Cursor cursor;
+    EXPECT(db->getCursor(s, &cursor));
+    uint64_t n = 0;
+    uint64_t last_time = 0;
+    bool inserted = false;
+    for (; cursor.valid(); cursor.next()) {
+      uint64_t time;
+      uint64_t value;
+      cursor.get(&time, &value, sizeof(value));
+      EXPECT(time >= last_time);
+      last_time = time;
+      if (s == 7 && time == 100 && value == 42) {
+        inserted = true;
+      } else {
+        EXPECT_EQ(value, s * 1000000 + time - 1);
+      }
+      ++n;
+    }
+
+    EXPECT_EQ(n, num_values * 3 + (s == 7 ? 1 : 0));
+    EXPECT_EQ(inserted, s == 7);
+  }
+
+  EXPECT_EQ(count_series(db.get(), 1), num_values * 3);
+});
+
+TEST_CASE(TSDBTest, TestPageSplitAndMerge, [] () {
+  const char* filename = "/tmp/__test_split.tsdb";
+  unlink(filename);
+
+  TSDBOptions opts;
+  opts.page_split_size = 512;
+  opts.extent_size = 1024 * 1024;
+
+  SeriesValues expected;
+  std::mt19937 rng(1);
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename, opts));
+    EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+
+    /* the reader pins the empty first version of the series index */
+    Cursor reader;
+    EXPECT(db->getCursor(1, &reader));
+
+    Cursor writer;
+    EXPECT(db->getCursor(1, &writer, false));
+    for (uint64_t i = 0; i < 20000; ++i) {
+      uint64_t value = rng();
+      uint64_t time = i;
+      if (i > 100 && rng() % 5 == 0) {
+        time = rng() % i;
+        writer.insert(time, &value, sizeof(value));
+      } else {
+        writer.append(time, &value, sizeof(value));
+      }
+
+      expected.emplace(time, value);
+      if (i % 5000 == 0) {
+        EXPECT(db->commit());
+      }
+    }
+
+    for (; reader.valid(); reader.next());
+    verify_series(db.get(), 1, expected);
+    EXPECT(db->commit());
+  }
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename, opts));
+    verify_series(db.get(), 1, expected);
+  }
+
+  /* reopening with a larger split size merges the small pages on write */
+  {
+    TSDBOptions merge_opts = opts;
+    merge_opts.page_split_size = 8192;
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename, merge_opts));
+    Cursor writer;
+    EXPECT(db->getCursor(1, &writer, false));
+    for (size_t i = 0; i < 2000; ++i) {
+      uint64_t time = rng() % 20000;
+      uint64_t value = rng();
+      writer.insert(time, &value, sizeof(value));
+      expected.emplace(time, value);
+    }
+
+    verify_series(db.get(), 1, expected);
+    EXPECT(db->commit());
+  }
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename, opts));
+  verify_series(db.get(), 1, expected);
+});
+
+TEST_CASE(TSDBTest, TestVectoredCommitWrites, [] () {
+  const char* filename = "/tmp/__test_pwritev.tsdb";
+  const uint64_t num_series = 3000;
+  unlink(filename);
+
+  /* one page per series, so the commit writes runs of more than IOV_MAX
+     contiguous pages */
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename));
+    for (uint64_t s = 1; s <= num_series; ++s) {
+      EXPECT(db->createSeries(s, sizeof(uint64_t), ""));
+      Cursor cursor;
+      EXPECT(db->getCursor(s, &cursor, false));
+      for (uint64_t i = 0; i < s % 10 + 1; ++i) {
+        uint64_t value = s * i;
+        cursor.append(i, &value, sizeof(value));
+      }
+    }
+
+    EXPECT(db->commit());
+  }
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename));
+  for (uint64_t s = 1; s <= num_series; ++s) {
+    Cursor cursor;
+    EXPECT(db->getCursor(s, &cursor));
+    uint64_t n = 0;
+    for (; cursor.valid(); cursor.next()) {
+      uint64_t time;
+      uint64_t value;
+      cursor.get(&time, &value, sizeof(value));
+      EXPECT_EQ(time, n);
+      EXPECT_EQ(value, s * n);
+      ++n;
+    }
+
+    EXPECT_EQ(n, s % 10 + 1);
+  }
+});
+
+static void append_values(TSDB* db, uint64_t begin, uint64_t end) {
+  Cursor cursor;
+  EXPECT(db->getCursor(1, &cursor, false));
+  for (uint64_t i = begin; i < end; ++i) {
+    cursor.append(i, &i, sizeof(i));
+  }
+}
+
+TEST_CASE(TSDBTest, TestTornMetaBlock, [] () {
+  const char* filename = "/tmp/__test_torn.tsdb";
+  unlink(filename);
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename));
+    EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+    append_values(db.get(), 0, 10);
+    EXPECT(db->commit());
+    append_values(db.get(), 10, 20);
+    EXPECT(db->commit());
+  }
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename));
+    EXPECT_EQ(count_series(db.get(), 1), 20);
+  }
+
+  /* the second commit went to the first slot. tearing it falls back to the
+     first commit in the other slot */
+  int fd = open(filename, O_RDWR);
+  EXPECT(fd >= 0);
+  EXPECT_EQ(pwrite(fd, "xx", 2, 6), 2);
+  close(fd);
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename));
+  EXPECT_EQ(count_series(db.get(), 1), 10);
+});
+
+TEST_CASE(TSDBTest, TestUnversionedMetaBlock, [] () {
+  const char* filename = "/tmp/__test_unversioned.tsdb";
+  const size_t meta_size = TSDB::kMetaBlockSize;
+  unlink(filename);
+
+  {
+    std::unique_ptr<TSDB> db;
+    TSDBOptions opts;
+    opts.block_size = 512;
+    EXPECT(TSDB::createDatabase(&db, filename, opts));
+    EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+    append_values(db.get(), 0, 100);
+    EXPECT(db->commit());
+  }
+
+  /* rewrite the file as if it was written before there were metablock slots:
+     a single metablock with the transaction address, size and the file
+     position. the first commit went to the second slot */
+  int fd = open(filename, O_RDWR);
+  EXPECT(fd >= 0);
+  std::string metablock(meta_size, 0);
+  auto rc = pread(fd, &metablock[0], meta_size, meta_size);
+  EXPECT_EQ(rc, ssize_t(meta_size));
+
+  const char* cur = metablock.data() + sizeof(TSDB::kMagicBytes);
+  const char* end = metablock.data() + metablock.size();
+  uint64_t fields[6];
+  for (auto& field : fields) {
+    EXPECT(readVarUInt(&cur, end, &field));
+  }
+
+  EXPECT_EQ(fields[0], TSDB::kMetaBlockVersion);
+  std::string legacy(TSDB::kMagicBytes, sizeof(TSDB::kMagicBytes));
+  writeVarUInt(&legacy, fields[3]);
+  writeVarUInt(&legacy, fields[4]);
+  writeVarUInt(&legacy, fields[5]);
+  legacy.resize(meta_size * 2);
+  rc = pwrite(fd, legacy.data(), legacy.size(), 0);
+  EXPECT_EQ(rc, ssize_t(legacy.size()));
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename));
+    EXPECT_EQ(count_series(db.get(), 1), 100);
+    append_values(db.get(), 100, 200);
+    EXPECT(db->commit());
+    append_values(db.get(), 200, 300);
+    EXPECT(db->commit());
+  }
+
+  /* the second slot may hold page data in unversioned files, so it must
+     never be written */
+  std::string second_slot(meta_size, 1);
+  rc = pread(fd, &second_slot[0], meta_size, meta_size);
+  EXPECT_EQ(rc, ssize_t(meta_size));
+  EXPECT(second_slot == std::string(meta_size, 0));
+  close(fd);
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename));
+  EXPECT_EQ(count_series(db.get(), 1), 300);
+});
+
+static uint64_t get_file_size(const char* filename) {
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return 0;
+  }
+
+  return st.st_size;
+}
+
+TEST_CASE(TSDBTest, TestExtentPreallocation, [] () {
+  const char* filename = "/tmp/__test_extent.tsdb";
+  const uint64_t extent_size = 256 * 1024;
+  unlink(filename);
+
+  TSDBOptions opts;
+  opts.extent_size = extent_size;
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename, opts));
+    EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+    append_values(db.get(), 0, 100);
+    EXPECT(db->commit());
+    EXPECT_EQ(get_file_size(filename), extent_size);
+  }
+
+  /* a reopened database hands out the rest of the preallocated extent
+     before it grows the file */
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename, opts));
+    append_values(db.get(), 100, 200);
+    EXPECT(db->commit());
+    EXPECT_EQ(get_file_size(filename), extent_size);
+
+    for (uint64_t i = 200; i < 200200; i += 10000) {
+      append_values(db.get(), i, i + 10000);
+      EXPECT(db->commit());
+    }
+
+    EXPECT(get_file_size(filename) > extent_size);
+    EXPECT_EQ(get_file_size(filename) % extent_size, 0);
+  }
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename, opts));
+  Cursor cursor;
+  EXPECT(db->getCursor(1, &cursor));
+  uint64_t n = 0;
+  for (; cursor.valid(); cursor.next()) {
+    uint64_t time;
+    uint64_t value;
+    cursor.get(&time, &value, sizeof(value));
+    EXPECT_EQ(time, n);
+    EXPECT_EQ(value, n);
+    ++n;
+  }
+
+  EXPECT_EQ(n, 200200);
+});
+
+static std::string read_file(const char* filename) {
+  std::string data;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return data;
+  }
+
+  char buf[65536];
+  for (;;) {
+    auto rc = read(fd, buf, sizeof(buf));
+    if (rc <= 0) {
+      break;
+    }
+
+    data.append(buf, rc);
+  }
+
+  close(fd);
+  return data;
+}
+
+static void write_commit_test_file(const char* filename, size_t threads) {
+  unlink(filename);
+  std::unique_ptr<TSDB> db;
+  TSDBOptions opts;
+  opts.commit_threads = threads;
+  EXPECT(TSDB::createDatabase(&db, filename, opts));
+
+  for (uint64_t s = 1; s <= 200; ++s) {
+    EXPECT(db->createSeries(s, sizeof(uint64_t), std::to_string(s)));
+  }
+
+  for (uint64_t round = 0; round < 3; ++round) {
+    for (uint64_t s = 1; s <= 200; s += round + 1) {
+      Cursor cursor;
+      EXPECT(db->getCursor(s, &cursor, false));
+      for (uint64_t i = 0; i < s * 10; ++i) {
+        uint64_t value = s ^ i;
+        cursor.append(round * 10000 + i, &value, sizeof(value));
+      }
+    }
+
+    EXPECT(db->commit());
+  }
+}
+
+TEST_CASE(TSDBTest, TestParallelCommitEncoding, [] () {
+  const char* serial_file = "/tmp/__test_encode_serial.tsdb";
+  const char* parallel_file = "/tmp/__test_encode_parallel.tsdb";
+
+  /* the pages are encoded on any number of threads, but written in the same
+     order to the same addresses */
+  write_commit_test_file(serial_file, 1);
+  write_commit_test_file(parallel_file, 8);
+
+  auto serial_data = read_file(serial_file);
+  auto parallel_data = read_file(parallel_file);
+  EXPECT(serial_data.size() > 0);
+  EXPECT(serial_data == parallel_data);
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, parallel_file));
+  EXPECT_EQ(count_series(db.get(), 1), 30);
+  EXPECT_EQ(count_series(db.get(), 199), 1990 * 3);
+  EXPECT_EQ(count_series(db.get(), 200), 2000);
+});
+
+TEST_CASE(TSDBTest, TestDirtyBytes, [] () {
+  const char* filename = "/tmp/__test_dirty.tsdb";
+  unlink(filename);
+  int fd = open(filename, O_CREAT | O_RDWR, 0666);
+  EXPECT(fd >= 0);
+
+  {
+    PageMap page_map(fd, 1024 * 1024);
+    auto page_id = page_map.allocPage(sizeof(uint64_t));
+    EXPECT_EQ(page_map.getDirtyBytes(), 0);
+
+    /* a single modification that fills the page, e.g. a split */
+    page_map.modifyPage(page_id, [] (PageBuffer* buf) {
+      for (uint64_t i = 0; i < 1000; ++i) {
+        buf->append(i, &i, sizeof(i));
+      }
+      return true;
+    });
+
+    PageBufferRef page;
+    EXPECT(page_map.getPage(page_id, &page));
+    EXPECT_EQ(page_map.getDirtyBytes(), page->getEncodedSize());
+    EXPECT(page_map.getDirtyBytes() > 1000 * sizeof(uint64_t));
+
+    PageInfo info;
+    EXPECT(page_map.getPageInfo(page_id, &info));
+    page_map.flushPage(page_id, info.version, 4096, 16384);
+    EXPECT_EQ(page_map.getDirtyBytes(), 0);
+
+    auto other_page_id = page_map.allocPage(sizeof(uint64_t));
+    page_map.modifyPage(other_page_id, [] (PageBuffer* buf) {
+      uint64_t value = 1;
+      buf->append(1, &value, sizeof(value));
+      return true;
+    });
+
+    EXPECT(page_map.getDirtyBytes() > 0);
+    page_map.deletePage(other_page_id);
+    EXPECT_EQ(page_map.getDirtyBytes(), 0);
+    page_map.stopPrefetch();
+  }
+
+  close(fd);
+});
+
+TEST_CASE(TSDBTest, TestCheckpointDirtyBytes, [] () {
+  const char* filename = "/tmp/__test_checkpoint.tsdb";
+  unlink(filename);
+
+  TSDBOptions opts;
+  opts.checkpoint_dirty_bytes = 64 * 1024;
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::createDatabase(&db, filename, opts));
+  EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+  EXPECT(db->commit());
+  append_values(db.get(), 0, 100000);
+
+  /* the checkpointer commits in the background; a second reader of the file
+     eventually sees the values without an explicit commit */
+  uint64_t n = 0;
+  for (size_t i = 0; i < 100 && n == 0; ++i) {
+    usleep(50000);
+    std::unique_ptr<TSDB> reader;
+    EXPECT(TSDB::openDatabase(&reader, filename));
+    n = count_series(reader.get(), 1);
+  }
+
+  EXPECT(n > 0);
+});
+
+static PageBufferRef make_page(uint64_t time) {
+  std::shared_ptr<PageBuffer> page(new PageBuffer(sizeof(uint64_t)));
+  page->append(time, &time, sizeof(time));
+  return page;
+}
+
+TEST_CASE(TSDBTest, TestPageCacheScanResistance, [] () {
+  /* 1000 bytes per shard, all pages below are in the first shard */
+  const size_t shard_stride = 16;
+  PageCache cache(shard_stride * 1000);
+
+  /* pages that are requested again after they were evicted from A1in are
+     promoted to Am */
+  for (size_t round = 0; round < 2; ++round) {
+    for (size_t i = 0; i < 12; ++i) {
+      cache.put(i * shard_stride, 1, make_page(i), 100);
+    }
+  }
+
+  /* a long scan only churns A1in */
+  for (size_t i = 100; i < 1000; ++i) {
+    cache.put(i * shard_stride, 1, make_page(i), 100);
+  }
+
+  size_t hot_pages = 0;
+  for (size_t i = 0; i < 12; ++i) {
+    PageBufferRef page;
+    if (cache.get(i * shard_stride, 1, &page)) {
+      uint64_t time;
+      page->getTimestamp(0, &time);
+      EXPECT_EQ(time, i);
+      ++hot_pages;
+    }
+  }
+
+  EXPECT(hot_pages >= 6);
+  EXPECT(cache.getSize() <= shard_stride * 1000);
+
+  /* a cached page is only returned for the disk address it was read from */
+  PageBufferRef page;
+  EXPECT(cache.get(999 * shard_stride, 1, &page));
+  EXPECT(!cache.get(999 * shard_stride, 2, &page));
+  cache.erase(999 * shard_stride);
+  EXPECT(!cache.get(999 * shard_stride, 1, &page));
+
+  /* pages larger than a shard are not cached */
+  cache.put(1, 1, make_page(1), 2000);
+  EXPECT(!cache.get(1, 1, &page));
+});
+
+TEST_CASE(TSDBTest, TestPageTableConcurrency, [] () {
+  const size_t num_pages = 20000;
+  const size_t num_threads = 4;
+  const uint64_t num_rounds = 20;
+
+  PageMap page_map(-1, 1024 * 1024);
+  std::vector<PageMap::PageIDType> page_ids;
+  for (size_t i = 0; i < num_pages; ++i) {
+    page_ids.push_back(page_map.allocPage(sizeof(uint64_t)));
+  }
+
+  /* every fifth page is deleted while the other pages are modified and read
+     and more pages are allocated */
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] (size_t thread_id) {
+      for (uint64_t round = 0; round < num_rounds; ++round) {
+        for (size_t i = thread_id; i < num_pages; i += num_threads) {
+          if (i % 5 == 4) {
+            continue;
+          }
+
+          page_map.modifyPage(page_ids[i], [round] (PageBuffer* buf) {
+            buf->append(round, &round, sizeof(round));
+            return true;
+          });
+
+          PageBufferRef page;
+          page_map.getPage(page_ids[(i * 7) % num_pages], &page);
+        }
+      }
+    }, t);
+  }
+
+  std::vector<PageMap::PageIDType> new_page_ids;
+  threads.emplace_back([&] () {
+    for (size_t i = 4; i < num_pages; i += 5) {
+      page_map.deletePage(page_ids[i]);
+      new_page_ids.push_back(page_map.allocPage(sizeof(uint64_t)));
+    }
+  });
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < num_pages; ++i) {
+    PageInfo info;
+    if (i % 5 == 4) {
+      EXPECT(!page_map.getPageInfo(page_ids[i], &info));
+      continue;
+    }
+
+    PageBufferRef page;
+    EXPECT(page_map.getPage(page_ids[i], &page));
+    EXPECT_EQ(page->getSize(), num_rounds);
+    for (uint64_t round = 0; round < num_rounds; ++round) {
+      uint64_t time;
+      page->getTimestamp(round, &time);
+      EXPECT_EQ(time, round);
+    }
+  }
+
+  std::set<PageMap::PageIDType> all_page_ids(page_ids.begin(), page_ids.end());
+  all_page_ids.insert(new_page_ids.begin(), new_page_ids.end());
+  EXPECT_EQ(all_page_ids.size(), page_ids.size() + new_page_ids.size());
+  page_map.stopPrefetch();
+});
+
+static void append_to_page(PageMap* page_map, PageMap::PageIDType page_id) {
+  page_map->modifyPage(page_id, [] (PageBuffer* buf) {
+    uint64_t time = buf->getSize();
+    buf->append(time, &time, sizeof(time));
+    return true;
+  });
+}
+
+TEST_CASE(TSDBTest, TestPinnedPageVersions, [] () {
+  PageMap page_map(-1, 1024 * 1024);
+  auto page_id = page_map.allocPage(sizeof(uint64_t));
+  append_to_page(&page_map, page_id);
+
+  /* a pinned version is never modified, writers modify a copy */
+  PageBufferRef pinned;
+  uint64_t pinned_version;
+  EXPECT(page_map.getPage(page_id, &pinned, &pinned_version));
+  EXPECT_EQ(pinned->getSize(), 1);
+
+  append_to_page(&page_map, page_id);
+  EXPECT_EQ(pinned->getSize(), 1);
+
+  PageBufferRef current;
+  uint64_t current_version;
+  EXPECT(page_map.getPage(page_id, &current, &current_version));
+  EXPECT_EQ(current->getSize(), 2);
+  EXPECT(current_version > pinned_version);
+  EXPECT(current.get() != pinned.get());
+
+  /* once the last pin is dropped, the page is modified in place */
+  auto current_buffer = current.get();
+  current.reset();
+  append_to_page(&page_map, page_id);
+  EXPECT(page_map.getPage(page_id, &current));
+  EXPECT_EQ(current->getSize(), 3);
+  EXPECT(current.get() == current_buffer);
+
+  /* pinned versions outlive the page */
+  page_map.deletePage(page_id);
+  EXPECT(!page_map.getPage(page_id, &current));
+  EXPECT_EQ(pinned->getSize(), 1);
+  uint64_t time;
+  pinned->getTimestamp(0, &time);
+  EXPECT_EQ(time, 0);
+  page_map.stopPrefetch();
+});
+
+TEST_CASE(TSDBTest, TestPinnedVersionChain, [] () {
+  PageMap page_map(-1, 1024 * 1024);
+  PageIndex page_index(sizeof(uint64_t), "");
+  std::shared_ptr<PageIndexVersion> first(new PageIndexVersion());
+  first->entries.emplace_back(PageIndexEntry{page_map.allocPage(8)});
+  page_index.setVersion(first, &page_map);
+
+  /* a reader pins the first version while the page is split and merged
+     again many times, which chains every later version to it */
+  auto pinned = page_index.getVersion();
+  first.reset();
+
+  std::vector<size_t> retired;
+  for (size_t i = 0; i < 200000; ++i) {
+    auto cur = page_index.getVersion();
+    std::shared_ptr<PageIndexVersion> version(new PageIndexVersion());
+    for (size_t j = cur->entries.size() == 1 ? 2 : 1; j > 0; --j) {
+      version->entries.emplace_back(PageIndexEntry{page_map.allocPage(8)});
+    }
+
+    if (version->entries.size() == 2) {
+      version->splitpoints.emplace_back(PageIndexSplitpoint{100});
+    }
+
+    for (const auto& e : cur->entries) {
+      retired.emplace_back(e.page_id);
+    }
+
+    page_index.setVersion(version, &page_map);
+  }
+
+  PageBufferRef page;
+  EXPECT(page_map.getPage(retired.front(), &page));
+  EXPECT(page_map.getPage(retired.back(), &page));
+
+  /* releasing the pin frees the whole chain and deletes the retired pages */
+  pinned.reset();
+  for (auto page_id : retired) {
+    EXPECT(!page_map.getPage(page_id, &page));
+  }
+
+  auto cur = page_index.getVersion();
+  for (const auto& e : cur->entries) {
+    EXPECT(page_map.getPage(e.page_id, &page));
+  }
+
+  page_map.stopPrefetch();
+});
+
+TEST_CASE(TSDBTest, TestUnmergeablePage, [] () {
+  const size_t split_size = 4096;
+  PageMap page_map(-1, 1024 * 1024);
+  PageIndex page_index(sizeof(uint64_t), "");
+
+  /* a small page between two pages that are too big to merge with it */
+  auto fill_page = [&] (uint64_t begin, uint64_t end) {
+    auto page_id = page_map.allocPage(sizeof(uint64_t));
+    page_map.modifyPage(page_id, [begin, end] (PageBuffer* buf) {
+      for (uint64_t time = begin; time < end; ++time) {
+        uint64_t value = time * 0x9e3779b97f4a7c15;
+        buf->append(time, &value, sizeof(value));
+      }
+
+      return true;
+    });
+
+    return page_id;
+  };
+
+  std::shared_ptr<PageIndexVersion> version(new PageIndexVersion());
+  version->entries.emplace_back(PageIndexEntry{fill_page(0, 1000)});
+  version->entries.emplace_back(PageIndexEntry{fill_page(1000, 1001)});
+  version->entries.emplace_back(PageIndexEntry{fill_page(2000, 3000)});
+  version->splitpoints.emplace_back(PageIndexSplitpoint{1000});
+  version->splitpoints.emplace_back(PageIndexSplitpoint{2000});
+  auto small_page_id = version->entries[1].page_id;
+  page_index.setVersion(version, &page_map);
+  version.reset();
+
+  Cursor cursor(
+      &page_map,
+      Transaction(&page_index, &page_map, false),
+      split_size);
+
+  /* the failed merge is remembered, so later writes to the page don't read
+     the neighbours again */
+  uint64_t value = 1;
+  cursor.append(1500, &value, sizeof(value));
+  auto current = page_index.getVersion();
+  EXPECT_EQ(current->entries.size(), 3);
+  EXPECT(current->isUnmergeable(small_page_id));
+  cursor.append(1501, &value, sizeof(value));
+  EXPECT(page_index.getVersion() == current);
+
+  /* a split of a neighbour publishes a new version that tries again */
+  uint64_t time = 3000;
+  while (page_index.getVersion() == current) {
+    cursor.append(time++, &value, sizeof(value));
+  }
+
+  current = page_index.getVersion();
+  EXPECT_EQ(current->entries.size(), 4);
+  EXPECT(!current->isUnmergeable(small_page_id));
+  page_map.stopPrefetch();
+});
+
+TEST_CASE(TSDBTest, TestCursorReadsPinnedVersion, [] () {
+  const char* filename = "/tmp/__test_pinned.tsdb";
+  unlink(filename);
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::createDatabase(&db, filename));
+  EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+  append_values(db.get(), 0, 10);
+
+  /* the reader keeps reading the page as it was when it was positioned on
+     it, even though the writer modifies and commits it */
+  Cursor reader;
+  EXPECT(db->getCursor(1, &reader));
+  EXPECT(reader.valid());
+  EXPECT_EQ(reader.getTime(), 0);
+
+  append_values(db.get(), 10, 20);
+  EXPECT(db->commit());
+
+  uint64_t n = 0;
+  for (; reader.valid(); reader.next()) {
+    EXPECT_EQ(reader.getTime(), n);
+    ++n;
+  }
+
+  EXPECT_EQ(n, 10);
+  EXPECT_EQ(count_series(db.get(), 1), 20);
+});
+
+TEST_CASE(TSDBTest, TestPageBufferValueBlock, [] () {
+  /* pages are encoded as the number of values, the varint timestamps and
+     then all values back to back in one block */
+  const size_t value_size = 12;
+  std::string encoded;
+  writeVarUInt(&encoded, 300);
+  std::string value_block;
+  for (uint64_t i = 0; i < 300; ++i) {
+    writeVarUInt(&encoded, i * 1000);
+    for (size_t j = 0; j < value_size; ++j) {
+      value_block += char(i + j);
+    }
+  }
+
+  encoded += value_block;
+
+  /* pages read from disk are padded to the block size */
+  std::string padded = encoded;
+  padded.resize(padded.size() + 100);
+
+  PageBuffer page(value_size);
+  EXPECT(page.decode(padded.data(), padded.size()));
+  EXPECT_EQ(page.getSize(), 300);
+  for (size_t i = 0; i < 300; ++i) {
+    uint64_t time;
+    char value[value_size];
+    page.getTimestamp(i, &time);
+    page.getValue(i, value, value_size);
+    EXPECT_EQ(time, i * 1000);
+    EXPECT(memcmp(value, value_block.data() + i * value_size, value_size) == 0);
+  }
+
+  std::string reencoded;
+  page.encode(&reencoded);
+  EXPECT(reencoded == encoded);
+  EXPECT_EQ(page.getEncodedSize(), encoded.size());
+
+  /* a truncated value block is rejected */
+  PageBuffer truncated(value_size);
+  EXPECT(!truncated.decode(encoded.data(), encoded.size() - 1));
+});
+
+using PageValues = std::vector<std::pair<uint64_t, uint64_t>>;
+
+static void insert_reference(
+    PageValues* values,
+    uint64_t time,
+    uint64_t value) {
+  auto iter = std::lower_bound(
+      values->begin(),
+      values->end(),
+      time,
+      [] (const SeriesValue& v, uint64_t t) { return v.first < t; });
+
+  values->emplace(iter, time, value);
+}
+
+static void check_page(const PageBuffer& page, const PageValues& expected) {
+  EXPECT_EQ(page.getSize(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    uint64_t time;
+    uint64_t value;
+    page.getTimestamp(i, &time);
+    page.getValue(i, &value, sizeof(value));
+    EXPECT_EQ(time, expected[i].first);
+    EXPECT_EQ(value, expected[i].second);
+  }
+}
+
+TEST_CASE(TSDBTest, TestPageBufferOutOfOrder, [] () {
+  std::mt19937 rng(42);
+  for (size_t round = 0; round < 200; ++round) {
+    PageBuffer page(sizeof(uint64_t));
+    PageValues expected;
+    size_t num_values = rng() % 2000;
+    for (size_t i = 0; i < num_values; ++i) {
+      uint64_t time = rng() % 4 == 0 ? rng() % 500 : 500 + i;
+      uint64_t value = rng();
+
+      /* late values go before existing values with the same timestamp,
+         appends of the newest timestamp go after them */
+      if (rng() % 2 == 0) {
+        page.insert(time, &value, sizeof(value));
+        insert_reference(&expected, time, value);
+      } else {
+        page.append(time, &value, sizeof(value));
+        if (expected.empty() || time >= expected.back().first) {
+          expected.emplace_back(time, value);
+        } else {
+          insert_reference(&expected, time, value);
+        }
+      }
+
+      if (rng() % 100 == 0 && page.getSize() > 0) {
+        size_t pos = rng() % page.getSize();
+        uint64_t new_value = rng();
+        page.update(pos, &new_value, sizeof(new_value));
+        expected[pos].second = new_value;
+      }
+    }
+
+    check_page(page, expected);
+
+    /* copying a range of a page with late values copies the merged order */
+    PageBuffer copy(sizeof(uint64_t));
+    copy.appendRange(page, 0, page.getSize());
+    check_page(copy, expected);
+
+    /* encoding writes the merged order without modifying the page */
+    std::string encoded;
+    page.encode(&encoded);
+    PageBuffer decoded(sizeof(uint64_t));
+    EXPECT(decoded.decode(encoded.data(), encoded.size()));
+    check_page(decoded, expected);
+
+    page.seal();
+    check_page(page, expected);
+  }
+});
+
+TEST_CASE(TSDBTest, TestParallelLoad, [] () {
+  const char* filename = "/tmp/__test_load.tsdb";
+  const uint64_t num_series = 5000;
+  unlink(filename);
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename));
+    for (uint64_t s = 1; s <= num_series; ++s) {
+      EXPECT(db->createSeries(s, sizeof(uint64_t), std::to_string(s)));
+      Cursor cursor;
+      EXPECT(db->getCursor(s, &cursor, false));
+      for (uint64_t i = 0; i < s % 5; ++i) {
+        cursor.append(i, &s, sizeof(s));
+      }
+    }
+
+    EXPECT(db->commit());
+  }
+
+  for (size_t load_threads = 1; load_threads <= 16; load_threads *= 4) {
+    TSDBOptions opts;
+    opts.preload_series = true;
+    opts.load_threads = load_threads;
+
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename, opts));
+    std::set<uint64_t> series_ids;
+    EXPECT(db->listSeries(&series_ids));
+    EXPECT_EQ(series_ids.size(), num_series);
+
+    for (uint64_t s = 1; s <= num_series; ++s) {
+      std::string metadata;
+      EXPECT(db->getSeriesMetadata(s, &metadata));
+      EXPECT_EQ(metadata, std::to_string(s));
+      EXPECT_EQ(count_series(db.get(), s), s % 5);
+    }
+  }
+});
+
+static void check_lazy_series(TSDB* db, uint64_t num_series) {
+  std::set<uint64_t> series_ids;
+  EXPECT(db->listSeries(&series_ids));
+  EXPECT_EQ(series_ids.size(), num_series);
+
+  for (uint64_t s = 1; s <= num_series; ++s) {
+    std::string metadata;
+    EXPECT(db->getSeriesMetadata(s, &metadata));
+    EXPECT_EQ(metadata, std::to_string(s));
+
+    Cursor cursor;
+    EXPECT(db->getCursor(s, &cursor));
+    uint64_t n = 0;
+    for (; cursor.valid(); cursor.next()) {
+      uint64_t time;
+      uint64_t value;
+      cursor.get(&time, &value, sizeof(value));
+      EXPECT_EQ(time, n);
+      EXPECT_EQ(value, s + n);
+      ++n;
+    }
+
+    EXPECT_EQ(n, s % 7 + 1 + (s == 42 ? 1 : 0));
+  }
+}
+
+TEST_CASE(TSDBTest, TestSharedScheduler, [] () {
+  std::string filenames[2];
+  filenames[0] = "/tmp/__test_sched_a.tsdb";
+  filenames[1] = "/tmp/__test_sched_b.tsdb";
+
+  zdb::scheduler_options sched_opts;
+  sched_opts.threads = 2;
+  zdb::scheduler_ref sched;
+  EXPECT_SUCCESS(zdb::scheduler_init(sched_opts, &sched));
+
+  TSDBOptions opts;
+  opts.scheduler = sched;
+  opts.preload_series = true;
+
+  /* two databases commit on the same scheduler at the same time, one of them
+     from a task of the scheduler itself */
+  std::unique_ptr<TSDB> dbs[2];
+  for (size_t d = 0; d < 2; ++d) {
+    unlink(filenames[d].c_str());
+    EXPECT(TSDB::createDatabase(&dbs[d], filenames[d], opts));
+    for (uint64_t s = 1; s <= 100; ++s) {
+      EXPECT(dbs[d]->createSeries(s, sizeof(uint64_t), ""));
+      Cursor cursor;
+      EXPECT(dbs[d]->getCursor(s, &cursor, false));
+      for (uint64_t i = 0; i < s * 10 + d; ++i) {
+        cursor.append(i, &i, sizeof(i));
+      }
+    }
+  }
+
+  std::atomic<bool> committed(false);
+  sched->submit([&] () {
+    EXPECT(dbs[0]->commit());
+    committed = true;
+  });
+
+  EXPECT(dbs[1]->commit());
+  sched->run_until([&] () { return committed.load(); });
+
+  for (size_t d = 0; d < 2; ++d) {
+    dbs[d].reset();
+    EXPECT(TSDB::openDatabase(&dbs[d], filenames[d], opts));
+    for (uint64_t s = 1; s <= 100; s += 33) {
+      EXPECT_EQ(count_series(dbs[d].get(), s), s * 10 + d);
+    }
+  }
+});
+
+TEST_CASE(TSDBTest, TestLazySeriesLoading, [] () {
+  const char* filename = "/tmp/__test_lazy.tsdb";
+  const uint64_t num_series = 3000;
+  unlink(filename);
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename));
+    for (uint64_t s = 1; s < num_series; ++s) {
+      EXPECT(db->createSeries(s, sizeof(uint64_t), std::to_string(s)));
+      Cursor cursor;
+      EXPECT(db->getCursor(s, &cursor, false));
+      for (uint64_t i = 0; i < s % 7 + 1; ++i) {
+        uint64_t value = s + i;
+        cursor.append(i, &value, sizeof(value));
+      }
+    }
+
+    EXPECT(db->commit());
+  }
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename));
+
+    /* series that were not loaded yet still exist */
+    EXPECT(!db->createSeries(5, sizeof(uint64_t), ""));
+
+    /* concurrent first accesses to the same series */
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+      threads.emplace_back([&] () {
+        for (uint64_t s = 100; s < 200; ++s) {
+          Cursor cursor;
+          EXPECT(db->getCursor(s, &cursor));
+          EXPECT(cursor.valid());
+        }
+      });
+    }
+
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    /* commit with most series still unloaded */
+    {
+      Cursor cursor;
+      EXPECT(db->getCursor(42, &cursor, false, TSDB::SEEK_NONE));
+      uint64_t value = 42 + 1;
+      cursor.append(1, &value, sizeof(value));
+    }
+
+    EXPECT(db->createSeries(num_series, sizeof(uint64_t), "3000"));
+    {
+      Cursor cursor;
+      EXPECT(db->getCursor(num_series, &cursor, false));
+      for (uint64_t i = 0; i < num_series % 7 + 1; ++i) {
+        uint64_t value = num_series + i;
+        cursor.append(i, &value, sizeof(value));
+      }
+    }
+
+    EXPECT(db->commit());
+    check_lazy_series(db.get(), num_series);
+  }
+
+  for (size_t preload = 0; preload < 2; ++preload) {
+    TSDBOptions opts;
+    opts.preload_series = preload == 1;
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::openDatabase(&db, filename, opts));
+    check_lazy_series(db.get(), num_series);
+  }
+});
+
+TEST_CASE(TSDBTest, TestTruncatedFixedTransaction, [] () {
+  const char* filename = "/tmp/__test_truncated.tsdb";
+  const size_t meta_size = TSDB::kMetaBlockSize;
+  unlink(filename);
+
+  /* enough series that the transaction spans several memory pages */
+  {
+    std::unique_ptr<TSDB> db;
+    TSDBOptions opts;
+    opts.fixed_layout = true;
+    EXPECT(TSDB::createDatabase(&db, filename, opts));
+    for (uint64_t s = 1; s <= 2000; ++s) {
+      EXPECT(db->createSeries(s, sizeof(uint64_t), ""));
+    }
+
+    EXPECT(db->commit());
+  }
+
+  /* the first commit went to the second slot */
+  int fd = open(filename, O_RDWR);
+  EXPECT(fd >= 0);
+  std::string metablock(meta_size, 0);
+  auto rc = pread(fd, &metablock[0], meta_size, meta_size);
+  EXPECT_EQ(rc, ssize_t(meta_size));
+
+  const char* cur = metablock.data() + sizeof(TSDB::kMagicBytes);
+  const char* end = metablock.data() + metablock.size();
+  uint64_t fields[6];
+  for (auto& field : fields) {
+    EXPECT(readVarUInt(&cur, end, &field));
+  }
+
+  auto txn_addr = fields[3];
+  auto txn_size = fields[4];
+  EXPECT(txn_size > 3 * 4096);
+  EXPECT_EQ(ftruncate(fd, txn_addr + 4096), 0);
+  close(fd);
+
+  for (size_t preload = 0; preload < 2; ++preload) {
+    TSDBOptions opts;
+    opts.preload_series = preload == 1;
+    std::unique_ptr<TSDB> db;
+    EXPECT(!TSDB::openDatabase(&db, filename, opts));
+  }
+});
+
+TEST_CASE(TSDBTest, TestColdPages, [] () {
+  const char* filename = "/tmp/__test_cold.dat";
+  const size_t num_pages = 5000;
+  const size_t num_threads = 4;
+  unlink(filename);
+  int fd = open(filename, O_CREAT | O_RDWR, 0666);
+  EXPECT(fd >= 0);
+
+  /* write one encoded page per 512 bytes */
+  std::vector<uint64_t> page_addrs;
+  std::vector<uint64_t> page_sizes;
+  for (uint64_t i = 0; i < num_pages; ++i) {
+    PageBuffer page(sizeof(uint64_t));
+    page.append(1, &i, sizeof(i));
+    std::string encoded;
+    page.encode(&encoded);
+
+    auto addr = 4096 + i * 512;
+    auto rc = pwrite(fd, encoded.data(), encoded.size(), addr);
+    EXPECT_EQ(rc, ssize_t(encoded.size()));
+    page_addrs.push_back(addr);
+    page_sizes.push_back(encoded.size());
+  }
+
+  PageMap page_map(fd, 64 * 1024);
+  std::vector<PageMap::PageIDType> page_ids;
+  for (size_t i = 0; i < num_pages; ++i) {
+    page_ids.push_back(
+        page_map.addColdPage(sizeof(uint64_t), page_addrs[i], page_sizes[i]));
+  }
+
+  PageInfo info;
+  EXPECT(page_map.getPageInfo(page_ids[1], &info));
+  EXPECT(!info.is_dirty);
+  EXPECT_EQ(info.disk_addr, page_addrs[1]);
+  EXPECT_EQ(info.disk_size, page_sizes[1]);
+
+  /* readers, writers that upgrade the cold records to full entries and a
+     thread that deletes every other page race on the same pages */
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] (size_t thread_id) {
+      do {
+        for (size_t i = thread_id; i < num_pages; i += num_threads + 1) {
+          PageBufferRef page;
+          if (page_map.getPage(page_ids[i], &page)) {
+            uint64_t time;
+            uint64_t value;
+            page->getTimestamp(0, &time);
+            page->getValue(0, &value, sizeof(value));
+            EXPECT_EQ(time, 1);
+            EXPECT_EQ(value, i);
+          }
+
+          if (i % 3 == 0) {
+            page_map.modifyPage(page_ids[i], [] (PageBuffer* buf) {
+              uint64_t value = 7;
+              buf->append(2, &value, sizeof(value));
+              return true;
+            });
+          }
+        }
+      } while (!done);
+    }, t);
+  }
+
+  for (size_t i = 0; i < num_pages; i += 2) {
+    page_map.deletePage(page_ids[i]);
+    usleep(10);
+  }
+
+  done = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (size_t i = 0; i < num_pages; ++i) {
+    EXPECT_EQ(page_map.getPageInfo(page_ids[i], &info), i % 2 == 1);
+  }
+
+  /* an untouched cold page is still clean, a modified one is dirty */
+  EXPECT(page_map.getPageInfo(page_ids[1], &info));
+  EXPECT(!info.is_dirty);
+  EXPECT(page_map.getPageInfo(page_ids[3], &info));
+  EXPECT(info.is_dirty);
+
+  page_map.stopPrefetch();
+  close(fd);
+});
+
+TEST_CASE(TSDBTest, TestPageCachePrefetch, [] () {
+  const size_t shard_stride = 16;
+
+  /* evict page 0 from A1in so that it has a ghost entry */
+  for (size_t promote = 0; promote < 2; ++promote) {
+    PageCache cache(shard_stride * 1000);
+    cache.put(0, 1, make_page(0), 100);
+    for (size_t i = 1; i < 20; ++i) {
+      cache.put(i * shard_stride, 1, make_page(i), 100);
+    }
+
+    PageBufferRef page;
+    EXPECT(!cache.get(0, 1, &page));
+
+    /* a prefetch doesn't count as a reference and leaves the page in A1in.
+       the first real reference promotes it to Am */
+    cache.put(0, 1, make_page(0), 100, false);
+    EXPECT(cache.get(0, 1, &page, promote == 1));
+
+    for (size_t i = 100; i < 1000; ++i) {
+      cache.put(i * shard_stride, 1, make_page(i), 100);
+    }
+
+    EXPECT_EQ(cache.get(0, 1, &page), promote == 1);
+  }
+});
+
+TEST_CASE(TSDBTest, TestCursorReadahead, [] () {
+  const char* filename = "/tmp/__test_readahead.tsdb";
+  unlink(filename);
+
+  TSDBOptions opts;
+  opts.page_split_size = 1024;
+
+  {
+    std::unique_ptr<TSDB> db;
+    EXPECT(TSDB::createDatabase(&db, filename, opts));
+    EXPECT(db->createSeries(1, sizeof(uint64_t), ""));
+    append_values(db.get(), 0, 50000);
+    EXPECT(db->commit());
+  }
+
+  std::unique_ptr<TSDB> db;
+  EXPECT(TSDB::openDatabase(&db, filename, opts));
+  for (size_t caching = 0; caching < 2; ++caching) {
+    Cursor cursor;
+    EXPECT(db->getCursor(1, &cursor, true, TSDB::SEEK_NONE));
+    cursor.setCaching(caching == 1);
+    cursor.setReadahead(8);
+    EXPECT(cursor.seekToFirst());
+
+    uint64_t n = 0;
+    for (; cursor.valid(); cursor.next()) {
+      uint64_t time;
+      uint64_t value;
+      cursor.get(&time, &value, sizeof(value));
+      EXPECT_EQ(time, n);
+      EXPECT_EQ(value, n);
+      ++n;
+    }
+
+    EXPECT_EQ(n, 50000);
+  }
+});
+